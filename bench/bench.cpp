@@ -0,0 +1,287 @@
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "common_types.h"
+#include "fill_allocator.h"
+#include "interner.h"
+#include "market.h"
+#include "orderbook.h"
+#include "order_parser.h"
+#include "order_queue.h"
+#include "price_ladder.h"
+
+// Microbenchmarks of the matching engine's hot paths, parameterised by book depth and order count.
+// Each benchmark is instantiated for the level and ladder containers worth comparing, so that
+// a change to a data structure shows up as a change in items_per_second.
+
+namespace {
+	// Counts fills, so that the compiler cannot discard the matching work.
+	struct TradeCounter {
+		std::size_t trades = 0;
+		void HandleTradeEvent(const Side, const Price, const Quantity, const Order&, const PriorityKey&) {
+			++trades;
+		}
+	};
+
+	struct OrderCounter {
+		std::size_t orders = 0;
+		void HandleFullOrderDetail(const FullOrderDetail&) {
+			++orders;
+		}
+	};
+
+	// Deterministic pseudo-random numbers, identical on every platform.
+	struct Lcg {
+		unsigned long long state;
+		unsigned long long Next(const unsigned long long bound) {
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			return (state >> 33) % bound;
+		}
+	};
+
+	constexpr Price kTouch = 100000;
+
+	using TimePriority = PriorityKey::TimeStampComparator;
+
+	template<typename Comparator, typename Ladder>
+	using Book = Orderbook<Comparator, GreedyFillAllocator, TradeCounter, Ladder>;
+
+	// `orders` sell orders spread round-robin over `depth` price levels from the touch upwards, in time order.
+	std::vector<Order> MakeLadderOfSells(const std::size_t depth, const std::size_t orders) {
+		std::vector<Order> sells;
+		sells.reserve(orders);
+		for (std::size_t i = 0; i < orders; ++i) {
+			sells.push_back({ kTouch + (i % depth), 10, { i, i } });
+		}
+		return sells;
+	}
+}
+
+// Orders resting into a book they do not cross: the matching check, then the level lookup and append.
+template<typename Comparator, typename Ladder>
+void BM_RestInserts(benchmark::State& state) {
+	const auto depth = static_cast<std::size_t>(state.range(0));
+	const auto orders = static_cast<std::size_t>(state.range(1));
+	const auto sells = MakeLadderOfSells(depth, orders);
+	GreedyFillAllocator fill_allocator;
+	TradeCounter trade_counter;
+
+	for (auto _ : state) {
+		state.PauseTiming();
+		auto book = std::make_unique<Book<Comparator, Ladder>>();
+		state.ResumeTiming();
+
+		for (Order order : sells) {
+			book->Sell(fill_allocator, trade_counter, order);
+		}
+
+		state.PauseTiming();
+		book.reset();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(static_cast<long long>(state.iterations() * orders));
+}
+
+// One aggressor sweeping every level of a book of `levels` levels with `orders_per_level` orders each.
+template<typename Comparator, typename Ladder>
+void BM_SweepLevels(benchmark::State& state) {
+	const auto levels = static_cast<std::size_t>(state.range(0));
+	const auto orders_per_level = static_cast<std::size_t>(state.range(1));
+	const auto sells = MakeLadderOfSells(levels, levels * orders_per_level);
+	GreedyFillAllocator fill_allocator;
+	TradeCounter trade_counter;
+
+	for (auto _ : state) {
+		state.PauseTiming();
+		auto book = std::make_unique<Book<Comparator, Ladder>>();
+		for (Order order : sells) {
+			book->Sell(fill_allocator, trade_counter, order);
+		}
+		Order sweep{ kTouch + levels, 10 * sells.size(), { sells.size(), sells.size() } };
+		state.ResumeTiming();
+
+		benchmark::DoNotOptimize(book->Buy(fill_allocator, trade_counter, sweep));
+
+		state.PauseTiming();
+		book.reset();
+		state.ResumeTiming();
+	}
+	benchmark::DoNotOptimize(trade_counter.trades);
+	state.SetItemsProcessed(static_cast<long long>(state.iterations() * sells.size()));
+}
+
+// GreedyFillAllocator::Fill consuming a single level of `orders` resting orders.
+template<typename Comparator>
+void BM_FillDeepLevel(benchmark::State& state) {
+	const auto orders = static_cast<std::size_t>(state.range(0));
+	GreedyFillAllocator fill_allocator;
+	TradeCounter trade_counter;
+
+	for (auto _ : state) {
+		state.PauseTiming();
+		auto level = std::make_unique<typename PriorityLevel<Comparator>::type>();
+		for (std::size_t i = 0; i < orders; ++i) {
+			level->emplace(PriorityKey{ i, i }, 10);
+		}
+		Order aggressor{ kTouch, 10 * orders, { orders, orders } };
+		state.ResumeTiming();
+
+		fill_allocator.Fill(Side::Buy, kTouch, aggressor, *level, trade_counter);
+
+		state.PauseTiming();
+		level.reset();
+		state.ResumeTiming();
+	}
+	benchmark::DoNotOptimize(trade_counter.trades);
+	state.SetItemsProcessed(static_cast<long long>(state.iterations() * orders));
+}
+
+// A random stream of buys and sells around one price, spread over `instruments` orderbooks.
+// About half of the orders trade, so the books stay shallow and the cost is dominated by routing and matching.
+template<typename Comparator, typename Ladder>
+void BM_MarketRouting(benchmark::State& state) {
+	const auto instruments = static_cast<Instrument>(state.range(0));
+	const auto orders = static_cast<std::size_t>(state.range(1));
+
+	struct Entry {
+		Side side;
+		Instrument instrument;
+		Order order;
+	};
+	std::vector<Entry> entries;
+	entries.reserve(orders);
+	Lcg lcg{ 42 };
+	for (std::size_t i = 0; i < orders; ++i) {
+		const auto side = (0 == lcg.Next(2)) ? Side::Buy : Side::Sell;
+		const auto instrument = static_cast<Instrument>(lcg.Next(instruments));
+		const Price price = kTouch - 8 + lcg.Next(16);
+		entries.push_back({ side, instrument, { price, 1 + lcg.Next(10), { i, i } } });
+	}
+	GreedyFillAllocator fill_allocator;
+	TradeCounter trade_counter;
+
+	for (auto _ : state) {
+		state.PauseTiming();
+		auto market = std::make_unique<Market<Comparator, GreedyFillAllocator, TradeCounter, Ladder>>(fill_allocator, trade_counter);
+		for (Instrument instrument = 0; instrument < instruments; ++instrument) {
+			market->AddInstrument(instrument);
+		}
+		state.ResumeTiming();
+
+		for (Entry entry : entries) {
+			if (Side::Buy == entry.side) {
+				market->Buy(entry.instrument, entry.order);
+			}
+			else {
+				market->Sell(entry.instrument, entry.order);
+			}
+		}
+
+		state.PauseTiming();
+		market.reset();
+		state.ResumeTiming();
+	}
+	benchmark::DoNotOptimize(trade_counter.trades);
+	state.SetItemsProcessed(static_cast<long long>(state.iterations() * orders));
+}
+
+// Snapshot of every resting order in time order, over `instruments` books holding `orders` orders in all.
+template<typename Comparator, typename Ladder>
+void BM_ForEachOrderByTime(benchmark::State& state) {
+	const auto instruments = static_cast<Instrument>(state.range(0));
+	const auto orders = static_cast<std::size_t>(state.range(1));
+	GreedyFillAllocator fill_allocator;
+	TradeCounter trade_counter;
+	Market<Comparator, GreedyFillAllocator, TradeCounter, Ladder> market(fill_allocator, trade_counter);
+	Lcg lcg{ 7 };
+	for (std::size_t i = 0; i < orders; ++i) {
+		// Bids below and offers above the touch, so that nothing trades
+		Order order{ kTouch, 10, { i, i } };
+		const auto instrument = static_cast<Instrument>(lcg.Next(instruments));
+		if (0 == lcg.Next(2)) {
+			order.price -= 1 + lcg.Next(64);
+			market.Buy(instrument, order);
+		}
+		else {
+			order.price += 1 + lcg.Next(64);
+			market.Sell(instrument, order);
+		}
+	}
+
+	for (auto _ : state) {
+		OrderCounter order_counter;
+		market.ForEachOrderByTime(order_counter);
+		benchmark::DoNotOptimize(order_counter.orders);
+	}
+	state.SetItemsProcessed(static_cast<long long>(state.iterations() * orders));
+}
+
+// Text gateway throughput: lines of new orders (a few of them market, IOC or FOK), cancels and amends,
+// of `ids` distinct order ids over 64 instruments. Names are interned on the first pass,
+// so the steady state is tokenizing, number conversion and name lookups.
+void BM_ParseLine(benchmark::State& state) {
+	const auto ids = static_cast<unsigned long long>(state.range(0));
+	const auto lines = static_cast<std::size_t>(state.range(1));
+	std::vector<std::string> text;
+	text.reserve(lines);
+	Lcg lcg{ 11 };
+	for (std::size_t i = 0; i < lines; ++i) {
+		const auto id = "ORD" + std::to_string(lcg.Next(ids));
+		const auto quantity = std::to_string(1 + lcg.Next(100));
+		const auto price = std::to_string(kTouch - 50 + lcg.Next(100));
+		switch (lcg.Next(10)) {
+		case 0:
+			text.push_back(id + " CANCEL");
+			break;
+		case 1:
+			text.push_back(id + " AMEND " + quantity + " " + price);
+			break;
+		case 2:
+			text.push_back(id + " BUY SYM" + std::to_string(lcg.Next(64)) + " " + quantity + " MKT IOC");
+			break;
+		case 3:
+			text.push_back(id + " SELL SYM" + std::to_string(lcg.Next(64)) + " " + quantity + " " + price + " FOK");
+			break;
+		default:
+			text.push_back(id + ((0 == lcg.Next(2)) ? " BUY SYM" : " SELL SYM") + std::to_string(lcg.Next(64)) + " " + quantity + " " + price);
+			break;
+		}
+	}
+	NameTables names;
+	OrderMessage message{};
+	TimeStamp timestamp = 0;
+	std::size_t errors = 0;
+
+	for (auto _ : state) {
+		for (const auto& line : text) {
+			errors += (ParseError::None == ParseLineToOrderParams(++timestamp, line, names, message)) ? 0 : 1;
+		}
+		benchmark::DoNotOptimize(message);
+	}
+	benchmark::DoNotOptimize(errors);
+	state.SetItemsProcessed(static_cast<long long>(state.iterations() * lines));
+}
+
+BENCHMARK_TEMPLATE(BM_RestInserts, TimePriority, MapLadder)->ArgsProduct({ { 1, 16, 256, 4096 }, { 1 << 14 } });
+BENCHMARK_TEMPLATE(BM_RestInserts, FifoPriority, MapLadder)->ArgsProduct({ { 1, 16, 256, 4096 }, { 1 << 14 } });
+BENCHMARK_TEMPLATE(BM_RestInserts, FifoPriority, ArrayLadder<>)->ArgsProduct({ { 1, 16, 256, 4096 }, { 1 << 14 } });
+
+BENCHMARK_TEMPLATE(BM_SweepLevels, TimePriority, MapLadder)->ArgsProduct({ { 1, 16, 256, 1024 }, { 1, 16 } });
+BENCHMARK_TEMPLATE(BM_SweepLevels, FifoPriority, MapLadder)->ArgsProduct({ { 1, 16, 256, 1024 }, { 1, 16 } });
+BENCHMARK_TEMPLATE(BM_SweepLevels, FifoPriority, ArrayLadder<>)->ArgsProduct({ { 1, 16, 256, 1024 }, { 1, 16 } });
+
+BENCHMARK_TEMPLATE(BM_FillDeepLevel, TimePriority)->RangeMultiplier(8)->Range(8, 1 << 15);
+BENCHMARK_TEMPLATE(BM_FillDeepLevel, FifoPriority)->RangeMultiplier(8)->Range(8, 1 << 15);
+
+BENCHMARK_TEMPLATE(BM_MarketRouting, TimePriority, MapLadder)->ArgsProduct({ { 1, 64, 4096 }, { 1 << 16 } });
+BENCHMARK_TEMPLATE(BM_MarketRouting, FifoPriority, ArrayLadder<>)->ArgsProduct({ { 1, 64, 4096 }, { 1 << 16 } });
+
+BENCHMARK_TEMPLATE(BM_ForEachOrderByTime, TimePriority, MapLadder)->ArgsProduct({ { 1, 64 }, { 1 << 10, 1 << 16 } });
+BENCHMARK_TEMPLATE(BM_ForEachOrderByTime, FifoPriority, ArrayLadder<>)->ArgsProduct({ { 1, 64 }, { 1 << 10, 1 << 16 } });
+
+BENCHMARK(BM_ParseLine)->ArgsProduct({ { 1 << 10, 1 << 20 }, { 1 << 14 } });
+
+BENCHMARK_MAIN();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <deque>
 #include <map>
@@ -19,11 +20,30 @@ enum class FillExtent {
 	Full,
 };
 
+// Limit orders trade at their price or better. Market orders have no price: they trade at whatever prices
+// the opposite side offers, as far as it takes, and never rest, whatever their time in force.
+enum class OrderType : unsigned char {
+	Limit,
+	Market,
+};
+
+// What becomes of the part of a new order that does not trade on entry.
+enum class TimeInForce : unsigned char {
+	// Rests in the book
+	GoodTillCancel,
+	// Is discarded
+	ImmediateOrCancel,
+	// The order only trades if all of it can trade at once; otherwise none of it trades, and nothing rests
+	FillOrKill,
+};
+
 using Price = unsigned long long;
 using Quantity = unsigned long long;
 using TimeStamp = unsigned long long;
-using Id = std::string;
-using Instrument = std::string;
+// Order ids and instruments are dense integer handles, assigned by the gateway (see interner.h).
+// Their external names are only looked up again when printing.
+using Id = unsigned long long;
+using Instrument = unsigned int;
 
 // Used as the key to sort resting orders of the same price
 struct PriorityKey {
@@ -62,8 +82,8 @@ struct Order {
 	}
 	std::string ToString() const {
 		char s[1024] = { 0 };
-		snprintf(s, sizeof(s), "|%s| %10llu %llu x %llu"
-			, key.id.c_str()
+		snprintf(s, sizeof(s), "|%llu| %10llu %llu x %llu"
+			, key.id
 			, key.timestamp
 			, price
 			, quantity);
@@ -72,6 +92,58 @@ struct Order {
 	}
 };
 
+// Price level of one side of an orderbook, as market data sees it: its price, and the sum of its orders.
+struct LevelSummary {
+	Price price;
+	Quantity quantity;
+	std::size_t order_count;
+	bool operator==(const LevelSummary& rhs) const {
+		return (price == rhs.price)
+			&& (quantity == rhs.quantity)
+			&& (order_count == rhs.order_count);
+	}
+	bool operator!=(const LevelSummary& rhs) const {
+		return !((*this) == rhs);
+	}
+};
+
+// Best bid and offer of an orderbook. A side with no orders is all zeros.
+struct TopOfBook {
+	LevelSummary bid;
+	LevelSummary ask;
+	bool operator==(const TopOfBook& rhs) const {
+		return (bid == rhs.bid)
+			&& (ask == rhs.ask);
+	}
+	bool operator!=(const TopOfBook& rhs) const {
+		return !((*this) == rhs);
+	}
+};
+
+enum class LevelAction : unsigned char {
+	Add,
+	Modify,
+	Delete,
+};
+
+// Change to one of the best levels of one side of an orderbook, as an incremental depth feed publishes it.
+// Deleted levels carry their last summary.
+struct DepthUpdate {
+	Instrument instrument;
+	Side side;
+	LevelAction action;
+	LevelSummary level;
+	bool operator==(const DepthUpdate& rhs) const {
+		return (instrument == rhs.instrument)
+			&& (side == rhs.side)
+			&& (action == rhs.action)
+			&& (level == rhs.level);
+	}
+	bool operator!=(const DepthUpdate& rhs) const {
+		return !((*this) == rhs);
+	}
+};
+
 // Order in a market (with instrument and side)
 struct FullOrderDetail {
 	Side side;
@@ -95,13 +167,26 @@ requires(T x, const FullOrderDetail& full_order_detail) {
 	{ x.HandleFullOrderDetail(full_order_detail) } -> std::same_as<void>;
 };
 
+template <typename T>
+concept IsMarketDataHandler =
+requires(T x, const Instrument instrument, const TopOfBook& top_of_book) {
+	{ x.HandleBbo(instrument, top_of_book) } -> std::same_as<void>;
+	{ x.HandleBookChange(instrument) } -> std::same_as<void>;
+};
+
+template <typename T>
+concept IsDepthUpdateHandler =
+requires(T x, const DepthUpdate& depth_update) {
+	{ x.HandleDepthUpdate(depth_update) } -> std::same_as<void>;
+};
+
 template <typename T>
 concept IsTradeEventHandler =
 requires(T x, const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
 	{ x.HandleTradeEvent(side, matched_price, matched_quantity, aggressor_order, opposite_side_key) } -> std::same_as<void>;
 };
 
-template <typename T, typename TradeEventHandler>
+template <typename T, typename PrioritySortedOrders, typename TradeEventHandler>
 concept IsFillAllocator =
 requires(T x, const Side side, const Price matched_price, Order& aggressor_order, PrioritySortedOrders& opposite_side_resting_orders, TradeEventHandler& trade_event_handler) {
 	{ x.Fill(side, matched_price, aggressor_order, opposite_side_resting_orders, trade_event_handler) } -> std::same_as<void>;
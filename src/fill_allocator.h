@@ -2,11 +2,14 @@
 #include "common_types.h"
 
 // Consume as much quantity as possible from a matching order.
+// The orders it fills completely are removed together once it is done with the level, as one range,
+// so a sweep through a whole level releases the level's storage in one go rather than order by order.
 struct GreedyFillAllocator {
 	template<typename PrioritySortedOrders, typename TradeEventHandler>
 	void Fill(const Side side, const Price matched_price, Order& aggressor_order, PrioritySortedOrders& opposite_side_resting_orders, TradeEventHandler& trade_event_handler) {
-		while ((!opposite_side_resting_orders.empty()) && (aggressor_order.quantity > 0)) {
-			auto it = opposite_side_resting_orders.begin();
+		const auto first = opposite_side_resting_orders.begin();
+		auto it = first;
+		while ((opposite_side_resting_orders.end() != it) && (aggressor_order.quantity > 0)) {
 			auto& key = it->first;
 			auto& quantity = it->second;
 
@@ -17,12 +20,11 @@ struct GreedyFillAllocator {
 			quantity -= matched_quantity;
 			aggressor_order.quantity -= matched_quantity;
 
-			if (0 == quantity) {
-				opposite_side_resting_orders.erase(it);
-			}
-			else {
-				return;
+			if (0 != quantity) {
+				break;
 			}
+			++it;
 		}
+		opposite_side_resting_orders.erase(first, it);
 	}
 };
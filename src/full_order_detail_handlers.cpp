@@ -1,12 +1,32 @@
 #include "full_order_detail_handlers.h"
 #include <stdio.h>
+#include "order_message.h"
+#include "wire_format.h"
 
 void MarketConsolePrinter::HandleFullOrderDetail(const FullOrderDetail& full_order_detail) {
 	printf("%s %s %s %llu %llu\n"
-		, full_order_detail.order.key.id.c_str()
+		, names.order_ids.Name(full_order_detail.order.key.id).c_str()
 		, (Side::Buy == full_order_detail.side) ? "BUY" : "SELL"
-		, full_order_detail.instrument.c_str()
+		, names.instruments.Name(full_order_detail.instrument).c_str()
 		, full_order_detail.order.quantity
 		, full_order_detail.order.price
 	);
 }
+
+void MarketBufferedPrinter::HandleFullOrderDetail(const FullOrderDetail& full_order_detail) {
+	output.Append(names.order_ids.Name(full_order_detail.order.key.id));
+	output.Append((Side::Buy == full_order_detail.side) ? " BUY " : " SELL ");
+	output.Append(names.instruments.Name(full_order_detail.instrument));
+	output.Append(' ');
+	output.Append(full_order_detail.order.quantity);
+	output.Append(' ');
+	output.Append(full_order_detail.order.price);
+	output.Append('\n');
+	output.EndRecord();
+}
+
+void MarketWireWriter::HandleFullOrderDetail(const FullOrderDetail& full_order_detail) {
+	const OrderMessage message{ OrderAction::New, full_order_detail.side, full_order_detail.instrument, OrderType::Limit, TimeInForce::GoodTillCancel, full_order_detail.order };
+	EncodeWireRecord(message, output.Extend(kWireRecordSize));
+	output.EndRecord();
+}
@@ -1,6 +1,23 @@
 #pragma once
 #include "common_types.h"
+#include "interner.h"
+#include "output_buffer.h"
 
 struct MarketConsolePrinter {
+	const NameTables& names;
+	void HandleFullOrderDetail(const FullOrderDetail&);
+};
+
+// Prints the same lines as MarketConsolePrinter, into an OutputBuffer.
+struct MarketBufferedPrinter {
+	const NameTables& names;
+	OutputBuffer& output;
+	void HandleFullOrderDetail(const FullOrderDetail&);
+};
+
+// Writes each resting order as a binary new order record (see wire_format.h) into an OutputBuffer,
+// so that the output can be replayed to rebuild the book.
+struct MarketWireWriter {
+	OutputBuffer& output;
 	void HandleFullOrderDetail(const FullOrderDetail&);
 };
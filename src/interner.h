@@ -0,0 +1,84 @@
+#pragma once
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "common_types.h"
+
+// Maps external names (order ids, instrument symbols) to dense integer handles and back.
+// Handles are assigned in order of first sight starting from 0, so they can index arrays directly.
+// Only gateways and output handlers deal in names; the engine itself works on handles alone.
+template<typename Handle>
+class Interner {
+	// A deque never moves its elements, so the map's keys can view the stored names.
+	std::deque<std::string> names_;
+	std::unordered_map<std::string_view, Handle> handles_;
+
+public:
+	// Handle of a name, assigning the next one if the name has not been seen before.
+	Handle Intern(const std::string_view name) {
+		const auto it = handles_.find(name);
+		if (handles_.end() != it) {
+			return it->second;
+		}
+		const auto handle = static_cast<Handle>(names_.size());
+		handles_.emplace(names_.emplace_back(name), handle);
+		return handle;
+	}
+
+	std::optional<Handle> Find(const std::string_view name) const {
+		const auto it = handles_.find(name);
+		if (handles_.end() == it) {
+			return std::nullopt;
+		}
+		return it->second;
+	}
+
+	// Reverse lookup, for printing.
+	const std::string& Name(const Handle handle) const {
+		return names_[handle];
+	}
+
+	std::size_t Size() const {
+		return names_.size();
+	}
+};
+
+// External names of everything the engine refers to by handle.
+struct NameTables {
+	Interner<Id> order_ids;
+	Interner<Instrument> instruments;
+};
+
+// Names that were interned for the first time by the message they come with, for passing on to
+// readers of the messages that keep names of their own (e.g. another thread, or a journal).
+// They point into a NameTables, which never moves a name once interned.
+struct NewNames {
+	const std::string* order_id = nullptr;
+	const std::string* instrument = nullptr;
+};
+
+// Picks out the names a NameTables has gained since last asked. A message interns at most one of each.
+class NewNameTracker {
+	std::size_t known_order_ids_;
+	std::size_t known_instruments_;
+
+public:
+	explicit NewNameTracker(const NameTables& names)
+		: known_order_ids_(names.order_ids.Size())
+		, known_instruments_(names.instruments.Size())
+	{}
+
+	NewNames Take(const NameTables& names) {
+		NewNames new_names;
+		if (names.order_ids.Size() > known_order_ids_) {
+			new_names.order_id = &names.order_ids.Name(static_cast<Id>(known_order_ids_++));
+		}
+		if (names.instruments.Size() > known_instruments_) {
+			new_names.instrument = &names.instruments.Name(static_cast<Instrument>(known_instruments_++));
+		}
+		return new_names;
+	}
+};
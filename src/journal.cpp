@@ -0,0 +1,224 @@
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "output_buffer.h"
+#include "threads.h"
+
+namespace {
+	constexpr char kJournalMagic[8] = { 'M', 'E', 'J', 'O', 'U', 'R', 'N', 'L' };
+	constexpr std::size_t kTimeStampOffset = 32;
+	// Records are written out just before a sync, or once this many bytes are pending
+	constexpr std::size_t kWriteBytes = std::size_t(1) << 20;
+
+	std::uint64_t NowUs() {
+		// Only read on the background thread, so it can afford the precise clock
+		struct timespec now = {};
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return static_cast<std::uint64_t>(now.tv_sec) * 1000000ULL + static_cast<std::uint64_t>(now.tv_nsec) / 1000;
+	}
+
+	bool WriteAll(const int fd, const char* data, std::size_t size) {
+		while (size > 0) {
+			const auto n = write(fd, data, size);
+			if (n >= 0) {
+				data += n;
+				size -= static_cast<std::size_t>(n);
+			}
+			else if (EINTR != errno) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+const char* ToString(const JournalError error) {
+	switch (error) {
+	case JournalError::None: return "no error";
+	case JournalError::BadHeader: return "not a journal, or of another version";
+	case JournalError::UnknownRecord: return "unknown record";
+	case JournalError::BadName: return "name was interned as another handle";
+	}
+	return "unknown error";
+}
+
+Journal::Journal(const JournalParams& params)
+	: params_(params)
+{}
+
+Journal::~Journal() {
+	Close();
+}
+
+bool Journal::Open(const char* path, const NameTables& names) {
+	fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd_ < 0) {
+		return false;
+	}
+	char header[kWireRecordSize] = {};
+	memcpy(header, kJournalMagic, sizeof(kJournalMagic));
+	StoreWireField<std::uint32_t>(header, sizeof(kJournalMagic), kJournalVersion);
+	if (!WriteAll(fd_, header, sizeof(header))) {
+		close(fd_);
+		fd_ = -1;
+		return false;
+	}
+	Start(names, 0, 0, kWireRecordSize);
+	return true;
+}
+
+bool Journal::Reopen(const char* path, const NameTables& names, const JournalPosition& position) {
+	fd_ = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd_ < 0) {
+		return false;
+	}
+	const auto end = static_cast<off_t>(position.bytes);
+	if ((0 != ftruncate(fd_, end)) || (end != lseek(fd_, end, SEEK_SET))) {
+		close(fd_);
+		fd_ = -1;
+		return false;
+	}
+	Start(names, position.order_ids, position.instruments, position.bytes);
+	return true;
+}
+
+void Journal::Start(const NameTables& names, const std::size_t first_order_id, const std::size_t first_instrument, const std::size_t file_bytes) {
+	syncer_ = std::thread([this, file_bytes]() { WriteAndSync(file_bytes); });
+	for (std::size_t instrument = first_instrument; instrument < names.instruments.Size(); ++instrument) {
+		AppendName(1, instrument, names.instruments.Name(static_cast<Instrument>(instrument)));
+	}
+	for (std::size_t id = first_order_id; id < names.order_ids.Size(); ++id) {
+		AppendName(0, id, names.order_ids.Name(static_cast<Id>(id)));
+	}
+}
+
+void Journal::Push(const Record& record) {
+	unsigned spins = 0;
+	while (!records_->TryPush(record)) {
+		SpinWait(spins);
+	}
+}
+
+void Journal::AppendName(const std::uint8_t kind, const std::uint64_t handle, const std::string& name) {
+	Record record{};
+	StoreWireField<std::uint8_t>(record.bytes, 0, kJournalNameRecordType);
+	StoreWireField<std::uint8_t>(record.bytes, 1, kind);
+	StoreWireField<std::uint32_t>(record.bytes, 4, static_cast<std::uint32_t>(name.size()));
+	StoreWireField<std::uint64_t>(record.bytes, 8, handle);
+	Push(record);
+	for (std::size_t offset = 0; offset < name.size(); offset += kWireRecordSize) {
+		Record part{};
+		name.copy(part.bytes, kWireRecordSize, offset);
+		Push(part);
+	}
+}
+
+void Journal::Append(const OrderMessage& message, const NewNames& new_names) {
+	if (new_names.instrument) {
+		AppendName(1, message.instrument, *new_names.instrument);
+	}
+	if (new_names.order_id) {
+		AppendName(0, message.order.key.id, *new_names.order_id);
+	}
+	Record record;
+	EncodeWireRecord(message, record.bytes);
+	StoreWireField<std::uint64_t>(record.bytes, kTimeStampOffset, message.order.key.timestamp);
+	record.ends_message = true;
+	Push(record);
+}
+
+void Journal::WriteAndSync(const std::size_t file_bytes) {
+	OutputBuffer output(fd_, kWriteBytes);
+	auto written_bytes = static_cast<off_t>(file_bytes);
+	off_t preallocated_bytes = written_bytes;
+	std::uint64_t pending_messages = 0;
+	std::uint64_t oldest_pending_us = 0;
+	const auto write_out = [&]() {
+		// Keep the file allocated ahead of the writes. Only an optimization, so failure is not an error.
+		written_bytes += static_cast<off_t>(output.Pending());
+		while (written_bytes > preallocated_bytes) {
+			const auto chunk = static_cast<off_t>(std::max<std::size_t>(params_.preallocate_bytes, kWireRecordSize));
+			if (0 != fallocate(fd_, FALLOC_FL_KEEP_SIZE, preallocated_bytes, chunk)) {
+				preallocated_bytes = std::numeric_limits<off_t>::max();
+				break;
+			}
+			preallocated_bytes += chunk;
+		}
+		ok_ = output.Flush() && ok_;
+	};
+
+	unsigned spins = 0;
+	for (;;) {
+		// Seen before draining, so that everything appended before Close() is drained before stopping
+		const bool closing = closing_.load(std::memory_order_acquire);
+		const auto count = records_->ConsumeAvailable([&](const Record& record) {
+			memcpy(output.Extend(kWireRecordSize), record.bytes, kWireRecordSize);
+			if (record.ends_message) {
+				if (0 == pending_messages++) {
+					oldest_pending_us = NowUs();
+				}
+			}
+		});
+		if (output.Pending() >= kWriteBytes) {
+			write_out();
+		}
+
+		const bool sync_due = (pending_messages > 0)
+			&& ((pending_messages >= params_.sync_messages) || (NowUs() - oldest_pending_us >= params_.sync_delay_us));
+		if (sync_due || (closing && (0 == count))) {
+			write_out();
+			ok_ = (0 == fdatasync(fd_)) && ok_;
+			durable_.fetch_add(pending_messages, std::memory_order_release);
+			pending_messages = 0;
+		}
+		if (count > 0) {
+			spins = 0;
+		}
+		else if (closing) {
+			return;
+		}
+		else {
+			SpinWait(spins);
+		}
+	}
+}
+
+bool Journal::Close() {
+	if (fd_ < 0) {
+		return ok_;
+	}
+	closing_.store(true, std::memory_order_release);
+	if (syncer_.joinable()) {
+		syncer_.join();
+	}
+	ok_ = (0 == close(fd_)) && ok_;
+	fd_ = -1;
+	return ok_;
+}
+
+JournalError DecodeJournalHeader(const char* record) {
+	if ((0 != memcmp(record, kJournalMagic, sizeof(kJournalMagic)))
+		|| (kJournalVersion != LoadWireField<std::uint32_t>(record, sizeof(kJournalMagic)))) {
+		return JournalError::BadHeader;
+	}
+	return JournalError::None;
+}
+
+bool DecodeJournalName(const char* record, std::uint8_t& kind, std::uint64_t& handle, std::size_t& length) {
+	if (kJournalNameRecordType != LoadWireField<std::uint8_t>(record, 0)) {
+		return false;
+	}
+	kind = LoadWireField<std::uint8_t>(record, 1);
+	length = LoadWireField<std::uint32_t>(record, 4);
+	handle = LoadWireField<std::uint64_t>(record, 8);
+	return true;
+}
+
+TimeStamp JournalTimeStampOf(const char* record) {
+	return LoadWireField<std::uint64_t>(record, kTimeStampOffset);
+}
@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "common_types.h"
+#include "interner.h"
+#include "order_message.h"
+#include "spsc_queue.h"
+#include "wire_format.h"
+
+// Journal of inbound messages, appended to a file so that the book can be rebuilt after a crash.
+// The file is a sequence of kWireRecordSize-byte records:
+// - a header: the 8 bytes "MEJOURNL", then the u32 format version, then zeros,
+// - a wire format record per message (see wire_format.h), with the message's timestamp in the last 8 bytes,
+// - before the first message to use a new order id or instrument, a name record:
+//     offset  size  field
+//          0     1  type (kJournalNameRecordType)
+//          1     1  kind: 0 = order id, 1 = instrument
+//          4     4  length of the name
+//          8     8  handle the name was interned as
+//   followed by the name itself, zero padded to whole records.
+// A crash may leave a partial record at the end, which readers ignore.
+constexpr std::uint32_t kJournalVersion = 1;
+constexpr std::uint8_t kJournalNameRecordType = 16;
+
+enum class JournalError {
+	None,
+	BadHeader,
+	UnknownRecord,
+	// A name record whose handle differs from the one the name is interned as
+	BadName,
+};
+
+const char* ToString(const JournalError error);
+
+// How far a journal has been read.
+struct JournalPosition {
+	// Length of the whole records read, i.e. where appending can carry on
+	std::size_t bytes = 0;
+	// Number of order ids and instruments named in it
+	std::size_t order_ids = 0;
+	std::size_t instruments = 0;
+	// Timestamp of the last message
+	TimeStamp timestamp = 0;
+};
+
+// When a Journal makes appended messages durable.
+struct JournalParams {
+	// Sync once this many messages are waiting to be synced...
+	std::size_t sync_messages = 1024;
+	// ...or once the oldest of them has waited this long, whichever comes first
+	std::uint64_t sync_delay_us = 1000;
+	// The file is preallocated in chunks of this size ahead of the writes, so that appends do not allocate blocks
+	std::size_t preallocate_bytes = std::size_t(64) << 20;
+};
+
+// Appends messages to a journal file with group commit: the appending thread only copies records into an SPSC queue,
+// and a background thread writes them out and fdatasync()s them, once per group of messages.
+// So matching never waits for the disk, unless the disk falls so far behind that the queue fills up.
+class Journal {
+	struct Record {
+		char bytes[kWireRecordSize];
+		// Last record of a message, i.e. the message itself rather than a name it defines
+		bool ends_message;
+	};
+	using RecordQueue = SpscQueue<Record, 1 << 16>;
+
+	JournalParams params_;
+	int fd_ = -1;
+	std::unique_ptr<RecordQueue> records_ = std::make_unique<RecordQueue>();
+	alignas(kCacheLineSize) std::atomic<bool> closing_{ false };
+	// Number of messages known to be on disk
+	alignas(kCacheLineSize) std::atomic<std::uint64_t> durable_{ 0 };
+	// Whether every write and sync so far succeeded; only read once the syncer has stopped
+	bool ok_ = true;
+	std::thread syncer_;
+
+	void Push(const Record& record);
+	void AppendName(std::uint8_t kind, std::uint64_t handle, const std::string& name);
+	// Start the background thread, and record the names from the given handles on.
+	void Start(const NameTables& names, std::size_t first_order_id, std::size_t first_instrument, std::size_t file_bytes);
+	void WriteAndSync(std::size_t file_bytes);
+
+public:
+	explicit Journal(const JournalParams& params = {});
+	Journal(const Journal&) = delete;
+	Journal& operator=(const Journal&) = delete;
+	~Journal();
+
+	// Create (or truncate) the journal file, record every name interned so far, e.g. the symbol universe,
+	// and start the background thread. Returns false if the file cannot be created.
+	bool Open(const char* path, const NameTables& names);
+
+	// Carry on appending to a journal that was read up to `position`, e.g. by recovery, cutting off whatever a crash left after it.
+	// Records the names interned since, e.g. symbols added to the universe. Returns false if the file cannot be opened.
+	bool Reopen(const char* path, const NameTables& names, const JournalPosition& position);
+
+	// Appending thread: journal a message, after the names it interned for the first time.
+	void Append(const OrderMessage& message, const NewNames& new_names);
+
+	// Inbound consumer of a PipelinedMarket: journal messages from the consumer's own thread.
+	void operator()(const OrderMessage& message, const NewNames& new_names, std::uint64_t, bool) {
+		Append(message, new_names);
+	}
+
+	// Number of messages appended so far that are known to be on disk.
+	std::uint64_t Durable() const {
+		return durable_.load(std::memory_order_acquire);
+	}
+
+	// Wait for everything appended to be on disk, then stop the background thread and close the file.
+	// Returns false if any write or sync failed.
+	bool Close();
+};
+
+JournalError DecodeJournalHeader(const char* record);
+// Kind, handle and length of a name record. Returns false if `record` is not a name record.
+bool DecodeJournalName(const char* record, std::uint8_t& kind, std::uint64_t& handle, std::size_t& length);
+TimeStamp JournalTimeStampOf(const char* record);
+
+// Call handle_message(message) for every message in a journal's bytes, in the order journaled,
+// after interning the names they define into `names`. Instruments must be below `instrument_limit`, unless they are named.
+// Whatever a crash mid-write left at the end, i.e. a partial record or a name cut short, is ignored,
+// and `position` tells where the rest ends.
+template<typename MessageHandler>
+JournalError ForEachJournalMessage(const std::string_view bytes, NameTables& names, const Instrument instrument_limit, MessageHandler&& handle_message, JournalPosition& position) {
+	position = {};
+	const std::size_t count = bytes.size() / kWireRecordSize;
+	if (0 == count) {
+		return JournalError::BadHeader;
+	}
+	if (const auto error = DecodeJournalHeader(bytes.data()); JournalError::None != error) {
+		return error;
+	}
+	position.bytes = kWireRecordSize;
+	OrderMessage message{};
+	for (std::size_t i = 1; i < count; ++i) {
+		const char* record = bytes.data() + i * kWireRecordSize;
+		std::uint8_t kind = 0;
+		std::uint64_t handle = 0;
+		std::size_t length = 0;
+		if (DecodeJournalName(record, kind, handle, length)) {
+			const std::size_t name_records = (length + kWireRecordSize - 1) / kWireRecordSize;
+			if (i + name_records >= count) {
+				break;
+			}
+			const std::string_view name(record + kWireRecordSize, length);
+			const bool same_handle = (0 == kind)
+				? (handle == names.order_ids.Intern(name))
+				: (handle == names.instruments.Intern(name));
+			if (!same_handle) {
+				return JournalError::BadName;
+			}
+			auto& named = (0 == kind) ? position.order_ids : position.instruments;
+			named = std::max<std::size_t>(named, handle + 1);
+			i += name_records;
+			position.bytes = (i + 1) * kWireRecordSize;
+			continue;
+		}
+		const auto limit = std::max(instrument_limit, static_cast<Instrument>(names.instruments.Size()));
+		if (WireError::None != DecodeWireRecord(JournalTimeStampOf(record), record, limit, message)) {
+			return JournalError::UnknownRecord;
+		}
+		handle_message(message);
+		position.bytes = (i + 1) * kWireRecordSize;
+		position.timestamp = message.order.key.timestamp;
+	}
+	return JournalError::None;
+}
+
+template<typename MessageHandler>
+JournalError ForEachJournalMessage(const std::string_view bytes, NameTables& names, const Instrument instrument_limit, MessageHandler&& handle_message) {
+	JournalPosition position;
+	return ForEachJournalMessage(bytes, names, instrument_limit, handle_message, position);
+}
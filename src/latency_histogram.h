@@ -0,0 +1,80 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram of unsigned values, in the style of HdrHistogram.
+// Values below 2^SubBucketBits are counted exactly; above that, each power of two is split into 2^SubBucketBits
+// equal buckets, so any recorded value is known to within 1 part in 2^SubBucketBits.
+// All counters are allocated with the histogram, so recording never allocates.
+template<unsigned SubBucketBits = 5>
+class LatencyHistogram {
+	static constexpr std::uint64_t kSubBuckets = 1ULL << SubBucketBits;
+	static constexpr std::size_t kBuckets = (65 - SubBucketBits) * kSubBuckets;
+
+	std::array<std::uint64_t, kBuckets> counts_{};
+	std::uint64_t total_count_ = 0;
+	std::uint64_t max_ = 0;
+
+	static std::size_t BucketOf(const std::uint64_t value) {
+		if (value < kSubBuckets) {
+			return static_cast<std::size_t>(value);
+		}
+		const unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(value));
+		const unsigned shift = msb - SubBucketBits;
+		return static_cast<std::size_t>(((shift + 1) << SubBucketBits) + ((value >> shift) & (kSubBuckets - 1)));
+	}
+
+	// Largest value that is counted in a bucket.
+	static std::uint64_t HighestValueOf(const std::size_t bucket) {
+		if (bucket < kSubBuckets) {
+			return bucket;
+		}
+		const unsigned shift = static_cast<unsigned>(bucket >> SubBucketBits) - 1;
+		const std::uint64_t lowest = (kSubBuckets + (bucket & (kSubBuckets - 1))) << shift;
+		return lowest + ((1ULL << shift) - 1);
+	}
+
+public:
+	void Record(const std::uint64_t value) {
+		++counts_[BucketOf(value)];
+		++total_count_;
+		if (value > max_) {
+			max_ = value;
+		}
+	}
+
+	std::uint64_t Count() const {
+		return total_count_;
+	}
+
+	std::uint64_t Max() const {
+		return max_;
+	}
+
+	// Smallest value that at least `percentile` percent of recorded values are no greater than, to within the bucket resolution.
+	std::uint64_t ValueAtPercentile(const double percentile) const {
+		if (0 == total_count_) {
+			return 0;
+		}
+		auto rank = static_cast<std::uint64_t>(percentile / 100.0 * static_cast<double>(total_count_) + 0.5);
+		if (rank < 1) {
+			rank = 1;
+		}
+		std::uint64_t seen = 0;
+		for (std::size_t bucket = 0; bucket < kBuckets; ++bucket) {
+			seen += counts_[bucket];
+			if (seen >= rank) {
+				const auto highest = HighestValueOf(bucket);
+				return (highest < max_) ? highest : max_;
+			}
+		}
+		return max_;
+	}
+
+	void Reset() {
+		counts_.fill(0);
+		total_count_ = 0;
+		max_ = 0;
+	}
+};
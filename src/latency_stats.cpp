@@ -0,0 +1,37 @@
+#include "latency_stats.h"
+
+const char* ToString(const LatencyStage stage) {
+	switch (stage) {
+	case LatencyStage::Parse: return "parse";
+	case LatencyStage::Journal: return "journal";
+	case LatencyStage::Route: return "route";
+	case LatencyStage::Match: return "match";
+	case LatencyStage::Publish: return "publish";
+	case LatencyStage::Total: return "total";
+	case LatencyStage::Count: break;
+	}
+	return "unknown";
+}
+
+void LatencyStats::Report(FILE* file) const {
+	// The tick rate over the whole run, which for the fallback clock is exactly 1 tick per ns
+	const auto elapsed_ticks = TickClock::Now() - start_ticks_;
+	const auto elapsed_ns = TickClock::MonotonicNs() - start_ns_;
+	const double ns_per_tick = (elapsed_ticks > 0) ? (static_cast<double>(elapsed_ns) / static_cast<double>(elapsed_ticks)) : 1.0;
+	const auto to_ns = [ns_per_tick](const std::uint64_t ticks) {
+		return static_cast<unsigned long long>(static_cast<double>(ticks) * ns_per_tick + 0.5);
+	};
+
+	fprintf(file, "%-8s %12s %10s %10s %10s %10s\n", "stage", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+	for (std::size_t i = 0; i < histograms_.size(); ++i) {
+		const auto& histogram = histograms_[i];
+		fprintf(file, "%-8s %12llu %10llu %10llu %10llu %10llu\n"
+			, ToString(static_cast<LatencyStage>(i))
+			, static_cast<unsigned long long>(histogram.Count())
+			, to_ns(histogram.ValueAtPercentile(50.0))
+			, to_ns(histogram.ValueAtPercentile(99.0))
+			, to_ns(histogram.ValueAtPercentile(99.9))
+			, to_ns(histogram.Max())
+		);
+	}
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include <stdio.h>
+#include <time.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "latency_histogram.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Per-order latency instrumentation, enabled by configuring with -DME_LATENCY_STATS=ON.
+// When disabled, every probe below is an empty inline function, so instrumented code compiles to exactly what it was.
+#ifndef ME_LATENCY_STATS
+#define ME_LATENCY_STATS 0
+#endif
+constexpr bool kLatencyStatsEnabled = (0 != ME_LATENCY_STATS);
+
+// Stages an inbound message goes through, in order.
+enum class LatencyStage {
+	Parse,   // Text or binary decoding into an OrderMessage
+	Journal, // Appending the message to the journal, when matching on the gateway's thread
+	Route,   // Finding the orderbook, or the resting order for cancels and amends
+	Match,   // Matching, resting and index upkeep, excluding Publish
+	Publish, // Trade event handlers, e.g. formatting fills into the output buffer
+	Total,   // From the start of parsing until the message is fully processed
+	Count,
+};
+
+const char* ToString(const LatencyStage stage);
+
+// Timestamp counter where there is one, otherwise CLOCK_MONOTONIC in ns.
+struct TickClock {
+	static std::uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return MonotonicNs();
+#endif
+	}
+
+	static std::uint64_t MonotonicNs() {
+		struct timespec now = {};
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return static_cast<std::uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<std::uint64_t>(now.tv_nsec);
+	}
+};
+
+// Latency histograms of one thread's stages, in ticks of the TickClock.
+class LatencyStats {
+	friend struct LatencyProbe;
+
+	std::array<LatencyHistogram<>, static_cast<std::size_t>(LatencyStage::Count)> histograms_;
+
+	// For converting ticks into ns when reporting
+	std::uint64_t start_ticks_ = TickClock::Now();
+	std::uint64_t start_ns_ = TickClock::MonotonicNs();
+
+	// The message being timed
+	std::uint64_t message_start_ = 0;
+	std::uint64_t stage_start_ = 0;
+	std::uint64_t publish_start_ = 0;
+	// Time spent publishing during the current stage, and during the whole message
+	std::uint64_t stage_publish_ticks_ = 0;
+	std::uint64_t message_publish_ticks_ = 0;
+	int next_stage_ = 0;
+
+public:
+	const LatencyHistogram<>& Histogram(const LatencyStage stage) const {
+		return histograms_[static_cast<std::size_t>(stage)];
+	}
+
+	// Print count, p50, p99, p99.9 and max of each stage, in ns.
+	void Report(FILE* file) const;
+};
+
+// Hooks for timing each message through its stages, on the thread the LatencyStats are attached to.
+// Stages run on other threads, e.g. matching on shard workers or a pipeline's matcher, are not timed, since the probes
+// are per thread: there, Total is the time until the message has been handed off.
+// Each stage is timed from the end of the previous one, and time spent publishing is not counted in the stage it happens in.
+// A stage that has already been timed for the current message is not timed again (e.g. an amend entering its orderbook again).
+struct LatencyProbe {
+	static LatencyStats*& Attached() {
+		thread_local LatencyStats* stats = nullptr;
+		return stats;
+	}
+
+	static void Attach(LatencyStats* stats) {
+		if constexpr (kLatencyStatsEnabled) {
+			Attached() = stats;
+		}
+	}
+
+	static void Begin() {
+		if constexpr (kLatencyStatsEnabled) {
+			if (LatencyStats* stats = Attached()) {
+				stats->message_start_ = stats->stage_start_ = TickClock::Now();
+				stats->stage_publish_ticks_ = 0;
+				stats->message_publish_ticks_ = 0;
+				stats->next_stage_ = 0;
+			}
+		}
+	}
+
+	static void Mark(const LatencyStage stage) {
+		if constexpr (kLatencyStatsEnabled) {
+			LatencyStats* stats = Attached();
+			if ((!stats) || (static_cast<int>(stage) < stats->next_stage_)) {
+				return;
+			}
+			const auto now = TickClock::Now();
+			const auto elapsed = now - stats->stage_start_;
+			const auto published = stats->stage_publish_ticks_;
+			stats->histograms_[static_cast<std::size_t>(stage)].Record((elapsed > published) ? (elapsed - published) : 0);
+			stats->stage_start_ = now;
+			stats->stage_publish_ticks_ = 0;
+			stats->next_stage_ = static_cast<int>(stage) + 1;
+		}
+	}
+
+	// Once the message is fully processed.
+	static void End() {
+		if constexpr (kLatencyStatsEnabled) {
+			if (LatencyStats* stats = Attached()) {
+				stats->histograms_[static_cast<std::size_t>(LatencyStage::Total)].Record(TickClock::Now() - stats->message_start_);
+				// Only messages that published anything, e.g. orders that traded
+				if (stats->message_publish_ticks_ > 0) {
+					stats->histograms_[static_cast<std::size_t>(LatencyStage::Publish)].Record(stats->message_publish_ticks_);
+				}
+			}
+		}
+	}
+
+	static void BeginPublish() {
+		if constexpr (kLatencyStatsEnabled) {
+			if (LatencyStats* stats = Attached()) {
+				stats->publish_start_ = TickClock::Now();
+			}
+		}
+	}
+
+	static void EndPublish() {
+		if constexpr (kLatencyStatsEnabled) {
+			if (LatencyStats* stats = Attached()) {
+				const auto published = TickClock::Now() - stats->publish_start_;
+				stats->stage_publish_ticks_ += published;
+				stats->message_publish_ticks_ += published;
+			}
+		}
+	}
+};
@@ -0,0 +1,63 @@
+#include "line_reader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile() {
+	if (data_) {
+		munmap(const_cast<char*>(data_), size_);
+	}
+	if (fd_ >= 0) {
+		close(fd_);
+	}
+}
+
+bool MappedFile::Open(const char* path) {
+	fd_ = open(path, O_RDONLY);
+	if (fd_ < 0) {
+		return false;
+	}
+	struct stat file_status = {};
+	if ((0 != fstat(fd_, &file_status)) || !S_ISREG(file_status.st_mode)) {
+		return false;
+	}
+	size_ = static_cast<std::size_t>(file_status.st_size);
+	if (0 == size_) {
+		// Nothing to map
+		return true;
+	}
+	void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if (MAP_FAILED == data) {
+		size_ = 0;
+		return false;
+	}
+	madvise(data, size_, MADV_SEQUENTIAL);
+	data_ = static_cast<const char*>(data);
+	return true;
+}
+
+bool ReadMore(const int fd, std::vector<char>& buffer, std::size_t& filled) {
+	if (filled == buffer.size()) {
+		// A line longer than the buffer
+		buffer.resize(buffer.size() * 2);
+	}
+	for (;;) {
+		const auto n = read(fd, buffer.data() + filled, buffer.size() - filled);
+		if (n >= 0) {
+			filled += static_cast<std::size_t>(n);
+			return true;
+		}
+		if (EINTR != errno) {
+			return false;
+		}
+	}
+}
+
+bool InputReady(const int fd) {
+	struct pollfd input = { fd, POLLIN, 0 };
+	// Errors are left for the read to report
+	return 0 != poll(&input, 1, 0);
+}
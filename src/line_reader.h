@@ -0,0 +1,97 @@
+#pragma once
+#include <string.h>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Size of the blocks streams are read in
+constexpr std::size_t kStreamBlockSize = 1 << 20;
+
+// Idle handler of the stream readers that does nothing, so that readers without one never look before they read.
+struct NoIdleHandler {
+	void operator()() const {}
+};
+
+// A whole file mapped into memory, read-only.
+class MappedFile {
+	int fd_ = -1;
+	const char* data_ = nullptr;
+	std::size_t size_ = 0;
+
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+
+	// Returns false if the file cannot be opened or mapped.
+	bool Open(const char* path);
+
+	std::string_view Contents() const {
+		return { data_, size_ };
+	}
+};
+
+// Call handle_line for each line of `text`, without its '\n', splitting lines like std::getline does.
+// Lines are views into `text`, so nothing is copied.
+template<typename LineHandler>
+void ForEachLine(const std::string_view text, LineHandler&& handle_line) {
+	const char* begin = text.data();
+	const char* const end = text.data() + text.size();
+	while (begin != end) {
+		const auto* newline = static_cast<const char*>(memchr(begin, '\n', static_cast<std::size_t>(end - begin)));
+		const char* const line_end = newline ? newline : end;
+		handle_line(std::string_view(begin, static_cast<std::size_t>(line_end - begin)));
+		begin = newline ? (newline + 1) : end;
+	}
+}
+
+// Read whatever is available into `buffer` after its first `filled` bytes, growing it if it is full.
+// Returns false on a read error; `filled` is unchanged at the end of the stream.
+bool ReadMore(const int fd, std::vector<char>& buffer, std::size_t& filled);
+
+// Whether reading `fd` would return at once, with input, the end of the stream or an error, rather than wait.
+bool InputReady(const int fd);
+
+// ReadMore, calling on_idle() first if the read would have to wait for input, e.g. to write out output
+// that is waiting for its batch to fill, which would otherwise wait as long as the input does.
+template<typename IdleHandler>
+bool ReadMore(const int fd, std::vector<char>& buffer, std::size_t& filled, IdleHandler& on_idle) {
+	if constexpr (!std::is_same_v<std::remove_cvref_t<IdleHandler>, NoIdleHandler>) {
+		if (!InputReady(fd)) {
+			on_idle();
+		}
+	}
+	return ReadMore(fd, buffer, filled);
+}
+
+// Read a file descriptor (e.g. stdin) in large blocks, and call handle_line for each line read.
+// Only a line straddling two blocks is copied. on_idle() is called whenever the reader is about to wait for input.
+// Returns false on a read error.
+template<typename LineHandler, typename IdleHandler = NoIdleHandler>
+bool ForEachLineOfStream(const int fd, LineHandler&& handle_line, const std::size_t block_size = kStreamBlockSize, IdleHandler&& on_idle = {}) {
+	std::vector<char> buffer(block_size);
+	std::size_t filled = 0;
+	for (;;) {
+		const std::size_t previously_filled = filled;
+		if (!ReadMore(fd, buffer, filled, on_idle)) {
+			return false;
+		}
+		if (previously_filled == filled) {
+			// End of stream: the rest is one last line without '\n'
+			ForEachLine(std::string_view(buffer.data(), filled), handle_line);
+			return true;
+		}
+
+		// Hand over every complete line, and keep the incomplete one for the next read.
+		const auto* last_newline = static_cast<const char*>(memrchr(buffer.data(), '\n', filled));
+		if (!last_newline) {
+			continue;
+		}
+		const auto complete = static_cast<std::size_t>(last_newline - buffer.data()) + 1;
+		ForEachLine(std::string_view(buffer.data(), complete), handle_line);
+		memmove(buffer.data(), buffer.data() + complete, filled - complete);
+		filled -= complete;
+	}
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include "common_types.h"
+#include "order_flow_generator.h"
+#include "order_message.h"
+#include "output_buffer.h"
+#include "wire_format.h"
+
+// Writes a synthetic order flow to stdout, in the text format me_app reads, or with --binary in the wire format.
+// Instruments are named S0, S1, ... in decreasing order of popularity.
+
+struct LoadgenOptions {
+	OrderFlowParams params;
+	unsigned long long orders = 1000000;
+	bool binary = false;
+	// Where to list the instruments, one per line, for me_app --symbols
+	const char* symbols_path = nullptr;
+};
+
+bool ParseLoadgenOptions(const int argc, char* argv[], LoadgenOptions& options) {
+	for (int i = 1; i < argc; ++i) {
+		const std::string option = argv[i];
+		if ("--binary" == option) {
+			options.binary = true;
+			continue;
+		}
+		if (i + 1 == argc) {
+			return false;
+		}
+		const char* value = argv[++i];
+		char* end = nullptr;
+		if ("--orders" == option) {
+			options.orders = strtoull(value, &end, 10);
+		}
+		else if ("--seed" == option) {
+			options.params.seed = strtoull(value, &end, 10);
+		}
+		else if ("--instruments" == option) {
+			options.params.instruments = static_cast<Instrument>(strtoul(value, &end, 10));
+		}
+		else if ("--start-price" == option) {
+			options.params.start_price = strtoull(value, &end, 10);
+		}
+		else if ("--zipf" == option) {
+			options.params.zipf_exponent = strtod(value, &end);
+		}
+		else if ("--distance" == option) {
+			options.params.mean_distance_ticks = strtod(value, &end);
+		}
+		else if ("--size" == option) {
+			options.params.mean_size = strtod(value, &end);
+		}
+		else if ("--cancel-ratio" == option) {
+			options.params.cancel_ratio = strtod(value, &end);
+		}
+		else if ("--aggressor-ratio" == option) {
+			options.params.aggressor_ratio = strtod(value, &end);
+		}
+		else if ("--symbols-out" == option) {
+			options.symbols_path = value;
+			end = const_cast<char*>(value) + strlen(value);
+		}
+		else {
+			return false;
+		}
+		if ((end == value) || ('\0' != *end)) {
+			return false;
+		}
+	}
+	return options.params.instruments > 0;
+}
+
+bool WriteSymbols(const char* path, const Instrument instruments) {
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		return false;
+	}
+	for (Instrument instrument = 0; instrument < instruments; ++instrument) {
+		fprintf(file, "S%u\n", instrument);
+	}
+	return 0 == fclose(file);
+}
+
+void AppendText(OutputBuffer& output, const OrderMessage& message) {
+	output.Append(message.order.key.id);
+	if (OrderAction::Cancel == message.action) {
+		output.Append(" CANCEL\n");
+		return;
+	}
+	output.Append((Side::Buy == message.side) ? " BUY S" : " SELL S");
+	output.Append(message.instrument);
+	output.Append(' ');
+	output.Append(message.order.quantity);
+	output.Append(' ');
+	output.Append(message.order.price);
+	output.Append('\n');
+}
+
+int main(int argc, char* argv[]) {
+	LoadgenOptions options;
+	if (!ParseLoadgenOptions(argc, argv, options)) {
+		fprintf(stderr, "Usage: %s [--orders N] [--seed N] [--instruments N] [--start-price N] [--zipf S] [--distance TICKS] [--size N]"
+			" [--cancel-ratio R] [--aggressor-ratio R] [--binary] [--symbols-out FILE]\n", argv[0]);
+		return 1;
+	}
+	if (options.symbols_path && !WriteSymbols(options.symbols_path, options.params.instruments)) {
+		fprintf(stderr, "Cannot write symbols to %s\n", options.symbols_path);
+		return 1;
+	}
+
+	OrderFlowGenerator generator(options.params);
+	OutputBuffer output(STDOUT_FILENO);
+	OrderMessage message{};
+	for (unsigned long long i = 0; i < options.orders; ++i) {
+		generator.Next(message);
+		if (options.binary) {
+			EncodeWireRecord(message, output.Extend(kWireRecordSize));
+		}
+		else {
+			AppendText(output, message);
+		}
+		output.EndRecord();
+	}
+	if (!output.Flush()) {
+		fprintf(stderr, "Cannot write output\n");
+		return 1;
+	}
+	return 0;
+}
@@ -1,113 +1,506 @@
-#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
-#include <stdlib.h>
-#include <iostream>
-#include <sstream>
-#include <map>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <memory>
 #include <string>
-#include <utility>
-#include <vector>
+#include <string_view>
 #include "common_types.h"
 #include "full_order_detail_handlers.h"
 #include "market.h"
+#include "market_data_handlers.h"
 #include "fill_allocator.h"
+#include "interner.h"
+#include "journal.h"
+#include "latency_stats.h"
+#include "line_reader.h"
+#include "order_message.h"
+#include "order_parser.h"
+#include "output_buffer.h"
+#include "pipelined_market.h"
+#include "sharded_market.h"
+#include "snapshot.h"
 #include "trade_event_handlers.h"
+#include "wire_format.h"
 
-void GetWords(const std::string& s, const char delim, std::vector<std::string>& words) {
-	std::istringstream line(s);
-	std::string word;
-	while (std::getline(line, word, delim)) {
-		if (!word.empty()) {
-			words.push_back(word);
+struct Options {
+	// File listing the known symbol universe, one instrument per line
+	const char* symbols_path = nullptr;
+	// Regular file of orders to memory-map, instead of reading stdin
+	const char* input_path = nullptr;
+	// Read and write the binary wire format instead of text
+	bool binary = false;
+	// Match on this many worker threads, each owning the orderbooks of some instruments; 0 matches on the input thread
+	std::size_t shards = 0;
+	// Parse, match and print on three pipelined threads
+	bool pipeline = false;
+	// Pin worker threads to their own CPUs
+	bool pin = true;
+	// Journal every message to this file before matching it
+	const char* journal_path = nullptr;
+	JournalParams journal_params;
+	// Rebuild the market from the journal before reading any input, and carry on journaling after it
+	bool recover = false;
+	// Snapshot the market to this file every `snapshot_interval` messages, and recover from it
+	const char* snapshot_path = nullptr;
+	std::size_t snapshot_interval = 1000000;
+	// Write an incremental depth feed of the best levels to this file, conflating each instrument's changes
+	// over `depth_window` messages. Runs as a stage of the pipeline.
+	const char* depth_feed_path = nullptr;
+	TimeStamp depth_window = 0;
+};
+
+bool ParseOptions(const int argc, char* argv[], Options& options) {
+	for (int i = 1; i < argc; ++i) {
+		const std::string option = argv[i];
+		if (("--symbols" == option) && (i + 1 < argc)) {
+			options.symbols_path = argv[++i];
+		}
+		else if ("--binary" == option) {
+			options.binary = true;
+		}
+		else if (("--shards" == option) && (i + 1 < argc)) {
+			options.shards = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if ("--pipeline" == option) {
+			options.pipeline = true;
+		}
+		else if ("--no-pin" == option) {
+			options.pin = false;
+		}
+		else if (("--journal" == option) && (i + 1 < argc)) {
+			options.journal_path = argv[++i];
+		}
+		else if (("--journal-sync-messages" == option) && (i + 1 < argc)) {
+			options.journal_params.sync_messages = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (("--journal-sync-us" == option) && (i + 1 < argc)) {
+			options.journal_params.sync_delay_us = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if ("--recover" == option) {
+			options.recover = true;
+		}
+		else if (("--snapshot" == option) && (i + 1 < argc)) {
+			options.snapshot_path = argv[++i];
+		}
+		else if (("--snapshot-every" == option) && (i + 1 < argc)) {
+			options.snapshot_interval = std::max<std::size_t>(std::strtoul(argv[++i], nullptr, 10), 1);
+		}
+		else if (("--depth-feed" == option) && (i + 1 < argc)) {
+			options.depth_feed_path = argv[++i];
 		}
+		else if (("--depth-window" == option) && (i + 1 < argc)) {
+			options.depth_window = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if ((!options.input_path) && ('-' != option[0])) {
+			options.input_path = argv[i];
+		}
+		else {
+			return false;
+		}
+	}
+	if ((options.pipeline && (options.shards > 0)) || (options.depth_feed_path && !options.pipeline)) {
+		return false;
 	}
+	// Recovery replays the journal into a market on this thread, and snapshots fork that thread
+	const bool multithreaded = options.pipeline || (options.shards > 0);
+	return !((options.recover && ((!options.journal_path) || multithreaded)) || (options.snapshot_path && multithreaded));
 }
 
-bool StringToUnsignedLongLong(char const* const s, unsigned long long& number) {
-	if (!s) return false;
-	char* end = nullptr;
-	number = std::strtoull(s, &end, 10);
-	return (0 == errno);
+// Intern every instrument of the symbol universe up front, so that their handles, and then their orderbooks, exist before trading.
+bool LoadSymbols(const char* path, NameTables& names) {
+	std::ifstream file(path);
+	if (!file) {
+		return false;
+	}
+	std::string symbol;
+	while (file >> symbol) {
+		names.instruments.Intern(symbol);
+	}
+	return true;
 }
 
-bool StringToQuantity(char const* const s, Quantity& quantity) {
-	return StringToUnsignedLongLong(s, quantity);
+// Read every inbound message, in the text or binary format, from the input file or stdin, and pass it to handle_message.
+// Messages are timestamped in order of arrival, after `last_timestamp`. Whenever stdin has nothing to read yet,
+// on_idle() is called before waiting for it, e.g. to write out the fills of the messages so far.
+// Messages that cannot be parsed are reported on stderr and skipped. Returns false if the input cannot be read.
+template<typename MessageHandler, typename IdleHandler>
+bool ForEachInputMessage(const Options& options, NameTables& names, const Instrument instrument_limit, const TimeStamp last_timestamp, MessageHandler&& handle_message, IdleHandler&& on_idle) {
+	TimeStamp t = last_timestamp;
+	OrderMessage message{};
+	const auto process_line = [&](const std::string_view line) {
+		LatencyProbe::Begin();
+		const auto error = ParseLineToOrderParams(++t, line, names, message);
+		if (ParseError::None != error) {
+			if (ParseError::EmptyLine != error) {
+				fprintf(stderr, "Ignoring line %llu (%s): %.*s\n", t, ToString(error), static_cast<int>(line.size()), line.data());
+			}
+			return;
+		}
+		LatencyProbe::Mark(LatencyStage::Parse);
+		handle_message(message);
+	};
+	const auto process_record = [&](const char* record) {
+		LatencyProbe::Begin();
+		const auto error = DecodeWireRecord(++t, record, instrument_limit, message);
+		if (WireError::None != error) {
+			fprintf(stderr, "Ignoring record %llu (%s)\n", t, ToString(error));
+			return;
+		}
+		LatencyProbe::Mark(LatencyStage::Parse);
+		handle_message(message);
+	};
+
+	MappedFile input;
+	if (options.input_path && !input.Open(options.input_path)) {
+		fprintf(stderr, "Cannot map %s\n", options.input_path);
+		return false;
+	}
+	if (!options.binary) {
+		if (options.input_path) {
+			ForEachLine(input.Contents(), process_line);
+		}
+		else if (!ForEachLineOfStream(STDIN_FILENO, process_line, kStreamBlockSize, on_idle)) {
+			fprintf(stderr, "Cannot read stdin\n");
+			return false;
+		}
+		return true;
+	}
+
+	const bool whole_records = options.input_path
+		? ForEachWireRecord(input.Contents(), process_record)
+		: ForEachWireRecordOfStream(STDIN_FILENO, process_record, kStreamBlockSize, on_idle);
+	if (!whole_records) {
+		fprintf(stderr, "Input ends with a partial record, or cannot be read\n");
+	}
+	return whole_records;
 }
 
-bool StringToPrice(char const* const s, Price& price) {
-	return StringToUnsignedLongLong(s, price);
+// Print the orders left resting after the trades, then hand everything left in the buffer to the OS.
+template<typename Market, typename MarketPrinter>
+int PrintBook(const Options& options, OutputBuffer& output, const Market& market, MarketPrinter& market_printer, const bool input_ok) {
+	if (!options.binary) {
+		output.Append('\n');
+	}
+	market.ForEachOrderByTime(market_printer);
+	if (!output.Flush()) {
+		fprintf(stderr, "Cannot write output\n");
+		return 1;
+	}
+	return input_ok ? 0 : 1;
 }
 
-bool ParseLineToOrderParams(const TimeStamp& timestamp, const std::string& line, Side& side, Instrument& instrument, Order& order) {
-	std::vector<std::string> words;
-	GetWords(line, ' ', words);
-	if (words.size() < 5) {
-		return false;
+template<typename TradePrinter>
+using AppMarket = Market<FifoPriority, GreedyFillAllocator, TradePrinter, ArrayLadder<>>;
+
+// Restore the latest snapshot, if there is one, then replay the journal's messages after it straight from the mapped file,
+// with the trade printer muted, and reopen the journal to carry on after the last message.
+// A missing or empty journal is a fresh start. The journal is read in full regardless, for the names it defines.
+// `last_timestamp` is set to the timestamp of the last message recovered. Returns false if the snapshot or journal is unusable.
+template<typename Market, typename TradePrinter>
+bool Recover(const Options& options, NameTables& names, const Instrument instrument_limit, Market& market, MutableTradeEventHandler<TradePrinter>& trade_printer, Journal& journal, TimeStamp& last_timestamp) {
+	MappedFile file;
+	if ((!file.Open(options.journal_path)) || file.Contents().empty()) {
+		if (!journal.Open(options.journal_path, names)) {
+			fprintf(stderr, "Cannot create journal %s\n", options.journal_path);
+			return false;
+		}
+		return true;
 	}
-	
-	order.key.id = words[0];
 
-	const std::string& side_as_string = words[1];
-	if ("SELL" == side_as_string) {
-		side = Side::Sell;
+	TimeStamp snapshot_timestamp = 0;
+	MappedFile snapshot;
+	if (options.snapshot_path && snapshot.Open(options.snapshot_path) && !snapshot.Contents().empty()) {
+		SnapshotReader reader(snapshot.Contents());
+		auto error = market.Restore(reader, snapshot_timestamp);
+		if (SnapshotError::None == error) {
+			error = reader.Names(names);
+		}
+		if (SnapshotError::None != error) {
+			fprintf(stderr, "Cannot restore snapshot %s (%s)\n", options.snapshot_path, ToString(error));
+			return false;
+		}
+		for (Instrument instrument = 0; instrument < names.instruments.Size(); ++instrument) {
+			market.AddInstrument(instrument);
+		}
 	}
-	else if ("BUY" == side_as_string) {
-		side = Side::Buy;
+
+	// Replayed messages are not part of the latency being measured
+	LatencyStats* const latency_stats = LatencyProbe::Attached();
+	LatencyProbe::Attach(nullptr);
+	trade_printer.muted = true;
+	JournalPosition position;
+	std::size_t replayed = 0;
+	const auto error = ForEachJournalMessage(file.Contents(), names, instrument_limit, [&](OrderMessage& message) {
+		if (message.order.key.timestamp > snapshot_timestamp) {
+			ProcessOrderMessage(market, trade_printer, message);
+			++replayed;
+		}
+	}, position);
+	trade_printer.muted = false;
+	LatencyProbe::Attach(latency_stats);
+
+	if (JournalError::None != error) {
+		fprintf(stderr, "Cannot recover from journal %s (%s)\n", options.journal_path, ToString(error));
+		return false;
 	}
-	else {
+	if (snapshot_timestamp > 0) {
+		fprintf(stderr, "Restored snapshot %s as of message %llu\n", options.snapshot_path, snapshot_timestamp);
+	}
+	fprintf(stderr, "Recovered %zu messages from journal %s\n", replayed, options.journal_path);
+	// Snapshots may be taken of messages that had not been synced to the journal yet. The names those messages interned
+	// came back with the snapshot, and the reopened journal records them before anything else.
+	last_timestamp = std::max(position.timestamp, snapshot_timestamp);
+	if (!journal.Reopen(options.journal_path, names, position)) {
+		fprintf(stderr, "Cannot reopen journal %s\n", options.journal_path);
 		return false;
 	}
+	return true;
+}
 
-	instrument = words[2];
-		
-	if (!StringToQuantity(words[3].c_str(), order.quantity)) {
-		return false;
+// Match every message on this thread, as it is read.
+template<typename TradePrinter, typename MarketPrinter>
+int RunMarket(const Options& options, NameTables& names, Journal* journal, OutputBuffer& output, TradePrinter& trade_printer, MarketPrinter& market_printer, const Instrument instrument_limit) {
+	GreedyFillAllocator fill_allocator;
+	MutableTradeEventHandler<TradePrinter> mutable_trade_printer{ trade_printer };
+	AppMarket<MutableTradeEventHandler<TradePrinter>> market(fill_allocator, mutable_trade_printer);
+	for (Instrument instrument = 0; instrument < names.instruments.Size(); ++instrument) {
+		market.AddInstrument(instrument);
+	}
+	TimeStamp last_timestamp = 0;
+	if (options.recover && !Recover(options, names, instrument_limit, market, mutable_trade_printer, *journal, last_timestamp)) {
+		return 1;
 	}
 
-	if (!StringToPrice(words[4].c_str(), order.price)) {
-		return false;
+	std::unique_ptr<PeriodicSnapshots> snapshots;
+	if (options.snapshot_path) {
+		snapshots = std::make_unique<PeriodicSnapshots>(options.snapshot_path, options.snapshot_interval);
+	}
+	NewNameTracker new_names(names);
+	const bool input_ok = ForEachInputMessage(options, names, instrument_limit, last_timestamp, [&](OrderMessage& message) {
+		if (journal) {
+			journal->Append(message, new_names.Take(names));
+			LatencyProbe::Mark(LatencyStage::Journal);
+		}
+		if (!ProcessOrderMessage(market, mutable_trade_printer, message)) {
+			ReportRejectedMessage(message);
+		}
+		LatencyProbe::Mark(LatencyStage::Match);
+		LatencyProbe::End();
+		if (snapshots) {
+			snapshots->AfterMessage(market, names, message.order.key.timestamp);
+		}
+	}, [&output]() {
+		output.Flush();
+	});
+	const int result = PrintBook(options, output, market, market_printer, input_ok);
+	if (snapshots && !snapshots->Finish()) {
+		fprintf(stderr, "Cannot write snapshot %s\n", options.snapshot_path);
+		return 1;
 	}
+	return result;
+}
 
-	order.key.timestamp = timestamp;
+// Match on shard worker threads, while this thread reads messages and prints fills in message order.
+template<typename TradePrinter, typename MarketPrinter>
+int RunShardedMarket(const Options& options, NameTables& names, Journal* journal, OutputBuffer& output, TradePrinter& trade_printer, MarketPrinter& market_printer, const Instrument instrument_limit) {
+	ShardedMarket<FifoPriority, GreedyFillAllocator, ArrayLadder<>> market(options.shards);
+	for (Instrument instrument = 0; instrument < names.instruments.Size(); ++instrument) {
+		market.AddInstrument(instrument);
+	}
+	if (options.pin) {
+		PinThisThread(0);
+	}
+	market.Start(options.pin);
 
-	return true;
+	NewNameTracker new_names(names);
+	const bool input_ok = ForEachInputMessage(options, names, instrument_limit, 0, [&](const OrderMessage& message) {
+		if (journal) {
+			journal->Append(message, new_names.Take(names));
+			LatencyProbe::Mark(LatencyStage::Journal);
+		}
+		if ((!market.Submit(message, trade_printer)) && (OrderAction::New == message.action)) {
+			ReportRejectedMessage(message);
+		}
+		market.Poll(trade_printer);
+		LatencyProbe::End();
+	}, [&]() {
+		market.Drain(trade_printer);
+		output.Flush();
+	});
+	market.Finish(trade_printer);
+	return PrintBook(options, output, market, market_printer, input_ok);
 }
 
-void RunMarket() {
-	
-	std::string line;
-	GreedyFillAllocator fill_allocator;
-	TradeEventConsolePrinter trade_event_console_printer;
-	
-	Market<PriorityKey::TimeStampComparator, GreedyFillAllocator, TradeEventConsolePrinter> market(fill_allocator, trade_event_console_printer);
-	
-	TimeStamp t = 0;
-	while (std::getline(std::cin, line)) {
-		Side side = Side::Buy;
-		Instrument instrument;
-		Order aggressor_order;
+// Market data stage of a pipeline: runs a depth feed on its own thread off the best levels the matcher records
+// after each message, and writes the updates to their own file. It learns instrument names from the messages,
+// as the output stage does, so that it never reads the gateway's names while they grow.
+template<typename Pipeline>
+class DepthFeedStage {
+	static constexpr std::size_t kLevels = Pipeline::kMarketDataLevels;
+
+	NameTables names_;
+	OutputBuffer output_;
+	DepthUpdateBufferedPrinter printer_{ names_, output_ };
+	BestLevelsMirror<kLevels> mirror_;
+	DepthFeed<kLevels, DepthUpdateBufferedPrinter> feed_;
+	TimeStamp last_timestamp_ = 0;
 
-		if (!ParseLineToOrderParams(++t, line, side, instrument, aggressor_order)) {
-			continue;
+public:
+	// `names` must hold the instruments interned so far.
+	DepthFeedStage(const int fd, const TimeStamp window, const NameTables& names)
+		: output_(fd)
+		, feed_(printer_, window)
+	{
+		for (Instrument instrument = 0; instrument < names.instruments.Size(); ++instrument) {
+			names_.instruments.Intern(names.instruments.Name(instrument));
 		}
+	}
 
-		trade_event_console_printer.instrument = instrument;
+	void operator()(const OrderMessage& message, const NewNames& new_names, const typename Pipeline::MarketDataLevels* levels, std::uint64_t, bool) {
+		if (new_names.instrument) {
+			names_.instruments.Intern(*new_names.instrument);
+		}
+		if (levels) {
+			mirror_.Update(*levels);
+			feed_.HandleBookChange(levels->instrument);
+		}
+		last_timestamp_ = message.order.key.timestamp;
+		feed_.Publish(mirror_, last_timestamp_);
+	}
+
+	// Only once the pipeline has finished. Returns false if the feed could not be written.
+	bool Finish() {
+		feed_.Flush(mirror_, last_timestamp_);
+		return output_.Flush();
+	}
+};
 
-		if (Side::Buy == side) {
-			market.Buy(instrument, aggressor_order);
+// Parse on this thread, while fills are matched on another and printed on a third.
+// The printers use `printer_names`, which the output thread fills in as the parser interns names.
+// The journal reads the parsed messages on a thread of its own, alongside the matcher, and the depth feed on another, behind it.
+template<typename TradePrinter, typename MarketPrinter>
+int RunPipelinedMarket(const Options& options, NameTables& names, NameTables& printer_names, Journal* journal, OutputBuffer& output, TradePrinter& trade_printer, MarketPrinter& market_printer, const Instrument instrument_limit) {
+	using Pipeline = PipelinedMarket<FifoPriority, GreedyFillAllocator, TradePrinter, ArrayLadder<>>;
+	Pipeline market(trade_printer, printer_names);
+	for (Instrument instrument = 0; instrument < names.instruments.Size(); ++instrument) {
+		printer_names.instruments.Intern(names.instruments.Name(instrument));
+		market.AddInstrument(instrument);
+	}
+	if (journal && !market.AddInboundConsumer(*journal)) {
+		fprintf(stderr, "Cannot add the journal to the pipeline\n");
+		return 1;
+	}
+	int depth_feed_fd = -1;
+	std::unique_ptr<DepthFeedStage<Pipeline>> depth_feed;
+	if (options.depth_feed_path) {
+		depth_feed_fd = open(options.depth_feed_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (depth_feed_fd < 0) {
+			fprintf(stderr, "Cannot create depth feed %s\n", options.depth_feed_path);
+			return 1;
 		}
-		else {
-			market.Sell(instrument, aggressor_order);
+		depth_feed = std::make_unique<DepthFeedStage<Pipeline>>(depth_feed_fd, options.depth_window, names);
+		if (!market.AddMarketDataConsumer(*depth_feed)) {
+			fprintf(stderr, "Cannot add the depth feed to the pipeline\n");
+			close(depth_feed_fd);
+			return 1;
 		}
 	}
+	market.SetRejectedMessageHandler(ReportRejectedMessage);
+	// Fills are printed on the output thread, which writes them out once they are due while it waits for more
+	market.SetOutputIdleHandler([&output]() {
+		output.FlushIfDue();
+	});
+	if (options.pin) {
+		PinThisThread(0);
+	}
+	market.Start(options.pin);
 
-	printf("\n");
-	MarketConsolePrinter market_console_printer;
-	market.ForEachOrderByTime(market_console_printer);
+	NewNameTracker new_names(names);
+	const bool input_ok = ForEachInputMessage(options, names, instrument_limit, 0, [&](const OrderMessage& message) {
+		market.Submit(message, new_names.Take(names));
+		LatencyProbe::End();
+	}, NoIdleHandler{});
+	market.Finish();
+	int result = PrintBook(options, output, market, market_printer, input_ok);
+	if (depth_feed) {
+		const bool written = depth_feed->Finish() && (0 == close(depth_feed_fd));
+		if (!written) {
+			fprintf(stderr, "Cannot write depth feed %s\n", options.depth_feed_path);
+			result = 1;
+		}
+	}
+	return result;
 }
 
-int main() {
-	RunMarket();
-	return 0;
+template<typename TradePrinter, typename MarketPrinter>
+int Run(const Options& options, NameTables& names, NameTables& printer_names, OutputBuffer& output, TradePrinter& trade_printer, MarketPrinter& market_printer) {
+	// Without a symbol universe, binary instruments are still bounded so that a stray record cannot exhaust memory
+	constexpr Instrument default_instrument_limit = 1 << 16;
+	const auto instrument_limit = options.symbols_path ? static_cast<Instrument>(names.instruments.Size()) : default_instrument_limit;
+
+	// When recovering, the journal is reopened once it has been replayed
+	Journal journal(options.journal_params);
+	if (options.journal_path && (!options.recover) && !journal.Open(options.journal_path, names)) {
+		fprintf(stderr, "Cannot create journal %s\n", options.journal_path);
+		return 1;
+	}
+	Journal* const journal_or_null = options.journal_path ? &journal : nullptr;
+
+	int result = 0;
+	if (options.pipeline) {
+		result = RunPipelinedMarket(options, names, printer_names, journal_or_null, output, trade_printer, market_printer, instrument_limit);
+	}
+	else {
+		result = (options.shards > 0)
+			? RunShardedMarket(options, names, journal_or_null, output, trade_printer, market_printer, instrument_limit)
+			: RunMarket(options, names, journal_or_null, output, trade_printer, market_printer, instrument_limit);
+	}
+	if (!journal.Close()) {
+		fprintf(stderr, "Cannot write journal %s\n", options.journal_path);
+		return 1;
+	}
+	return result;
+}
+
+// Text in and out, or with --binary, binary records in and out.
+int RunApp(const Options& options) {
+	NameTables names;
+	if (options.symbols_path && !LoadSymbols(options.symbols_path, names)) {
+		fprintf(stderr, "Cannot read symbols from %s\n", options.symbols_path);
+		return 1;
+	}
+
+	// Printing on another thread than parsing needs names of its own
+	NameTables output_names;
+	NameTables& printer_names = options.pipeline ? output_names : names;
+
+	OutputBuffer output(STDOUT_FILENO);
+	if (options.binary) {
+		TradeEventWireWriter trade_writer{ output };
+		MarketWireWriter market_writer{ output };
+		return Run(options, names, printer_names, output, trade_writer, market_writer);
+	}
+	TradeEventBufferedPrinter trade_printer{ printer_names, output };
+	MarketBufferedPrinter market_printer{ printer_names, output };
+	return Run(options, names, printer_names, output, trade_printer, market_printer);
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+	if (!ParseOptions(argc, argv, options)) {
+		fprintf(stderr, "Usage: %s [--symbols FILE] [--binary] [--shards N | --pipeline] [--no-pin] [--journal FILE [--journal-sync-messages N] [--journal-sync-us US] [--recover]] [--snapshot FILE [--snapshot-every N]] [--depth-feed FILE [--depth-window N]] [ORDERS_FILE]\n", argv[0]);
+		return 1;
+	}
+	if constexpr (kLatencyStatsEnabled) {
+		// Per-stage latencies of every message, reported on stderr so as not to disturb the output
+		auto latency_stats = std::make_unique<LatencyStats>();
+		LatencyProbe::Attach(latency_stats.get());
+		const auto result = RunApp(options);
+		latency_stats->Report(stderr);
+		return result;
+	}
+	return RunApp(options);
 }
@@ -1,57 +1,371 @@
 #pragma once
+#include <cstddef>
+#include <cstdio>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "latency_stats.h"
+#include "market_data_handlers.h"
+#include "order_message.h"
 #include "orderbook.h"
+#include "orders_by_time.h"
+#include "snapshot.h"
 
-// All instruments' orderbooks
-template<typename MatchingOrdersComparator, typename FillAllocator, typename TradeEventHandler>
+// All instruments' orderbooks.
+// Instruments are dense handles (see interner.h), so orderbooks live in a vector indexed by instrument.
+// The market data handler is told of every change to the best bid or offer of an instrument, once per message that changes it,
+// and of every message that may have changed an instrument's levels.
+template<typename MatchingOrdersComparator, typename FillAllocator, typename TradeEventHandler, typename LadderPolicy = MapLadder, typename MarketDataHandler = NullMarketDataHandler>
 class Market {
+	using Book = Orderbook<MatchingOrdersComparator, FillAllocator, TradeEventHandler, LadderPolicy>;
+
+	// Orderbooks move when the vector grows, and resting order handles have to survive that.
+	static_assert(std::is_nothrow_move_constructible_v<Book>, "Orderbooks must not be copied when the vector grows");
+
+	// Where a resting order is, so that it can be found without searching.
+	struct RestingOrderHandle {
+		Instrument instrument;
+		Side side;
+		Price price;
+		typename Book::RestingOrder resting_order;
+	};
+	using RestingOrderHandles = std::unordered_map<Id, RestingOrderHandle>;
+
+	// Passes trade events on, and forgets resting orders once they are completely filled.
+	// Relies on fill allocators reporting a fill before taking its quantity off the resting order.
+	struct RestingOrderTracker {
+		TradeEventHandler& trade_event_handler;
+		RestingOrderHandles& resting_orders;
+
+		void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
+			LatencyProbe::BeginPublish();
+			trade_event_handler.HandleTradeEvent(side, matched_price, matched_quantity, aggressor_order, opposite_side_key);
+			LatencyProbe::EndPublish();
+
+			const auto it = resting_orders.find(opposite_side_key.id);
+			if (resting_orders.end() == it) {
+				return;
+			}
+			const auto& [key, quantity] = *(it->second.resting_order);
+			if ((key == opposite_side_key) && (quantity == matched_quantity)) {
+				resting_orders.erase(it);
+			}
+		}
+	};
+
 	FillAllocator& fill_allocator_;
 	TradeEventHandler& trade_event_handler_;
-	std::map<Instrument, Orderbook<MatchingOrdersComparator, FillAllocator, TradeEventHandler>> orderbooks_;
+	MarketDataHandler& market_data_handler_;
+	std::vector<Book> orderbooks_;
+	RestingOrderHandles resting_orders_;
+
+	// For markets constructed without a market data handler
+	static inline MarketDataHandler null_market_data_handler_{};
+
+	// Top of an instrument's book before a change, to compare with after it. Free without a market data handler.
+	TopOfBook TopBefore(const Instrument instrument) const {
+		if constexpr (kIsNullMarketDataHandler<MarketDataHandler>) {
+			return {};
+		}
+		else {
+			return (instrument < orderbooks_.size()) ? orderbooks_[instrument].Top() : TopOfBook{};
+		}
+	}
+
+	void PublishBookChange(const Instrument instrument, const TopOfBook& before) {
+		if constexpr (!kIsNullMarketDataHandler<MarketDataHandler>) {
+			const auto& top = orderbooks_[instrument].Top();
+			if (top != before) {
+				market_data_handler_.HandleBbo(instrument, top);
+			}
+			market_data_handler_.HandleBookChange(instrument);
+		}
+	}
+
+	FillExtent Enter(const Side side, const Instrument instrument, Order& aggressor_order, const TimeInForce time_in_force, const OrderType order_type) {
+		AddInstrument(instrument);
+		auto& orderbook = orderbooks_[instrument];
+		LatencyProbe::Mark(LatencyStage::Route);
+		RestingOrderTracker tracker{ trade_event_handler_, resting_orders_ };
+		return orderbook.Enter(side, fill_allocator_, tracker, aggressor_order, time_in_force, order_type, [&](const typename Book::RestingOrder resting_order) {
+			resting_orders_.insert_or_assign(aggressor_order.key.id, RestingOrderHandle{ instrument, side, aggressor_order.price, resting_order });
+		});
+	}
+
+	std::optional<FillExtent> EnterNew(const Side side, const Instrument instrument, Order& aggressor_order, const TimeInForce time_in_force, const OrderType order_type) {
+		// Ids of resting orders are unique, or the earlier order could no longer be cancelled or amended
+		if (resting_orders_.contains(aggressor_order.key.id)) {
+			LatencyProbe::Mark(LatencyStage::Route);
+			return std::nullopt;
+		}
+		const auto before = TopBefore(instrument);
+		const auto fill_extent = Enter(side, instrument, aggressor_order, time_in_force, order_type);
+		PublishBookChange(instrument, before);
+		return fill_extent;
+	}
 
 public:
-	Market(FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler)
+	using OrdersByTimeMerge = OrdersByTime<typename Book::PrioritySortedOrders>;
+
+	Market(FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler, MarketDataHandler& market_data_handler)
 		: fill_allocator_(fill_allocator)
 		, trade_event_handler_(trade_event_handler)
+		, market_data_handler_(market_data_handler)
+	{}
+
+	Market(FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler) requires kIsNullMarketDataHandler<MarketDataHandler>
+		: Market(fill_allocator, trade_event_handler, null_market_data_handler_)
 	{}
 
-	FillExtent Buy(const Instrument& instrument, Order& aggressor_order) {
-		return orderbooks_[instrument].Buy(fill_allocator_, trade_event_handler_, aggressor_order);
+	// Create the orderbook of an instrument up front, e.g. for each symbol of a known universe at start-up.
+	// Instruments first seen in Buy/Sell get their orderbook then.
+	void AddInstrument(const Instrument instrument) {
+		if (instrument >= orderbooks_.size()) {
+			orderbooks_.resize(static_cast<std::size_t>(instrument) + 1);
+		}
+	}
+
+	std::size_t InstrumentCount() const {
+		return orderbooks_.size();
+	}
+
+	// Match an aggressor, then rest what remains of it if it is a good till cancel limit order.
+	// Immediate-or-cancel orders discard the remainder; fill-or-kill orders that cannot trade in full do not trade at all.
+	// Market orders sweep the opposite side at any price (their price is set to MarketablePrice(side)), and never rest.
+	// An order whose id is that of an order still resting is rejected: it neither trades nor rests, and std::nullopt
+	// is returned instead of its fill extent.
+	std::optional<FillExtent> Buy(const Instrument& instrument, Order& aggressor_order, const TimeInForce time_in_force = TimeInForce::GoodTillCancel, const OrderType order_type = OrderType::Limit) {
+		return EnterNew(Side::Buy, instrument, aggressor_order, time_in_force, order_type);
+	}
+
+	std::optional<FillExtent> Sell(const Instrument& instrument, Order& aggressor_order, const TimeInForce time_in_force = TimeInForce::GoodTillCancel, const OrderType order_type = OrderType::Limit) {
+		return EnterNew(Side::Sell, instrument, aggressor_order, time_in_force, order_type);
+	}
+
+	// Remove a resting order. Returns false if there is no resting order with this id.
+	bool Cancel(const Id& id) {
+		const auto it = resting_orders_.find(id);
+		LatencyProbe::Mark(LatencyStage::Route);
+		if (resting_orders_.end() == it) {
+			return false;
+		}
+		const auto& handle = it->second;
+		const auto instrument = handle.instrument;
+		const auto before = TopBefore(instrument);
+		orderbooks_[instrument].Cancel(handle.side, handle.price, handle.resting_order);
+		resting_orders_.erase(it);
+		PublishBookChange(instrument, before);
+		return true;
+	}
+
+	// Change the price and/or remaining quantity of a resting order.
+	// Reducing the quantity at the same price is done in place, so the order keeps its priority.
+	// Any other change loses priority: the order is taken out of its level and entered again as an aggressor
+	// with the new timestamp, trading with the opposite side if the new price crosses the spread.
+	// An amend to zero quantity cancels the order.
+	// Returns the fill extent of the amended order, or std::nullopt if there is no resting order with this id.
+	std::optional<FillExtent> Amend(const Id& id, const Price new_price, const Quantity new_quantity, const TimeStamp timestamp) {
+		const auto it = resting_orders_.find(id);
+		LatencyProbe::Mark(LatencyStage::Route);
+		if (resting_orders_.end() == it) {
+			return std::nullopt;
+		}
+		const auto handle = it->second;
+		const auto& [key, quantity] = *(handle.resting_order);
+		const auto before = TopBefore(handle.instrument);
+		if ((new_price == handle.price) && (new_quantity <= quantity) && (0 != new_quantity)) {
+			orderbooks_[handle.instrument].Reduce(handle.side, handle.price, handle.resting_order, new_quantity);
+			PublishBookChange(handle.instrument, before);
+			return FillExtent::None;
+		}
+
+		Order amended_order = { new_price, new_quantity, { key.id, timestamp } };
+		orderbooks_[handle.instrument].Cancel(handle.side, handle.price, handle.resting_order);
+		resting_orders_.erase(it);
+		auto fill_extent = FillExtent::None;
+		if (0 != new_quantity) {
+			fill_extent = Enter(handle.side, handle.instrument, amended_order, TimeInForce::GoodTillCancel, OrderType::Limit);
+		}
+		PublishBookChange(handle.instrument, before);
+		return fill_extent;
+	}
+
+	// Instrument of a resting order, or std::nullopt if there is no resting order with this id.
+	std::optional<Instrument> RestingOrderInstrument(const Id& id) const {
+		const auto it = resting_orders_.find(id);
+		if (resting_orders_.end() == it) {
+			return std::nullopt;
+		}
+		return it->second.instrument;
+	}
+
+	// Total quantity and number of orders at a price of an instrument, or std::nullopt if no order rests there.
+	std::optional<LevelSummary> LevelAt(const Instrument instrument, const Side side, const Price price) const {
+		if (instrument >= orderbooks_.size()) {
+			return std::nullopt;
+		}
+		return orderbooks_[instrument].LevelAt(side, price);
+	}
+
+	// Fill `depth` with the best levels of one side of an instrument, best first, and return how many there are.
+	std::size_t Depth(const Instrument instrument, const Side side, const std::span<LevelSummary> depth) const {
+		if (instrument >= orderbooks_.size()) {
+			return 0;
+		}
+		return orderbooks_[instrument].Depth(side, depth);
+	}
+
+	// Best bid and offer of an instrument, kept up to date as orders come and go, so this is constant time.
+	TopOfBook Top(const Instrument instrument) const {
+		return (instrument < orderbooks_.size()) ? orderbooks_[instrument].Top() : TopOfBook{};
+	}
+
+	LevelSummary BestBid(const Instrument instrument) const {
+		return Top(instrument).bid;
 	}
 
-	FillExtent Sell(const Instrument& instrument, Order& aggressor_order) {
-		return orderbooks_[instrument].Sell(fill_allocator_, trade_event_handler_, aggressor_order);
+	LevelSummary BestAsk(const Instrument instrument) const {
+		return Top(instrument).ask;
 	}
 
 	const auto& Buys(const Instrument& instrument) const {
-		return orderbooks_[instrument].Buys();
+		return orderbooks_.at(instrument).Buys();
 	}
 
 	const auto& Sells(const Instrument& instrument) const {
-		return orderbooks_[instrument].Sells();
+		return orderbooks_.at(instrument).Sells();
 	}
 
-	template<typename FullOrderDetailHandler>
-	void ForEachOrderByTime(FullOrderDetailHandler& full_order_details_handler) const {
-		std::map<TimeStamp, FullOrderDetail> sells_timestamp_to_full_order_details;
-		std::map<TimeStamp, FullOrderDetail> buys_timestamp_to_full_order_details;
-		for (const auto& [instrument, orderbook] : orderbooks_) {
-			for (const auto& [price, keys] : orderbook.Sells()) {
-				for (const auto& [key, quantity] : keys) {
-					sells_timestamp_to_full_order_details[key.timestamp] = { Side::Sell, instrument, { price, quantity, key } };
+	// Write every resting order, level by level, as of the message with timestamp `last_timestamp`.
+	// Best run in a forked child (see ForkSnapshot), so that matching carries on meanwhile.
+	void Snapshot(SnapshotWriter& writer, const TimeStamp last_timestamp) const {
+		writer.Header(last_timestamp, orderbooks_.size(), resting_orders_.size());
+		const auto write_levels = [&writer](const Instrument instrument, const Side side, const auto& levels) {
+			for (const auto& [price, resting_orders] : levels) {
+				writer.Level(instrument, side, price, resting_orders.size());
+				for (const auto& [key, quantity] : resting_orders) {
+					writer.RestingOrder(key, quantity);
 				}
 			}
-			for (const auto& [price, keys] : orderbook.Buys()) {
-				for (const auto& [key, quantity] : keys) {
-					buys_timestamp_to_full_order_details[key.timestamp] = { Side::Buy, instrument, { price, quantity, key } };
+		};
+		for (Instrument instrument = 0; instrument < orderbooks_.size(); ++instrument) {
+			write_levels(instrument, Side::Sell, orderbooks_[instrument].Sells());
+			write_levels(instrument, Side::Buy, orderbooks_[instrument].Buys());
+		}
+		writer.End();
+	}
+
+	// Replace every orderbook with the levels of a snapshot, and set `last_timestamp` to the snapshot's.
+	// Levels are built in bulk: orders are appended to their level in priority order, with no matching or searching,
+	// and the id index is sized for all of them up front.
+	// A level with two orders of equal priority, or an order with the id of another, is a bad level.
+	// On an error, the market is left with whatever was restored before it.
+	SnapshotError Restore(SnapshotReader& reader, TimeStamp& last_timestamp) {
+		std::size_t instrument_count = 0;
+		std::size_t order_count = 0;
+		if (const auto error = reader.Header(last_timestamp, instrument_count, order_count); SnapshotError::None != error) {
+			return error;
+		}
+		orderbooks_.clear();
+		resting_orders_.clear();
+		orderbooks_.resize(instrument_count);
+		resting_orders_.reserve(order_count);
+
+		Instrument instrument = 0;
+		Side side = Side::Buy;
+		Price price = 0;
+		std::size_t level_order_count = 0;
+		PriorityKey key{};
+		Quantity quantity = 0;
+		const auto refresh_tops = [this] {
+			for (auto& orderbook : orderbooks_) {
+				orderbook.RefreshTop();
+			}
+		};
+		while (reader.NextLevel(instrument, side, price, level_order_count)) {
+			if ((instrument >= orderbooks_.size()) || (0 == level_order_count)) {
+				refresh_tops();
+				return SnapshotError::BadLevel;
+			}
+			auto& level = orderbooks_[instrument].AppendLevel(side, price);
+			for (std::size_t i = 0; i < level_order_count; ++i) {
+				if (!reader.NextOrder(key, quantity)) {
+					refresh_tops();
+					return reader.Error();
+				}
+				const auto [resting_order, added] = level.Add(key, quantity);
+				if (!added) {
+					refresh_tops();
+					return SnapshotError::BadLevel;
+				}
+				if (!resting_orders_.try_emplace(key.id, RestingOrderHandle{ instrument, side, price, resting_order }).second) {
+					level.Remove(resting_order);
+					refresh_tops();
+					return SnapshotError::BadLevel;
 				}
 			}
 		}
+		refresh_tops();
+		return reader.Error();
+	}
 
-		for (const auto& [timestamp, full_order_detail] : sells_timestamp_to_full_order_details) {
-			full_order_details_handler.HandleFullOrderDetail(full_order_detail);
+	// Add the levels of one side of every orderbook to a merge of their orders by time.
+	void AddLevelsTo(OrdersByTimeMerge& merge, const Side side) const {
+		for (Instrument instrument = 0; instrument < orderbooks_.size(); ++instrument) {
+			if (Side::Sell == side) {
+				merge.AddLevels(instrument, orderbooks_[instrument].Sells());
+			}
+			else {
+				merge.AddLevels(instrument, orderbooks_[instrument].Buys());
+			}
 		}
-		for (const auto& [timestamp, full_order_detail] : buys_timestamp_to_full_order_details) {
-			full_order_details_handler.HandleFullOrderDetail(full_order_detail);
+	}
+
+	// Every resting order: sells, then buys, each by time.
+	// Streams out of a merge of the levels (see OrdersByTime), so it takes extra memory per level rather than per order.
+	template<typename FullOrderDetailHandler>
+	void ForEachOrderByTime(FullOrderDetailHandler& full_order_details_handler) const {
+		OrdersByTimeMerge merge;
+		for (const Side side : { Side::Sell, Side::Buy }) {
+			merge.Reset(side);
+			AddLevelsTo(merge, side);
+			merge.Drain(full_order_details_handler);
 		}
 	}
 };
+
+// Send one inbound message to a market.
+// Trade event handlers with an `instrument` member (e.g. the printers) are told which instrument the message trades in.
+// Returns false if the market rejected the message: a new order reusing the id of an order that is still live.
+template<typename Market, typename TradeEventHandler>
+bool ProcessOrderMessage(Market& market, TradeEventHandler& trade_event_handler, OrderMessage& message) {
+	Order& aggressor_order = message.order;
+	switch (message.action) {
+	case OrderAction::Cancel:
+		market.Cancel(aggressor_order.key.id);
+		break;
+
+	case OrderAction::Amend:
+		// Amends that cross the spread trade in the amended order's instrument
+		if (const auto resting_instrument = market.RestingOrderInstrument(aggressor_order.key.id)) {
+			trade_event_handler.instrument = *resting_instrument;
+		}
+		market.Amend(aggressor_order.key.id, aggressor_order.price, aggressor_order.quantity, aggressor_order.key.timestamp);
+		break;
+
+	case OrderAction::New:
+		trade_event_handler.instrument = message.instrument;
+		if (Side::Buy == message.side) {
+			return market.Buy(message.instrument, aggressor_order, message.time_in_force, message.type).has_value();
+		}
+		return market.Sell(message.instrument, aggressor_order, message.time_in_force, message.type).has_value();
+	}
+	return true;
+}
+
+// Report a message the market rejected on stderr, as input that cannot be parsed is reported.
+inline void ReportRejectedMessage(const OrderMessage& message) {
+	fprintf(stderr, "Ignoring message %llu (order id is still live)\n", message.order.key.timestamp);
+}
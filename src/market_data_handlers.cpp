@@ -0,0 +1,16 @@
+#include "market_data_handlers.h"
+
+void DepthUpdateBufferedPrinter::HandleDepthUpdate(const DepthUpdate& update) {
+	static constexpr std::string_view kActions[] = { " ADD ", " MODIFY ", " DELETE " };
+	output.Append("DEPTH ");
+	output.Append(names.instruments.Name(update.instrument));
+	output.Append((Side::Buy == update.side) ? " BUY" : " SELL");
+	output.Append(kActions[static_cast<std::size_t>(update.action)]);
+	output.Append(update.level.price);
+	output.Append(' ');
+	output.Append(update.level.quantity);
+	output.Append(' ');
+	output.Append(static_cast<unsigned long long>(update.level.order_count));
+	output.Append('\n');
+	output.EndRecord();
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <span>
+#include <type_traits>
+#include <vector>
+#include "common_types.h"
+#include "interner.h"
+#include "output_buffer.h"
+
+// Market data handler that ignores every change, so that markets without one pay nothing for keeping track.
+struct NullMarketDataHandler {
+	void HandleBbo(const Instrument, const TopOfBook&) {}
+	void HandleBookChange(const Instrument) {}
+};
+
+template<typename MarketDataHandler>
+constexpr bool kIsNullMarketDataHandler = std::is_same_v<MarketDataHandler, NullMarketDataHandler>;
+
+// Best levels of both sides of one instrument's book as of some moment, e.g. right after a message was matched,
+// for handing to another thread along with the message.
+template<std::size_t kLevels>
+struct BestLevels {
+	Instrument instrument = 0;
+	std::size_t bid_count = 0;
+	std::size_t ask_count = 0;
+	std::array<LevelSummary, kLevels> bids{};
+	std::array<LevelSummary, kLevels> asks{};
+
+	template<typename Market>
+	void Read(const Market& market, const Instrument of) {
+		instrument = of;
+		bid_count = market.Depth(of, Side::Buy, bids);
+		ask_count = market.Depth(of, Side::Sell, asks);
+	}
+};
+
+// Copy of the best levels of every instrument, kept up to date from BestLevels read off a market on another thread.
+// Answers Depth() like a Market does, so that a DepthFeed can publish from it on the thread that keeps it.
+template<std::size_t kLevels>
+class BestLevelsMirror {
+	std::vector<BestLevels<kLevels>> instruments_;
+
+public:
+	void Update(const BestLevels<kLevels>& levels) {
+		if (levels.instrument >= instruments_.size()) {
+			instruments_.resize(static_cast<std::size_t>(levels.instrument) + 1);
+		}
+		instruments_[levels.instrument] = levels;
+	}
+
+	// Up to kLevels levels
+	std::size_t Depth(const Instrument instrument, const Side side, const std::span<LevelSummary> depth) const {
+		if (instrument >= instruments_.size()) {
+			return 0;
+		}
+		const auto& levels = instruments_[instrument];
+		const auto count = std::min(depth.size(), (Side::Buy == side) ? levels.bid_count : levels.ask_count);
+		std::copy_n(((Side::Buy == side) ? levels.bids : levels.asks).begin(), count, depth.begin());
+		return count;
+	}
+};
+
+// Prints each depth update as a line "DEPTH INSTRUMENT SIDE ACTION PRICE QUANTITY ORDERS" into an OutputBuffer,
+// e.g. "DEPTH ABC SELL MODIFY 10001 30 2". Deleted levels are printed as they last were.
+struct DepthUpdateBufferedPrinter {
+	const NameTables& names;
+	OutputBuffer& output;
+	void HandleDepthUpdate(const DepthUpdate& update);
+};
+
+// Incremental depth feed of the best kLevels levels of each side of every instrument, plugged into a Market as its
+// market data handler. The market tells it which instruments' levels may have changed; Publish() then diffs the best
+// levels of each of those against what it last published, and hands the difference to the depth update handler
+// as add, modify and delete level updates. Levels come from the orderbooks' level totals (see Market::Depth),
+// so a diff costs O(kLevels) whatever the number of orders, and nothing is copied but the levels published.
+// Updates are conflated per instrument: once an instrument has been published, changes to it within the next `window`
+// timestamps wait, and go out as one diff when a Publish() comes after the window. A level that changed many times
+// meanwhile is published once, as it is by then, and one that came and went is not published at all.
+// A level pushed out of the best kLevels is deleted, and one that moves into them is added.
+template<std::size_t kLevels, typename DepthUpdateHandler>
+class DepthFeed {
+	struct PublishedLevels {
+		std::array<LevelSummary, kLevels> bids{};
+		std::array<LevelSummary, kLevels> asks{};
+		std::size_t bid_count = 0;
+		std::size_t ask_count = 0;
+		TimeStamp published_at = 0;
+		bool ever_published = false;
+		bool pending = false;
+	};
+
+	DepthUpdateHandler& depth_update_handler_;
+	const TimeStamp window_;
+	std::vector<PublishedLevels> instruments_;
+	// Instruments that changed since they were last published, in the order they first changed
+	std::vector<Instrument> pending_;
+
+	static bool Better(const Side side, const Price lhs, const Price rhs) {
+		return (Side::Buy == side) ? (lhs > rhs) : (lhs < rhs);
+	}
+
+	// Both before and after are best first, so one merge-like walk finds every level added, modified or deleted.
+	void Diff(const Instrument instrument, const Side side, const std::span<const LevelSummary> before, const std::span<const LevelSummary> after) {
+		std::size_t i = 0;
+		std::size_t j = 0;
+		while ((i < before.size()) || (j < after.size())) {
+			if ((j == after.size()) || ((i < before.size()) && Better(side, before[i].price, after[j].price))) {
+				depth_update_handler_.HandleDepthUpdate({ instrument, side, LevelAction::Delete, before[i++] });
+			}
+			else if ((i == before.size()) || Better(side, after[j].price, before[i].price)) {
+				depth_update_handler_.HandleDepthUpdate({ instrument, side, LevelAction::Add, after[j++] });
+			}
+			else {
+				if (before[i] != after[j]) {
+					depth_update_handler_.HandleDepthUpdate({ instrument, side, LevelAction::Modify, after[j] });
+				}
+				++i;
+				++j;
+			}
+		}
+	}
+
+	template<typename Market>
+	void PublishInstrument(const Market& market, const Instrument instrument, const TimeStamp now) {
+		auto& published = instruments_[instrument];
+		std::array<LevelSummary, kLevels> levels{};
+		for (const Side side : { Side::Buy, Side::Sell }) {
+			auto& last_levels = (Side::Buy == side) ? published.bids : published.asks;
+			auto& last_count = (Side::Buy == side) ? published.bid_count : published.ask_count;
+			const auto count = market.Depth(instrument, side, levels);
+			Diff(instrument, side, std::span<const LevelSummary>(last_levels.data(), last_count), std::span<const LevelSummary>(levels.data(), count));
+			std::copy_n(levels.begin(), count, last_levels.begin());
+			last_count = count;
+		}
+		published.published_at = now;
+		published.ever_published = true;
+		published.pending = false;
+	}
+
+public:
+	explicit DepthFeed(DepthUpdateHandler& depth_update_handler, const TimeStamp window = 0)
+		: depth_update_handler_(depth_update_handler)
+		, window_(window)
+	{}
+
+	// The best bid and offer are the first level of each side, so they are published with the rest of the depth.
+	void HandleBbo(const Instrument, const TopOfBook&) {}
+
+	void HandleBookChange(const Instrument instrument) {
+		if (instrument >= instruments_.size()) {
+			instruments_.resize(static_cast<std::size_t>(instrument) + 1);
+		}
+		auto& published = instruments_[instrument];
+		if (!published.pending) {
+			published.pending = true;
+			pending_.push_back(instrument);
+		}
+	}
+
+	// Publish the changes to every instrument whose conflation window has passed by `now`, e.g. the timestamp of
+	// the message just processed. Changes to the others keep until a later Publish() or Flush().
+	template<typename Market>
+	void Publish(const Market& market, const TimeStamp now) {
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < pending_.size(); ++i) {
+			const auto instrument = pending_[i];
+			const auto& published = instruments_[instrument];
+			if (published.ever_published && (now - published.published_at < window_)) {
+				pending_[kept++] = instrument;
+			}
+			else {
+				PublishInstrument(market, instrument, now);
+			}
+		}
+		pending_.resize(kept);
+	}
+
+	// Publish the changes to every instrument, whatever their window, e.g. at the end of a batch or at shutdown.
+	template<typename Market>
+	void Flush(const Market& market, const TimeStamp now) {
+		for (const auto instrument : pending_) {
+			PublishInstrument(market, instrument, now);
+		}
+		pending_.clear();
+	}
+
+	// Number of instruments with changes waiting to be published
+	std::size_t PendingCount() const {
+		return pending_.size();
+	}
+};
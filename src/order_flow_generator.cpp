@@ -0,0 +1,81 @@
+#include "order_flow_generator.h"
+#include <algorithm>
+#include <cmath>
+
+OrderFlowGenerator::OrderFlowGenerator(const OrderFlowParams& params)
+	: params_(params)
+	, state_(params.seed)
+	, touches_(std::max<Instrument>(params.instruments, 1), params.start_price)
+{
+	double total = 0;
+	popularity_cdf_.reserve(touches_.size());
+	for (std::size_t k = 1; k <= touches_.size(); ++k) {
+		total += 1.0 / std::pow(static_cast<double>(k), params_.zipf_exponent);
+		popularity_cdf_.push_back(total);
+	}
+	for (auto& cumulative : popularity_cdf_) {
+		cumulative /= total;
+	}
+}
+
+// splitmix64
+std::uint64_t OrderFlowGenerator::NextRandom() {
+	std::uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+double OrderFlowGenerator::NextUniform() {
+	return static_cast<double>(NextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double OrderFlowGenerator::NextExponential(const double mean) {
+	return -mean * std::log(1.0 - NextUniform());
+}
+
+Instrument OrderFlowGenerator::NextInstrument() {
+	const auto it = std::upper_bound(popularity_cdf_.begin(), popularity_cdf_.end(), NextUniform());
+	const auto instrument = static_cast<std::size_t>(it - popularity_cdf_.begin());
+	return static_cast<Instrument>(std::min(instrument, popularity_cdf_.size() - 1));
+}
+
+void OrderFlowGenerator::Next(OrderMessage& message) {
+	Order& order = message.order;
+	order.key.timestamp = next_timestamp_++;
+
+	if ((!live_ids_.empty()) && (NextUniform() < params_.cancel_ratio)) {
+		// Cancel a random live order
+		const auto i = static_cast<std::size_t>(NextRandom() % live_ids_.size());
+		message.action = OrderAction::Cancel;
+		order.key.id = live_ids_[i];
+		live_ids_[i] = live_ids_.back();
+		live_ids_.pop_back();
+		return;
+	}
+
+	message.action = OrderAction::New;
+	message.side = (0 == (NextRandom() & 1)) ? Side::Buy : Side::Sell;
+	message.instrument = NextInstrument();
+	order.key.id = next_id_++;
+	order.quantity = 1 + static_cast<Quantity>(NextExponential(std::max(params_.mean_size - 1.0, 0.0)));
+	live_ids_.push_back(order.key.id);
+
+	// The touch drifts by a tick now and then
+	Price& touch = touches_[message.instrument];
+	const auto drift = NextRandom() % 16;
+	if ((0 == drift) && (touch > 1)) {
+		--touch;
+	}
+	else if (1 == drift) {
+		++touch;
+	}
+
+	// Passive orders rest behind the touch, aggressive ones reach through it
+	const auto distance = static_cast<Price>(NextExponential(params_.mean_distance_ticks));
+	const bool aggressive = NextUniform() < params_.aggressor_ratio;
+	const bool below_touch = (Side::Buy == message.side) != aggressive;
+	order.price = below_touch
+		? ((touch > distance + 1) ? (touch - distance - 1) : 1)
+		: (touch + distance + 1);
+}
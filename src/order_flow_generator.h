@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "common_types.h"
+#include "order_message.h"
+
+// Shape of a synthetic order flow.
+struct OrderFlowParams {
+	std::uint64_t seed = 1;
+	// Instruments are 0 .. instruments-1, in decreasing order of popularity
+	Instrument instruments = 100;
+	// Popularity of the k-th most popular instrument is proportional to 1 / k^zipf_exponent; 0 makes all equally popular
+	double zipf_exponent = 1.0;
+	// Where every instrument's touch starts; it then takes a random walk
+	Price start_price = 10000;
+	// Mean distance in ticks of a passive order from the touch, and of an aggressive order through it
+	double mean_distance_ticks = 4.0;
+	// Mean order size; sizes are 1 plus an exponentially distributed number of units
+	double mean_size = 10.0;
+	// Fraction of messages that cancel a random earlier order, rather than entering a new one
+	double cancel_ratio = 0.3;
+	// Fraction of new orders that are priced through the touch, and so are likely to trade
+	double aggressor_ratio = 0.1;
+};
+
+// Generates a reproducible stream of new orders and cancels: the same params always give the same stream,
+// on every platform, since it uses its own random number generator and distributions.
+// Order ids are 0, 1, 2, ... in order of entry. Cancels pick a random order that has not been cancelled yet;
+// it may have traded away in the meantime, as the generator does not run a market.
+class OrderFlowGenerator {
+	OrderFlowParams params_;
+	std::uint64_t state_;
+	// Cumulative popularity of instruments 0..k, for drawing instruments by popularity
+	std::vector<double> popularity_cdf_;
+	std::vector<Price> touches_;
+	std::vector<Id> live_ids_;
+	Id next_id_ = 0;
+	TimeStamp next_timestamp_ = 1;
+
+	std::uint64_t NextRandom();
+	// Uniform in [0, 1)
+	double NextUniform();
+	double NextExponential(double mean);
+	Instrument NextInstrument();
+
+public:
+	explicit OrderFlowGenerator(const OrderFlowParams& params);
+
+	// The next message; cancels only use the action and the order id.
+	void Next(OrderMessage& message);
+};
@@ -0,0 +1,20 @@
+#pragma once
+#include "common_types.h"
+
+enum class OrderAction {
+	New,
+	Cancel,
+	Amend,
+};
+
+// One inbound message, as decoded by a gateway, with ids and instruments already interned.
+// Cancels only use order.key.id; amends also use the order's price, quantity and timestamp.
+// Amended orders always rest what remains of them, whatever their original time in force. Market orders ignore order.price.
+struct OrderMessage {
+	OrderAction action;
+	Side side;
+	Instrument instrument;
+	OrderType type;
+	TimeInForce time_in_force;
+	Order order;
+};
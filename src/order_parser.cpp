@@ -0,0 +1,160 @@
+#include "order_parser.h"
+#include <charconv>
+#include <system_error>
+
+namespace {
+	bool IsSeparator(const char c) {
+		return (' ' == c) || ('\t' == c) || ('\r' == c);
+	}
+
+	// Yields the fields of a line, one at a time, as views into the line.
+	class FieldCursor {
+		const char* next_;
+		const char* const end_;
+
+	public:
+		explicit FieldCursor(const std::string_view line)
+			: next_(line.data())
+			, end_(line.data() + line.size())
+		{}
+
+		bool Next(std::string_view& field) {
+			while ((next_ != end_) && IsSeparator(*next_)) {
+				++next_;
+			}
+			if (next_ == end_) {
+				return false;
+			}
+			const char* const begin = next_;
+			while ((next_ != end_) && !IsSeparator(*next_)) {
+				++next_;
+			}
+			field = std::string_view(begin, static_cast<std::size_t>(next_ - begin));
+			return true;
+		}
+	};
+
+	// The whole field has to be a number.
+	bool FieldToUnsignedLongLong(const std::string_view field, unsigned long long& number) {
+		const char* const end = field.data() + field.size();
+		const auto [ptr, ec] = std::from_chars(field.data(), end, number);
+		return (std::errc() == ec) && (end == ptr);
+	}
+
+	// New orders may have MKT as their price, which makes them market orders; amends may not (`order_type` is null).
+	ParseError ParseQuantityAndPrice(FieldCursor& fields, Order& order, OrderType* order_type = nullptr) {
+		std::string_view field;
+		if (!fields.Next(field)) {
+			return ParseError::MissingFields;
+		}
+		if (!FieldToUnsignedLongLong(field, order.quantity)) {
+			return ParseError::InvalidQuantity;
+		}
+		if (!fields.Next(field)) {
+			return ParseError::MissingFields;
+		}
+		if (order_type) {
+			*order_type = OrderType::Limit;
+			if ("MKT" == field) {
+				*order_type = OrderType::Market;
+				order.price = 0;
+				return ParseError::None;
+			}
+		}
+		if (!FieldToUnsignedLongLong(field, order.price)) {
+			return ParseError::InvalidPrice;
+		}
+		return ParseError::None;
+	}
+
+	// The time in force is optional, and defaults to good till cancel.
+	ParseError ParseTimeInForce(FieldCursor& fields, TimeInForce& time_in_force) {
+		std::string_view field;
+		if ((!fields.Next(field)) || ("GTC" == field)) {
+			time_in_force = TimeInForce::GoodTillCancel;
+		}
+		else if ("IOC" == field) {
+			time_in_force = TimeInForce::ImmediateOrCancel;
+		}
+		else if ("FOK" == field) {
+			time_in_force = TimeInForce::FillOrKill;
+		}
+		else {
+			return ParseError::UnknownTimeInForce;
+		}
+		return ParseError::None;
+	}
+}
+
+const char* ToString(const ParseError error) {
+	switch (error) {
+	case ParseError::None: return "no error";
+	case ParseError::EmptyLine: return "empty line";
+	case ParseError::MissingFields: return "missing fields";
+	case ParseError::UnknownAction: return "expected BUY, SELL, CANCEL or AMEND";
+	case ParseError::InvalidQuantity: return "quantity is not an unsigned integer";
+	case ParseError::InvalidPrice: return "price is not an unsigned integer";
+	case ParseError::UnknownOrderId: return "no order was entered with this id";
+	case ParseError::UnknownTimeInForce: return "expected GTC, IOC or FOK";
+	}
+	return "unknown error";
+}
+
+ParseError ParseLineToOrderParams(const TimeStamp timestamp, const std::string_view line, NameTables& names, OrderMessage& message) {
+	FieldCursor fields(line);
+	std::string_view id;
+	if (!fields.Next(id)) {
+		return ParseError::EmptyLine;
+	}
+	std::string_view action;
+	if (!fields.Next(action)) {
+		return ParseError::MissingFields;
+	}
+
+	Order& order = message.order;
+	order.key.timestamp = timestamp;
+
+	if (("CANCEL" == action) || ("AMEND" == action)) {
+		// Orders that were never entered cannot be cancelled or amended
+		const auto existing_id = names.order_ids.Find(id);
+		if (!existing_id) {
+			return ParseError::UnknownOrderId;
+		}
+		order.key.id = *existing_id;
+
+		if ("CANCEL" == action) {
+			message.action = OrderAction::Cancel;
+			return ParseError::None;
+		}
+		message.action = OrderAction::Amend;
+		return ParseQuantityAndPrice(fields, order);
+	}
+
+	if ("BUY" == action) {
+		message.side = Side::Buy;
+	}
+	else if ("SELL" == action) {
+		message.side = Side::Sell;
+	}
+	else {
+		return ParseError::UnknownAction;
+	}
+	message.action = OrderAction::New;
+
+	std::string_view instrument;
+	if (!fields.Next(instrument)) {
+		return ParseError::MissingFields;
+	}
+	auto error = ParseQuantityAndPrice(fields, order, &message.type);
+	if (ParseError::None == error) {
+		error = ParseTimeInForce(fields, message.time_in_force);
+	}
+	if (ParseError::None != error) {
+		return error;
+	}
+
+	// Only intern names once the whole line is known to be valid
+	order.key.id = names.order_ids.Intern(id);
+	message.instrument = names.instruments.Intern(instrument);
+	return ParseError::None;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <string_view>
+#include "common_types.h"
+#include "interner.h"
+#include "order_message.h"
+
+// Why a line of text could not be parsed into an OrderMessage.
+enum class ParseError {
+	None,
+	EmptyLine,
+	MissingFields,
+	UnknownAction,
+	InvalidQuantity,
+	InvalidPrice,
+	UnknownOrderId,
+	UnknownTimeInForce,
+};
+
+const char* ToString(const ParseError error);
+
+// Parse one line of the text order entry format:
+//   "ID SIDE INSTRUMENT QTY PRICE [TIF]" for a new order, where SIDE is BUY or SELL, PRICE is MKT for a market order,
+//     and the optional TIF is GTC (the default), IOC or FOK,
+//   "ID CANCEL", or
+//   "ID AMEND QTY PRICE".
+// Fields are separated by spaces (or tabs). A sixth field of a new order is always read as its time in force,
+// so anything else there is UnknownTimeInForce rather than ignored; anything after the last field of a format is ignored.
+// The line is tokenized in place and numbers are converted with std::from_chars, so nothing is allocated,
+// except when interning an id or instrument that has not been seen before.
+ParseError ParseLineToOrderParams(const TimeStamp timestamp, const std::string_view line, NameTables& names, OrderMessage& message);
@@ -0,0 +1,24 @@
+#include "order_queue.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+	constexpr std::size_t kNodesPerBlock = 4096;
+
+	// Blocks are shared by all threads and never freed, so nodes stay valid whichever thread releases them.
+	std::mutex blocks_mutex;
+	std::vector<std::unique_ptr<OrderNode[]>> blocks;
+}
+
+OrderNode* OrderNodePool::AllocateBlock() {
+	auto block = std::make_unique<OrderNode[]>(kNodesPerBlock);
+	for (std::size_t i = 0; i + 1 < kNodesPerBlock; ++i) {
+		block[i].next = &block[i + 1];
+	}
+	OrderNode* first = block.get();
+
+	const std::lock_guard<std::mutex> lock(blocks_mutex);
+	blocks.push_back(std::move(block));
+	return first;
+}
@@ -0,0 +1,240 @@
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include "common_types.h"
+
+// Time priority by arrival alone: the earliest order at a price is always filled first.
+// Orderbooks prioritised this way keep each price level in an OrderQueue rather than a sorted std::map,
+// since a newly resting order always goes to the back of its level.
+struct FifoPriority {};
+
+// Resting order in an OrderQueue.
+// `entry` has the same shape as the value_type of std::map<PriorityKey, Quantity>,
+// so fill allocators can walk an OrderQueue just like they walk a map of resting orders.
+struct OrderNode {
+	std::pair<PriorityKey, Quantity> entry;
+	OrderNode* prev = nullptr;
+	OrderNode* next = nullptr;
+};
+
+// Recycles OrderNodes, so that resting an order does not allocate.
+// Nodes are carved out of blocks that are kept for the lifetime of the process.
+// Each thread has its own free list; a node may be released by a different thread than the one that acquired it.
+class OrderNodePool {
+	struct FreeList {
+		OrderNode* head = nullptr;
+	};
+
+	static FreeList& ThreadFreeList() {
+		thread_local FreeList free_list;
+		return free_list;
+	}
+
+	// Allocates a block of nodes, linked together through `next`, and returns the first one.
+	static OrderNode* AllocateBlock();
+
+public:
+	static OrderNode* Acquire() {
+		auto& free_list = ThreadFreeList();
+		if (!free_list.head) {
+			free_list.head = AllocateBlock();
+		}
+		OrderNode* node = free_list.head;
+		free_list.head = node->next;
+		node->prev = nullptr;
+		node->next = nullptr;
+		return node;
+	}
+
+	// Release a chain of nodes linked through `next`, from `first` to `last` inclusive.
+	static void Release(OrderNode* first, OrderNode* last) {
+		auto& free_list = ThreadFreeList();
+		last->next = free_list.head;
+		free_list.head = first;
+	}
+
+	static void Release(OrderNode* node) {
+		Release(node, node);
+	}
+};
+
+// Resting orders of one price level in arrival order, as an intrusive doubly linked list of pooled nodes.
+// push_back, pop_front and erase of any order are all O(1), and iterators stay valid until their order is erased.
+// emplace() appends, so orders must be added in time priority order.
+class OrderQueue {
+	OrderNode* head_ = nullptr;
+	OrderNode* tail_ = nullptr;
+	std::size_t size_ = 0;
+
+public:
+	using key_type = PriorityKey;
+	using mapped_type = Quantity;
+	using value_type = std::pair<PriorityKey, Quantity>;
+	using size_type = std::size_t;
+
+	template<bool IsConst>
+	class Iterator {
+		friend class OrderQueue;
+		OrderNode* node_ = nullptr;
+
+		explicit Iterator(OrderNode* node)
+			: node_(node)
+		{}
+
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = OrderQueue::value_type;
+		using difference_type = std::ptrdiff_t;
+		using reference = std::conditional_t<IsConst, const value_type&, value_type&>;
+		using pointer = std::conditional_t<IsConst, const value_type*, value_type*>;
+
+		Iterator() = default;
+
+		// Allow iterator -> const_iterator
+		template<bool WasConst, typename = std::enable_if_t<IsConst && !WasConst>>
+		Iterator(const Iterator<WasConst>& rhs)
+			: node_(rhs.node_)
+		{}
+
+		reference operator*() const {
+			return node_->entry;
+		}
+
+		pointer operator->() const {
+			return &(node_->entry);
+		}
+
+		Iterator& operator++() {
+			node_ = node_->next;
+			return *this;
+		}
+
+		Iterator operator++(int) {
+			Iterator previous = *this;
+			node_ = node_->next;
+			return previous;
+		}
+
+		bool operator==(const Iterator& rhs) const {
+			return node_ == rhs.node_;
+		}
+
+		bool operator!=(const Iterator& rhs) const {
+			return node_ != rhs.node_;
+		}
+
+		template<bool> friend class Iterator;
+	};
+
+	using iterator = Iterator<false>;
+	using const_iterator = Iterator<true>;
+
+	OrderQueue() = default;
+
+	OrderQueue(OrderQueue&& rhs) noexcept
+		: head_(std::exchange(rhs.head_, nullptr))
+		, tail_(std::exchange(rhs.tail_, nullptr))
+		, size_(std::exchange(rhs.size_, 0))
+	{}
+
+	OrderQueue& operator=(OrderQueue&& rhs) noexcept {
+		if (this != &rhs) {
+			clear();
+			head_ = std::exchange(rhs.head_, nullptr);
+			tail_ = std::exchange(rhs.tail_, nullptr);
+			size_ = std::exchange(rhs.size_, 0);
+		}
+		return *this;
+	}
+
+	OrderQueue(const OrderQueue&) = delete;
+	OrderQueue& operator=(const OrderQueue&) = delete;
+
+	~OrderQueue() {
+		clear();
+	}
+
+	iterator begin() { return iterator{ head_ }; }
+	iterator end() { return iterator{ nullptr }; }
+	const_iterator begin() const { return const_iterator{ head_ }; }
+	const_iterator end() const { return const_iterator{ nullptr }; }
+
+	bool empty() const {
+		return nullptr == head_;
+	}
+
+	size_type size() const {
+		return size_;
+	}
+
+	value_type& front() {
+		return head_->entry;
+	}
+
+	// Append to the back of the queue. Always succeeds; the bool mirrors std::map::emplace.
+	std::pair<iterator, bool> emplace(const PriorityKey& key, const Quantity quantity) {
+		OrderNode* node = OrderNodePool::Acquire();
+		node->entry.first = key;
+		node->entry.second = quantity;
+		node->prev = tail_;
+		if (tail_) {
+			tail_->next = node;
+		}
+		else {
+			head_ = node;
+		}
+		tail_ = node;
+		++size_;
+		return { iterator{ node }, true };
+	}
+
+	void pop_front() {
+		erase(begin());
+	}
+
+	// Unlink an order from anywhere in the queue, returning the order after it.
+	iterator erase(const iterator it) {
+		OrderNode* node = it.node_;
+		OrderNode* next = node->next;
+		(node->prev ? node->prev->next : head_) = next;
+		(next ? next->prev : tail_) = node->prev;
+		--size_;
+		OrderNodePool::Release(node);
+		return iterator{ next };
+	}
+
+	// Unlink the orders from `first` up to, but not including, `last`, and release them in one go.
+	// Returns `last`.
+	iterator erase(const iterator first, const iterator last) {
+		if (first == last) {
+			return last;
+		}
+		if ((nullptr == first.node_->prev) && (nullptr == last.node_)) {
+			clear();
+			return last;
+		}
+		OrderNode* const first_node = first.node_;
+		OrderNode* last_node = first_node;
+		std::size_t count = 1;
+		for (; last_node->next != last.node_; last_node = last_node->next) {
+			++count;
+		}
+		(first_node->prev ? first_node->prev->next : head_) = last.node_;
+		(last.node_ ? last.node_->prev : tail_) = first_node->prev;
+		size_ -= count;
+		OrderNodePool::Release(first_node, last_node);
+		return last;
+	}
+
+	// Release all orders in one go.
+	void clear() {
+		if (head_) {
+			OrderNodePool::Release(head_, tail_);
+			head_ = nullptr;
+			tail_ = nullptr;
+			size_ = 0;
+		}
+	}
+};
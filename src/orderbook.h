@@ -1,5 +1,30 @@
 #pragma once
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <map>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
 #include "common_types.h"
+#include "order_queue.h"
+#include "price_ladder.h"
+
+// Most aggressive price of a side, which reaches every level of the opposite side. Market orders are matched at it.
+inline Price MarketablePrice(const Side side) {
+	return (Side::Buy == side) ? std::numeric_limits<Price>::max() : Price{ 0 };
+}
+
+// Whether what remains of an order after matching rests in the book.
+inline bool RestsRemainder(const OrderType order_type, const TimeInForce time_in_force) {
+	return (OrderType::Limit == order_type) && (TimeInForce::GoodTillCancel == time_in_force);
+}
+
+// Whether an aggressor's limit price reaches an opposite side level's price.
+inline bool Crosses(const Side side, const Price level_price, const Price aggressor_price) {
+	return (Side::Buy == side) ? (level_price <= aggressor_price) : (level_price >= aggressor_price);
+}
 
 template<typename FillAllocator, typename TradeEventHandler, typename OppositeSideLevels>
 FillExtent FindBestPricesThenFill(const Side side, FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler, Order& aggressor_order, OppositeSideLevels& opposite_side_levels) {
@@ -19,13 +44,26 @@ FillExtent FindBestPricesThenFill(const Side side, FillAllocator& fill_allocator
 	// Fill as much of the aggressor order as possible, starting from the best price level,
 	// until either the aggressor order is completely filled, or there are no more resting orders to match.
 	while ((aggressor_order.quantity > 0) 
-		&& ((Side::Buy == side) ? (it->first <= aggressor_order.price) : (it->first >= aggressor_order.price))
 		&& (opposite_side_levels.end() != it)
+		&& Crosses(side, it->first, aggressor_order.price)
 		) {
 		const Price& matched_price = it->first;
 		auto& opposite_side_resting_orders = it->second;
 
-		fill_allocator.Fill(side, matched_price, aggressor_order, opposite_side_resting_orders, trade_event_handler);
+		// The aggressor takes the whole level, so every order at it fills in full, in priority order, whatever the fill allocator.
+		// Report those fills, then clear the level in one go instead of having the allocator take its orders off one by one.
+		if (aggressor_order.quantity >= opposite_side_resting_orders.TotalQuantity()) {
+			for (const auto& [key, quantity] : opposite_side_resting_orders) {
+				trade_event_handler.HandleTradeEvent(side, matched_price, quantity, aggressor_order, key);
+				aggressor_order.quantity -= quantity;
+			}
+			opposite_side_resting_orders.clear();
+		}
+		else {
+			const auto unfilled_quantity = aggressor_order.quantity;
+			fill_allocator.Fill(side, matched_price, aggressor_order, opposite_side_resting_orders, trade_event_handler);
+			opposite_side_resting_orders.Filled(unfilled_quantity - aggressor_order.quantity);
+		}
 
 		// If all the opposite side's resting orders at this price level have been completed matched, 
 		// delete this price level from the opposite side.
@@ -49,37 +87,305 @@ FillExtent FindBestPricesThenFill(const Side side, FillAllocator& fill_allocator
 		;
 }
 
-template<typename MatchingOrdersComparator, typename FillAllocator, typename TradeEventHandler>
+// Whether the opposite side holds enough quantity at prices the aggressor reaches to fill all of it.
+// Only reads the levels' totals, and stops as soon as enough quantity is found, so it is O(levels) and touches no order.
+template<typename OppositeSideLevels>
+bool HasQuantityToFill(const Side side, const Order& aggressor_order, const OppositeSideLevels& opposite_side_levels) {
+	if (0 == aggressor_order.quantity) {
+		return true;
+	}
+	Quantity available = 0;
+	for (const auto& [price, level] : opposite_side_levels) {
+		if (!Crosses(side, price, aggressor_order.price)) {
+			return false;
+		}
+		available += level.TotalQuantity();
+		if (available >= aggressor_order.quantity) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Container for the resting orders of one price level, sorted by MatchingOrdersComparator.
+template<typename MatchingOrdersComparator>
+struct PriorityLevel {
+	using type = std::map<PriorityKey, Quantity, MatchingOrdersComparator>;
+};
+
+// Pure time priority needs no sorting, as a newly resting order always goes to the back of its level.
+template<>
+struct PriorityLevel<FifoPriority> {
+	using type = OrderQueue;
+};
+
+// Resting orders of one price level, with their total quantity kept alongside, so that depth queries and
+// fill-or-kill checks need not walk the orders. It is the container of orders itself, so it iterates (and is filled
+// by fill allocators) just like one. Whoever changes the orders keeps the total in step: Add(), Remove() and Reduce()
+// do so themselves, and Filled() is told how much a fill allocator took.
+template<typename PrioritySortedOrders>
+class PriceLevel : public PrioritySortedOrders {
+	Quantity total_quantity_ = 0;
+
+public:
+	PriceLevel() = default;
+	PriceLevel(const PriceLevel&) = default;
+	PriceLevel& operator=(const PriceLevel&) = default;
+
+	PriceLevel(PriceLevel&& rhs) noexcept(std::is_nothrow_move_constructible_v<PrioritySortedOrders>)
+		: PrioritySortedOrders(std::move(static_cast<PrioritySortedOrders&>(rhs)))
+		, total_quantity_(std::exchange(rhs.total_quantity_, 0))
+	{}
+
+	PriceLevel& operator=(PriceLevel&& rhs) noexcept(std::is_nothrow_move_assignable_v<PrioritySortedOrders>) {
+		static_cast<PrioritySortedOrders&>(*this) = std::move(static_cast<PrioritySortedOrders&>(rhs));
+		total_quantity_ = std::exchange(rhs.total_quantity_, 0);
+		return *this;
+	}
+
+	Quantity TotalQuantity() const {
+		return total_quantity_;
+	}
+
+	std::size_t OrderCount() const {
+		return this->size();
+	}
+
+	LevelSummary Summary(const Price price) const {
+		return { price, total_quantity_, this->size() };
+	}
+
+	// Append an order in priority order. Like emplace(), returns the order and true, or the order already there with
+	// an equal key (e.g. an equal timestamp in a level sorted by timestamp) and false, leaving the level as it was.
+	std::pair<typename PrioritySortedOrders::iterator, bool> Add(const PriorityKey& key, const Quantity quantity) {
+		const auto added = this->emplace(key, quantity);
+		if (added.second) {
+			total_quantity_ += quantity;
+		}
+		return added;
+	}
+
+	void Remove(const typename PrioritySortedOrders::iterator it) {
+		total_quantity_ -= it->second;
+		this->erase(it);
+	}
+
+	// Take quantity off an order in place, so that it keeps its priority.
+	void Reduce(const typename PrioritySortedOrders::iterator it, const Quantity new_quantity) {
+		total_quantity_ -= it->second - new_quantity;
+		it->second = new_quantity;
+	}
+
+	// A fill allocator took `quantity` off the level's orders.
+	void Filled(const Quantity quantity) {
+		total_quantity_ -= quantity;
+	}
+
+	void clear() {
+		PrioritySortedOrders::clear();
+		total_quantity_ = 0;
+	}
+};
+
+// LadderPolicy chooses how price levels are stored: MapLadder or ArrayLadder<...> (see price_ladder.h).
+template<typename MatchingOrdersComparator, typename FillAllocator, typename TradeEventHandler, typename LadderPolicy = MapLadder>
 class Orderbook {
 public:
-	using PrioritySortedOrders = std::map<PriorityKey, Quantity, MatchingOrdersComparator>;
+	using PrioritySortedOrders = typename PriorityLevel<MatchingOrdersComparator>::type;
+	using Level = PriceLevel<PrioritySortedOrders>;
 
 	// We want .begin() to be the best bid/ask
-	using BuyLevels = std::map<Price, PrioritySortedOrders, std::greater<Price>>;
-	using SellLevels = std::map<Price, PrioritySortedOrders, std::less<Price>>;
+	using BuyLevels = typename LadderPolicy::template Levels<Level, std::greater<Price>>;
+	using SellLevels = typename LadderPolicy::template Levels<Level, std::less<Price>>;
+
+	// Identifies a resting order within its price level. Stays valid until the order is filled or cancelled.
+	using RestingOrder = typename PrioritySortedOrders::iterator;
 
 private:
 	BuyLevels buys_;
 	SellLevels sells_;
+	// Summary of the first level of each side, kept up to date by every change to the levels
+	TopOfBook top_{};
+
+	template<typename Levels>
+	static LevelSummary BestOf(const Levels& levels) {
+		if (levels.empty()) {
+			return {};
+		}
+		const auto best = levels.begin();
+		return best->second.Summary(best->first);
+	}
+
+	void RefreshTop(const Side side) {
+		if (Side::Buy == side) {
+			top_.bid = BestOf(buys_);
+		}
+		else {
+			top_.ask = BestOf(sells_);
+		}
+	}
+
+	template<typename Levels>
+	static void Erase(Levels& levels, const Price price, const RestingOrder resting_order) {
+		const auto it = levels.find(price);
+		auto& level = it->second;
+		level.Remove(resting_order);
+		if (level.empty()) {
+			levels.erase(it);
+		}
+	}
+
+	template<typename Levels>
+	static Level& AppendLevelTo(Levels& levels, const Price price) {
+		// A std::map is told that the level goes at the end; an ArrayPriceLadder has its window follow the first, i.e. best, level
+		if constexpr (requires { levels.emplace_hint(levels.end(), price, Level{}); }) {
+			return levels.emplace_hint(levels.end(), price, Level{})->second;
+		}
+		else {
+			return levels[price];
+		}
+	}
+
+	template<typename Levels>
+	static std::optional<LevelSummary> SummaryAt(const Levels& levels, const Price price) {
+		const auto it = levels.find(price);
+		if (levels.end() == it) {
+			return std::nullopt;
+		}
+		return it->second.Summary(price);
+	}
+
+	template<typename Levels>
+	static std::size_t DepthOf(const Levels& levels, const std::span<LevelSummary> depth) {
+		std::size_t count = 0;
+		for (auto it = levels.begin(); (levels.end() != it) && (count < depth.size()); ++it, ++count) {
+			depth[count] = it->second.Summary(it->first);
+		}
+		return count;
+	}
 
 public:
-	FillExtent Buy(FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler, Order& aggressor_order) {
-		const auto fill_extent = FindBestPricesThenFill(Side::Buy, fill_allocator, trade_event_handler, aggressor_order, sells_);
-		if (FillExtent::Full != fill_extent) {
-			buys_[aggressor_order.price][aggressor_order.key] = aggressor_order.quantity;
+	// Match an aggressor, then deal with what remains of it according to its type and time in force.
+	// A market order's price is set to MarketablePrice(side) before it is matched.
+	FillExtent Buy(FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler, Order& aggressor_order, const TimeInForce time_in_force = TimeInForce::GoodTillCancel, const OrderType order_type = OrderType::Limit) {
+		return Enter(Side::Buy, fill_allocator, trade_event_handler, aggressor_order, time_in_force, order_type, [](RestingOrder) {});
+	}
+
+	FillExtent Sell(FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler, Order& aggressor_order, const TimeInForce time_in_force = TimeInForce::GoodTillCancel, const OrderType order_type = OrderType::Limit) {
+		return Enter(Side::Sell, fill_allocator, trade_event_handler, aggressor_order, time_in_force, order_type, [](RestingOrder) {});
+	}
+
+	// Buy() or Sell() by side. The trade event handler may be of any type, as in Match(), and `on_rest` is called
+	// with the resting order if the remainder rests, so that callers can keep an index of resting orders.
+	template<typename AnyTradeEventHandler, typename OnRest>
+	FillExtent Enter(const Side side, FillAllocator& fill_allocator, AnyTradeEventHandler& trade_event_handler, Order& aggressor_order, const TimeInForce time_in_force, const OrderType order_type, OnRest&& on_rest) {
+		if (OrderType::Market == order_type) {
+			aggressor_order.price = MarketablePrice(side);
+		}
+		if ((TimeInForce::FillOrKill == time_in_force) && !CanFill(side, aggressor_order)) {
+			return FillExtent::None;
+		}
+		const auto fill_extent = Match(side, fill_allocator, trade_event_handler, aggressor_order);
+		if ((FillExtent::Full != fill_extent) && RestsRemainder(order_type, time_in_force)) {
+			if (const auto resting_order = Rest(side, aggressor_order)) {
+				on_rest(*resting_order);
+			}
 		}
 		return fill_extent;
+	}
 
+	// Whether an aggressor could trade all of its quantity right now, i.e. whether it would trade if it were fill-or-kill.
+	// Nothing is filled, so a fill-or-kill order that cannot trade in full is rejected without touching the book.
+	bool CanFill(const Side side, const Order& aggressor_order) const {
+		return (Side::Buy == side)
+			? HasQuantityToFill(side, aggressor_order, sells_)
+			: HasQuantityToFill(side, aggressor_order, buys_);
 	}
 
-	FillExtent Sell(FillAllocator& fill_allocator, TradeEventHandler& trade_event_handler, Order& aggressor_order) {
-		const auto fill_extent = FindBestPricesThenFill(Side::Sell, fill_allocator, trade_event_handler, aggressor_order, buys_);
-		if (FillExtent::Full != fill_extent) {
-			sells_[aggressor_order.price][aggressor_order.key] = aggressor_order.quantity;
+	// Fill an aggressor from the opposite side, without resting what remains of it.
+	// The trade event handler may be of any type, so that callers can observe fills before passing them on.
+	template<typename AnyTradeEventHandler>
+	FillExtent Match(const Side side, FillAllocator& fill_allocator, AnyTradeEventHandler& trade_event_handler, Order& aggressor_order) {
+		if (Side::Buy == side) {
+			const auto fill_extent = FindBestPricesThenFill(side, fill_allocator, trade_event_handler, aggressor_order, sells_);
+			RefreshTop(Side::Sell);
+			return fill_extent;
 		}
+		const auto fill_extent = FindBestPricesThenFill(side, fill_allocator, trade_event_handler, aggressor_order, buys_);
+		RefreshTop(Side::Buy);
 		return fill_extent;
 	}
 
+	// Add an order to the back of its price level, without matching it.
+	// Returns std::nullopt, and leaves the book as it was, if the level already holds an order with an equal key.
+	std::optional<RestingOrder> Rest(const Side side, const Order& order) {
+		const auto [resting_order, added] = (Side::Buy == side)
+			? buys_[order.price].Add(order.key, order.quantity)
+			: sells_[order.price].Add(order.key, order.quantity);
+		if (!added) {
+			return std::nullopt;
+		}
+		RefreshTop(side);
+		return resting_order;
+	}
+
+	// Level at a price, created empty if there is none yet, for appending orders in priority order with Level::Add()
+	// without matching them, e.g. when restoring a snapshot. Levels are cheapest to append from the best price to the worst.
+	// Call RefreshTop() once done appending.
+	Level& AppendLevel(const Side side, const Price price) {
+		return (Side::Buy == side) ? AppendLevelTo(buys_, price) : AppendLevelTo(sells_, price);
+	}
+
+	void RefreshTop() {
+		RefreshTop(Side::Buy);
+		RefreshTop(Side::Sell);
+	}
+
+	// Remove a resting order, and its price level if that becomes empty.
+	void Cancel(const Side side, const Price price, const RestingOrder resting_order) {
+		if (Side::Buy == side) {
+			Erase(buys_, price, resting_order);
+		}
+		else {
+			Erase(sells_, price, resting_order);
+		}
+		RefreshTop(side);
+	}
+
+	// Take quantity off a resting order in place, so that it keeps its priority. The new quantity must not be zero.
+	void Reduce(const Side side, const Price price, const RestingOrder resting_order, const Quantity new_quantity) {
+		if (Side::Buy == side) {
+			buys_.find(price)->second.Reduce(resting_order, new_quantity);
+		}
+		else {
+			sells_.find(price)->second.Reduce(resting_order, new_quantity);
+		}
+		RefreshTop(side);
+	}
+
+	// Best bid and offer, in constant time.
+	const TopOfBook& Top() const {
+		return top_;
+	}
+
+	const LevelSummary& BestBid() const {
+		return top_.bid;
+	}
+
+	const LevelSummary& BestAsk() const {
+		return top_.ask;
+	}
+
+	// Total quantity and number of orders at a price, or std::nullopt if no order rests there.
+	std::optional<LevelSummary> LevelAt(const Side side, const Price price) const {
+		return (Side::Buy == side) ? SummaryAt(buys_, price) : SummaryAt(sells_, price);
+	}
+
+	// Fill `depth` with the best levels of a side, best first, and return how many there are, up to depth.size().
+	std::size_t Depth(const Side side, const std::span<LevelSummary> depth) const {
+		return (Side::Buy == side) ? DepthOf(buys_, depth) : DepthOf(sells_, depth);
+	}
+
 	const auto& Buys() const {
 		return buys_;
 	}
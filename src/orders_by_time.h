@@ -0,0 +1,70 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "common_types.h"
+
+// Merges the price levels of one side of any number of orderbooks into a single walk of their orders by time.
+// Each level is already in time order (true of both FifoPriority queues and maps sorted by PriorityKey::TimeStampComparator),
+// so this is a k-way merge: a min-heap holds a cursor per level, keyed by the timestamp of its next order.
+// Extra memory is a cursor per level rather than a copy of every order, and orders stream out as they are merged.
+// Levels must not change until Drain() has returned.
+template<typename Level>
+class OrdersByTime {
+	struct Cursor {
+		// Timestamp of the order at `it`, kept here so that heap comparisons do not chase the level's nodes
+		TimeStamp timestamp;
+		typename Level::const_iterator it;
+		typename Level::const_iterator end;
+		Instrument instrument;
+		Price price;
+	};
+
+	// Orders the heap so that the cursor with the earliest order is at the front
+	static bool Later(const Cursor& lhs, const Cursor& rhs) {
+		return lhs.timestamp > rhs.timestamp;
+	}
+
+	Side side_ = Side::Buy;
+	std::vector<Cursor> cursors_;
+
+public:
+	// Start merging the levels of one side. Keeps the cursors' memory from previous merges.
+	void Reset(const Side side) {
+		side_ = side;
+		cursors_.clear();
+	}
+
+	void AddLevel(const Instrument instrument, const Price price, const Level& level) {
+		if (level.begin() != level.end()) {
+			cursors_.push_back({ level.begin()->first.timestamp, level.begin(), level.end(), instrument, price });
+		}
+	}
+
+	// Add every level of one side of an orderbook, e.g. orderbook.Sells().
+	template<typename Levels>
+	void AddLevels(const Instrument instrument, const Levels& levels) {
+		for (const auto& [price, level] : levels) {
+			AddLevel(instrument, price, level);
+		}
+	}
+
+	// Hand every order of the levels added to full_order_details_handler, earliest first.
+	template<typename FullOrderDetailHandler>
+	void Drain(FullOrderDetailHandler& full_order_details_handler) {
+		std::make_heap(cursors_.begin(), cursors_.end(), Later);
+		while (!cursors_.empty()) {
+			std::pop_heap(cursors_.begin(), cursors_.end(), Later);
+			auto& cursor = cursors_.back();
+			const auto& [key, quantity] = *cursor.it;
+			full_order_details_handler.HandleFullOrderDetail({ side_, cursor.instrument, { cursor.price, quantity, key } });
+			if (++cursor.it == cursor.end) {
+				cursors_.pop_back();
+			}
+			else {
+				cursor.timestamp = cursor.it->first.timestamp;
+				std::push_heap(cursors_.begin(), cursors_.end(), Later);
+			}
+		}
+	}
+};
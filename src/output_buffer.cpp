@@ -0,0 +1,71 @@
+#include "output_buffer.h"
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+	std::uint64_t NowNs() {
+		// Coarse is plenty for batching, and much cheaper to read
+		struct timespec now = {};
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		return static_cast<std::uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<std::uint64_t>(now.tv_nsec);
+	}
+}
+
+OutputBuffer::OutputBuffer(const int fd, const std::size_t flush_bytes, const std::uint64_t max_delay_ns)
+	: fd_(fd)
+	// Leave headroom so that a record finished just below the threshold rarely needs the buffer to grow
+	, buffer_(flush_bytes + kHeadroom)
+	, flush_bytes_(flush_bytes)
+	, max_delay_ns_(max_delay_ns)
+{}
+
+OutputBuffer::~OutputBuffer() {
+	Flush();
+}
+
+void OutputBuffer::Grow(const std::size_t n) {
+	std::size_t size = buffer_.size() * 2;
+	while (size - used_ < n) {
+		size *= 2;
+	}
+	buffer_.resize(size);
+}
+
+void OutputBuffer::EndRecord() {
+	if (used_ >= flush_bytes_) {
+		Flush();
+		return;
+	}
+	const auto now = NowNs();
+	if (0 == pending_since_ns_) {
+		pending_since_ns_ = now;
+	}
+	else if (now - pending_since_ns_ >= max_delay_ns_) {
+		Flush();
+	}
+}
+
+void OutputBuffer::FlushIfDue() {
+	if ((0 != pending_since_ns_) && (NowNs() - pending_since_ns_ >= max_delay_ns_)) {
+		Flush();
+	}
+}
+
+bool OutputBuffer::Flush() {
+	const char* data = buffer_.data();
+	std::size_t remaining = used_;
+	while (ok_ && (remaining > 0)) {
+		const auto n = write(fd_, data, remaining);
+		if (n >= 0) {
+			data += n;
+			remaining -= static_cast<std::size_t>(n);
+		}
+		else if (EINTR != errno) {
+			ok_ = false;
+		}
+	}
+	used_ = 0;
+	pending_since_ns_ = 0;
+	return ok_;
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Formats output records into a large preallocated buffer, and hands them to the OS with one write() per batch.
+// A batch ends once `flush_bytes` are pending, or `max_delay_ns` after the oldest pending record was finished,
+// whichever comes first. Both are checked when a record is finished, so records are never split across writes.
+// Between records, e.g. while waiting for input, writers call Flush() or FlushIfDue(), or the last batch waits
+// for the next record. Pending output is flushed on destruction.
+class OutputBuffer {
+	int fd_;
+	std::vector<char> buffer_;
+	std::size_t used_ = 0;
+	std::size_t flush_bytes_;
+	std::uint64_t max_delay_ns_;
+	// When the oldest pending record was finished, or 0 if there is none
+	std::uint64_t pending_since_ns_ = 0;
+	bool ok_ = true;
+
+	// Make room for at least `n` more bytes.
+	void Reserve(const std::size_t n) {
+		if (buffer_.size() - used_ < n) {
+			Grow(n);
+		}
+	}
+
+	void Grow(std::size_t n);
+
+public:
+	// Longest text of an unsigned long long
+	static constexpr std::size_t kMaxDigits = 20;
+	// Room the buffer has beyond `flush_bytes`
+	static constexpr std::size_t kHeadroom = 4096;
+
+	explicit OutputBuffer(int fd, std::size_t flush_bytes = 1 << 16, std::uint64_t max_delay_ns = 1000000);
+	OutputBuffer(const OutputBuffer&) = delete;
+	OutputBuffer& operator=(const OutputBuffer&) = delete;
+	~OutputBuffer();
+
+	void Append(const std::string_view text) {
+		Reserve(text.size());
+		text.copy(buffer_.data() + used_, text.size());
+		used_ += text.size();
+	}
+
+	void Append(const char c) {
+		Reserve(1);
+		buffer_[used_++] = c;
+	}
+
+	// Decimal text of `value`, formatted two digits at a time from the right.
+	void Append(unsigned long long value) {
+		static constexpr char kDigitPairs[] =
+			"00010203040506070809"
+			"10111213141516171819"
+			"20212223242526272829"
+			"30313233343536373839"
+			"40414243444546474849"
+			"50515253545556575859"
+			"60616263646566676869"
+			"70717273747576777879"
+			"80818283848586878889"
+			"90919293949596979899";
+		char digits[kMaxDigits];
+		char* first = digits + kMaxDigits;
+		while (value >= 100) {
+			const auto pair = static_cast<std::size_t>(value % 100) * 2;
+			value /= 100;
+			*--first = kDigitPairs[pair + 1];
+			*--first = kDigitPairs[pair];
+		}
+		if (value >= 10) {
+			const auto pair = static_cast<std::size_t>(value) * 2;
+			*--first = kDigitPairs[pair + 1];
+			*--first = kDigitPairs[pair];
+		}
+		else {
+			*--first = static_cast<char>('0' + value);
+		}
+		Append(std::string_view(first, static_cast<std::size_t>(digits + kMaxDigits - first)));
+	}
+
+	// Append `n` bytes for the caller to fill in, e.g. a binary record.
+	char* Extend(const std::size_t n) {
+		Reserve(n);
+		char* extension = buffer_.data() + used_;
+		used_ += n;
+		return extension;
+	}
+
+	void Append(const unsigned int value) {
+		Append(static_cast<unsigned long long>(value));
+	}
+
+	// Mark the end of a record, and write out the batch if it is due.
+	void EndRecord();
+
+	// Write out the batch if its oldest record has waited `max_delay_ns`, e.g. from a loop waiting for more to write.
+	void FlushIfDue();
+
+	// Write out the batch if `flush_bytes` are pending, without reading the clock. Writers that call this before each
+	// piece of output of at most kHeadroom bytes never make the buffer grow, e.g. in a forked child, which must not allocate.
+	void FlushIfFull() {
+		if (used_ >= flush_bytes_) {
+			Flush();
+		}
+	}
+
+	// Write out everything pending. Returns false if any write so far has failed.
+	bool Flush();
+
+	std::size_t Pending() const {
+		return used_;
+	}
+};
@@ -0,0 +1,313 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "common_types.h"
+#include "interner.h"
+#include "market.h"
+#include "market_data_handlers.h"
+#include "order_message.h"
+#include "sequenced_ring.h"
+#include "spsc_queue.h"
+#include "threads.h"
+#include "trade_event_handlers.h"
+
+// A Market split into three pipelined stages, each on its own thread:
+// - the caller's thread parses messages and Submit()s them into a SequencedRing,
+// - a matching thread drives the Market,
+// - an output thread hands the fills to the trade event handler, e.g. formatting and writing them out, over an SPSC queue.
+// So parsing and printing overlap with matching instead of taking turns with it on one core.
+// Other readers of the inbound messages, e.g. a journal, can be added as consumers of the same ring, each on its own thread:
+// they read the very slots the matcher reads, and a slow one only holds up the parser once the ring is full.
+// Market data consumers read each slot once the matcher is done with it, along with the best levels of the book
+// the message changed, which the matcher records for that slot: so a depth feed runs on its own thread off the book's
+// state after every message, without touching the book.
+//
+// The output stage keeps its own copy of the names, interned in the same order as the gateway interned them,
+// and so with the same handles: printers on the output thread never touch the gateway's NameTables while it is growing.
+template<typename MatchingOrdersComparator, typename FillAllocator, typename TradeEventHandler, typename LadderPolicy = MapLadder>
+class PipelinedMarket {
+	static constexpr std::size_t kQueueCapacity = 1 << 14;
+
+public:
+	// How deep the books are that market data consumers see
+	static constexpr std::size_t kMarketDataLevels = 5;
+	using MarketDataLevels = BestLevels<kMarketDataLevels>;
+
+private:
+	struct Inbound {
+		OrderMessage message;
+		NewNames new_names;
+	};
+
+	// Either a fill, or names to learn before the fills that follow
+	struct Outbound {
+		bool is_trade_event;
+		QueuedTradeEvent trade_event;
+		NewNames new_names;
+	};
+	using OutboundQueue = SpscQueue<Outbound, kQueueCapacity>;
+
+	static void Push(OutboundQueue& queue, const Outbound& outbound) {
+		unsigned spins = 0;
+		while (!queue.TryPush(outbound)) {
+			SpinWait(spins);
+		}
+	}
+
+	// Trade event handler of the Market: queues fills for the output stage.
+	struct TradeEventQueuer {
+		OutboundQueue& outbound;
+		Instrument instrument = 0;
+
+		void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
+			Push(outbound, { true, { side, instrument, matched_price, matched_quantity, aggressor_order, opposite_side_key }, {} });
+		}
+	};
+
+	TradeEventHandler& trade_event_handler_;
+	NameTables& output_names_;
+	using InboundRing = SequencedRing<Inbound, kQueueCapacity>;
+	std::unique_ptr<InboundRing> inbound_ = std::make_unique<InboundRing>();
+	// The first consumer of a ring always fits
+	const typename InboundRing::ConsumerId matcher_id_ = *inbound_->AddConsumer();
+	// Best levels of the book each inbound slot's message changed, by slot, if there are market data consumers.
+	// Written by the matcher, and read by market data consumers once the matcher is past the slot.
+	std::unique_ptr<MarketDataLevels[]> market_data_levels_;
+	std::unique_ptr<bool[]> market_data_changed_;
+	std::unique_ptr<OutboundQueue> outbound_ = std::make_unique<OutboundQueue>();
+	FillAllocator fill_allocator_;
+	TradeEventQueuer trade_event_queuer_{ *outbound_ };
+	Market<MatchingOrdersComparator, FillAllocator, TradeEventQueuer, LadderPolicy> market_{ fill_allocator_, trade_event_queuer_ };
+
+	alignas(kCacheLineSize) std::atomic<bool> inbound_closed_{ false };
+	alignas(kCacheLineSize) std::atomic<bool> outbound_closed_{ false };
+	std::thread matcher_;
+	std::thread publisher_;
+	// Extra inbound consumers, to be started by Start(), and their threads
+	std::vector<std::function<void()>> inbound_consumer_loops_;
+	std::vector<std::thread> inbound_consumers_;
+	std::function<void(const OrderMessage&)> rejected_message_handler_;
+	std::function<void()> output_idle_handler_;
+
+	// Call consume_available() until it finds nothing more and `closed` is set.
+	template<typename ConsumeAvailable, typename Empty>
+	static void Drain(const std::atomic<bool>& closed, ConsumeAvailable&& consume_available, Empty&& empty) {
+		unsigned spins = 0;
+		for (;;) {
+			if (consume_available() > 0) {
+				spins = 0;
+			}
+			else if (closed.load(std::memory_order_acquire) && empty()) {
+				return;
+			}
+			else {
+				SpinWait(spins);
+			}
+		}
+	}
+
+	// Consume inbound messages as `consumer` until the ring is closed and read to the end.
+	template<typename Consumer>
+	void DrainInbound(const typename InboundRing::ConsumerId consumer_id, Consumer&& consume) {
+		Drain(inbound_closed_
+			, [this, consumer_id, &consume]() { return inbound_->ConsumeAvailable(consumer_id, consume); }
+			, [this, consumer_id]() { return inbound_->CaughtUp(consumer_id); });
+	}
+
+	void Process(OrderMessage& message) {
+		if ((!ProcessOrderMessage(market_, trade_event_queuer_, message)) && rejected_message_handler_) {
+			rejected_message_handler_(message);
+		}
+	}
+
+	void Match() {
+		DrainInbound(matcher_id_, [this](const Inbound& inbound, const std::uint64_t sequence, bool) {
+			if (inbound.new_names.order_id || inbound.new_names.instrument) {
+				Push(*outbound_, { false, {}, inbound.new_names });
+			}
+			OrderMessage message = inbound.message;
+			if (!market_data_levels_) {
+				Process(message);
+				return;
+			}
+			// Cancels and amends do not name their instrument, so it is looked up while the order still rests
+			const auto instrument = (OrderAction::New == message.action)
+				? std::optional<Instrument>(message.instrument)
+				: market_.RestingOrderInstrument(message.order.key.id);
+			Process(message);
+			const auto slot = sequence & (kQueueCapacity - 1);
+			market_data_changed_[slot] = instrument.has_value();
+			if (instrument) {
+				market_data_levels_[slot].Read(market_, *instrument);
+			}
+		});
+	}
+
+	void Publish() {
+		const auto consume = [this](const Outbound& outbound) {
+			if (outbound.is_trade_event) {
+				outbound.trade_event.PassOn(trade_event_handler_);
+				return;
+			}
+			if (outbound.new_names.order_id) {
+				output_names_.order_ids.Intern(*outbound.new_names.order_id);
+			}
+			if (outbound.new_names.instrument) {
+				output_names_.instruments.Intern(*outbound.new_names.instrument);
+			}
+		};
+		Drain(outbound_closed_
+			, [this, &consume]() {
+				const auto count = outbound_->ConsumeAvailable(consume);
+				if ((0 == count) && output_idle_handler_) {
+					output_idle_handler_();
+				}
+				return count;
+			}
+			, [this]() { return outbound_->Empty(); });
+	}
+
+public:
+	// `output_names` must hold the same names as the gateway's NameTables so far; names are then added as Submit() reports them.
+	PipelinedMarket(TradeEventHandler& trade_event_handler, NameTables& output_names)
+		: trade_event_handler_(trade_event_handler)
+		, output_names_(output_names)
+	{}
+
+	PipelinedMarket(const PipelinedMarket&) = delete;
+	PipelinedMarket& operator=(const PipelinedMarket&) = delete;
+
+	~PipelinedMarket() {
+		Finish();
+	}
+
+	// Create the orderbook of an instrument up front. Only before Start().
+	void AddInstrument(const Instrument instrument) {
+		market_.AddInstrument(instrument);
+	}
+
+	// Add another reader of every inbound message, on its own thread, e.g. a journal or a market data feed.
+	// consume(message, new_names, sequence, end_of_batch) is called for every message in the order submitted,
+	// where sequence counts messages from 0, and end_of_batch marks the last message available for now.
+	// Only before Start(); `consume` must outlive Finish(). Returns false if the ring has no room for another consumer.
+	template<typename InboundConsumer>
+	bool AddInboundConsumer(InboundConsumer& consume) {
+		const auto added = inbound_->AddConsumer();
+		if (!added) {
+			return false;
+		}
+		const auto consumer_id = *added;
+		inbound_consumer_loops_.push_back([this, consumer_id, &consume]() {
+			DrainInbound(consumer_id, [&consume](const Inbound& inbound, const std::uint64_t sequence, const bool end_of_batch) {
+				consume(inbound.message, inbound.new_names, sequence, end_of_batch);
+			});
+		});
+		return true;
+	}
+
+	// Add a market data consumer of every inbound message, on its own thread, e.g. the stage of a DepthFeed.
+	// consume(message, new_names, levels, sequence, end_of_batch) is called for every message once it has been matched,
+	// in the order submitted, where `levels` points to the best levels of the book the message changed right after it,
+	// or is nullptr if it changed none (e.g. a cancel of an order that no longer rests).
+	// Only before Start(); `consume` must outlive Finish(). Returns false if the ring has no room for another consumer.
+	template<typename MarketDataConsumer>
+	bool AddMarketDataConsumer(MarketDataConsumer& consume) {
+		const auto added = inbound_->AddConsumer(matcher_id_);
+		if (!added) {
+			return false;
+		}
+		if (!market_data_levels_) {
+			market_data_levels_ = std::make_unique<MarketDataLevels[]>(kQueueCapacity);
+			market_data_changed_ = std::make_unique<bool[]>(kQueueCapacity);
+		}
+		const auto consumer_id = *added;
+		inbound_consumer_loops_.push_back([this, consumer_id, &consume]() {
+			DrainInbound(consumer_id, [this, &consume](const Inbound& inbound, const std::uint64_t sequence, const bool end_of_batch) {
+				const auto slot = sequence & (kQueueCapacity - 1);
+				const MarketDataLevels* levels = market_data_changed_[slot] ? &market_data_levels_[slot] : nullptr;
+				consume(inbound.message, inbound.new_names, levels, sequence, end_of_batch);
+			});
+		});
+		return true;
+	}
+
+	// Have handle(message) called, on the matching thread, for every message the market rejects (see ProcessOrderMessage).
+	// Only before Start().
+	void SetRejectedMessageHandler(std::function<void(const OrderMessage&)> handle) {
+		rejected_message_handler_ = std::move(handle);
+	}
+
+	// Have handle() called, on the output thread, whenever it finds no fills waiting, e.g. to write out a batch of
+	// output that has waited long enough (see OutputBuffer::FlushIfDue). Only before Start().
+	void SetOutputIdleHandler(std::function<void()> handle) {
+		output_idle_handler_ = std::move(handle);
+	}
+
+	// Start the matching, output and extra inbound consumer threads.
+	// With `pin`, they are pinned to CPUs 1, 2, 3... as long as there are enough CPUs.
+	void Start(const bool pin) {
+		const auto cpus = std::thread::hardware_concurrency();
+		matcher_ = std::thread([this, pin, cpus]() {
+			if (pin && (cpus > 1)) {
+				PinThisThread(1);
+			}
+			Match();
+		});
+		publisher_ = std::thread([this, pin, cpus]() {
+			if (pin && (cpus > 2)) {
+				PinThisThread(2);
+			}
+			Publish();
+		});
+		for (std::size_t i = 0; i < inbound_consumer_loops_.size(); ++i) {
+			inbound_consumers_.emplace_back([this, pin, cpus, i]() {
+				if (pin && (i + 3 < cpus)) {
+					PinThisThread(static_cast<unsigned>(i + 3));
+				}
+				inbound_consumer_loops_[i]();
+			});
+		}
+	}
+
+	// Pass a message on to the matching stage, waiting while it is behind.
+	void Submit(const OrderMessage& message, const NewNames& new_names) {
+		unsigned spins = 0;
+		Inbound* inbound = nullptr;
+		while (!(inbound = inbound_->TryClaim())) {
+			SpinWait(spins);
+		}
+		*inbound = { message, new_names };
+		inbound_->Publish();
+	}
+
+	// Wait for every submitted message to be matched and its fills to be handled, then stop the threads.
+	void Finish() {
+		inbound_closed_.store(true, std::memory_order_release);
+		if (matcher_.joinable()) {
+			matcher_.join();
+		}
+		for (auto& inbound_consumer : inbound_consumers_) {
+			if (inbound_consumer.joinable()) {
+				inbound_consumer.join();
+			}
+		}
+		outbound_closed_.store(true, std::memory_order_release);
+		if (publisher_.joinable()) {
+			publisher_.join();
+		}
+	}
+
+	// Only after Finish().
+	template<typename FullOrderDetailHandler>
+	void ForEachOrderByTime(FullOrderDetailHandler& full_order_details_handler) const {
+		market_.ForEachOrderByTime(full_order_details_handler);
+	}
+};
@@ -0,0 +1,391 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "common_types.h"
+
+// Price levels of one side of an orderbook, held in a contiguous array indexed by (price - base) / tick.
+// The array is a window of WindowTicks slots that is moved to stay around the touch, so looking up a level
+// near the best price is a single index computation.
+// Prices outside the window, or off the tick grid, fall back to a sparse std::map.
+//
+// Iteration visits levels from best to worst price, exactly like std::map<Price, Level, BetterPrice> does,
+// so this can be used in place of that map by FindBestPricesThenFill.
+// As with std::map, operator[] creates a level and erase() removes it.
+// Only operator[] moves the window, so iterators stay valid while levels are being matched and erased.
+template<typename Level, typename BetterPrice, std::size_t WindowTicks, Price TickSize>
+class ArrayPriceLadder {
+	static_assert(WindowTicks > 1, "The window needs at least 2 slots");
+	static_assert(TickSize > 0, "Tick size cannot be zero");
+
+public:
+	using key_type = Price;
+	using mapped_type = Level;
+	using value_type = std::pair<const Price, Level>;
+	using size_type = std::size_t;
+
+private:
+	using Slots = std::vector<value_type>;
+	using SparseLevels = std::map<Price, Level, BetterPrice>;
+	using Word = std::uint64_t;
+
+	static constexpr bool kHigherIsBetter = BetterPrice{}(Price{ 1 }, Price{ 0 });
+	static constexpr std::size_t kWordBits = 64;
+	static constexpr std::size_t kWords = (WindowTicks + kWordBits - 1) / kWordBits;
+	static constexpr std::size_t kNoSlot = WindowTicks;
+	// Highest price that can be put in the window without slot prices overflowing.
+	static constexpr Price kMaxWindowPrice = std::numeric_limits<Price>::max() - (WindowTicks * TickSize);
+
+	Slots slots_;
+	std::vector<Word> occupied_;
+	std::size_t occupied_count_ = 0;
+	std::size_t best_slot_ = kNoSlot;
+	SparseLevels sparse_;
+
+public:
+	// Merges the window's occupied slots with the sparse levels, best price first.
+	template<bool IsConst>
+	class Iterator {
+		friend class ArrayPriceLadder;
+		using Ladder = std::conditional_t<IsConst, const ArrayPriceLadder, ArrayPriceLadder>;
+		using SparseIterator = std::conditional_t<IsConst, typename SparseLevels::const_iterator, typename SparseLevels::iterator>;
+
+		Ladder* ladder_ = nullptr;
+		std::size_t slot_ = kNoSlot;
+		SparseIterator sparse_;
+		bool in_window_ = false;
+
+		Iterator(Ladder* ladder, const std::size_t slot, const SparseIterator sparse)
+			: ladder_(ladder)
+			, slot_(slot)
+			, sparse_(sparse) {
+			Settle();
+		}
+
+		// Point at whichever of the window slot and the sparse level has the better price.
+		void Settle() {
+			const bool has_slot = (kNoSlot != slot_);
+			const bool has_sparse = (ladder_->sparse_.end() != sparse_);
+			in_window_ = has_slot && ((!has_sparse) || BetterPrice{}(ladder_->slots_[slot_].first, sparse_->first));
+		}
+
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = typename ArrayPriceLadder::value_type;
+		using difference_type = std::ptrdiff_t;
+		using reference = std::conditional_t<IsConst, const value_type&, value_type&>;
+		using pointer = std::conditional_t<IsConst, const value_type*, value_type*>;
+
+		Iterator() = default;
+
+		// Allow iterator -> const_iterator
+		template<bool WasConst, typename = std::enable_if_t<IsConst && !WasConst>>
+		Iterator(const Iterator<WasConst>& rhs)
+			: ladder_(rhs.ladder_)
+			, slot_(rhs.slot_)
+			, sparse_(rhs.sparse_)
+			, in_window_(rhs.in_window_)
+		{}
+
+		reference operator*() const {
+			return in_window_ ? ladder_->slots_[slot_] : *sparse_;
+		}
+
+		pointer operator->() const {
+			return &(**this);
+		}
+
+		Iterator& operator++() {
+			if (in_window_) {
+				slot_ = ladder_->NextWorseSlot(slot_);
+			}
+			else {
+				++sparse_;
+			}
+			Settle();
+			return *this;
+		}
+
+		Iterator operator++(int) {
+			Iterator previous = *this;
+			++(*this);
+			return previous;
+		}
+
+		bool operator==(const Iterator& rhs) const {
+			return (slot_ == rhs.slot_) && (sparse_ == rhs.sparse_);
+		}
+
+		bool operator!=(const Iterator& rhs) const {
+			return !((*this) == rhs);
+		}
+
+		template<bool> friend class Iterator;
+	};
+
+	using iterator = Iterator<false>;
+	using const_iterator = Iterator<true>;
+
+	iterator begin() { return { this, best_slot_, sparse_.begin() }; }
+	iterator end() { return { this, kNoSlot, sparse_.end() }; }
+	const_iterator begin() const { return { this, best_slot_, sparse_.begin() }; }
+	const_iterator end() const { return { this, kNoSlot, sparse_.end() }; }
+
+	bool empty() const {
+		return (0 == occupied_count_) && sparse_.empty();
+	}
+
+	size_type size() const {
+		return occupied_count_ + sparse_.size();
+	}
+
+	// Level at this price, created empty if there is none yet.
+	Level& operator[](const Price price) {
+		if (IsSlotPrice(price) && !IsInWindow(price)) {
+			// Keep the touch inside the window. A new price better than the window's best becomes the touch.
+			const Price touch = ((0 == occupied_count_) || IsBetter(price, slots_[best_slot_].first))
+				? price
+				: slots_[best_slot_].first;
+			if (TicksBetween(touch, price) < (WindowTicks / 2)) {
+				Recentre(touch);
+			}
+		}
+
+		if (IsInWindow(price)) {
+			return Occupy(SlotIndex(price)).second;
+		}
+		return sparse_[price];
+	}
+
+	iterator find(const Price price) {
+		if (IsInWindow(price)) {
+			const auto slot = SlotIndex(price);
+			return IsOccupied(slot) ? iterator{ this, slot, sparse_.upper_bound(price) } : end();
+		}
+		const auto it = sparse_.find(price);
+		return (sparse_.end() == it) ? end() : iterator{ this, FirstSlotWorseThan(price), it };
+	}
+
+	const_iterator find(const Price price) const {
+		if (IsInWindow(price)) {
+			const auto slot = SlotIndex(price);
+			return IsOccupied(slot) ? const_iterator{ this, slot, sparse_.upper_bound(price) } : end();
+		}
+		const auto it = sparse_.find(price);
+		return (sparse_.end() == it) ? end() : const_iterator{ this, FirstSlotWorseThan(price), it };
+	}
+
+	iterator erase(iterator it) {
+		if (it.in_window_) {
+			const auto slot = it.slot_;
+			it.slot_ = NextWorseSlot(slot);
+			Vacate(slot);
+		}
+		else {
+			it.sparse_ = sparse_.erase(it.sparse_);
+		}
+		it.Settle();
+		return it;
+	}
+
+	void clear() {
+		for (std::size_t slot = best_slot_; kNoSlot != slot; slot = NextWorseSlot(slot)) {
+			slots_[slot].second.clear();
+		}
+		std::fill(occupied_.begin(), occupied_.end(), Word{ 0 });
+		occupied_count_ = 0;
+		best_slot_ = kNoSlot;
+		sparse_.clear();
+	}
+
+private:
+	static bool IsBetter(const Price lhs, const Price rhs) {
+		return BetterPrice{}(lhs, rhs);
+	}
+
+	// Whether a level at this price can be held in a window slot.
+	static bool IsSlotPrice(const Price price) {
+		return (0 == (price % TickSize)) && (price <= kMaxWindowPrice);
+	}
+
+	static Price TicksBetween(const Price lhs, const Price rhs) {
+		return ((lhs > rhs) ? (lhs - rhs) : (rhs - lhs)) / TickSize;
+	}
+
+	Price Base() const {
+		return slots_.front().first;
+	}
+
+	bool IsInWindow(const Price price) const {
+		return (!slots_.empty())
+			&& IsSlotPrice(price)
+			&& (price >= Base())
+			&& (((price - Base()) / TickSize) < WindowTicks);
+	}
+
+	std::size_t SlotIndex(const Price price) const {
+		return static_cast<std::size_t>((price - Base()) / TickSize);
+	}
+
+	bool IsOccupied(const std::size_t slot) const {
+		return 0 != (occupied_[slot / kWordBits] & (Word{ 1 } << (slot % kWordBits)));
+	}
+
+	value_type& Occupy(const std::size_t slot) {
+		if (!IsOccupied(slot)) {
+			occupied_[slot / kWordBits] |= (Word{ 1 } << (slot % kWordBits));
+			++occupied_count_;
+			if ((kNoSlot == best_slot_) || IsBetterSlot(slot, best_slot_)) {
+				best_slot_ = slot;
+			}
+		}
+		return slots_[slot];
+	}
+
+	void Vacate(const std::size_t slot) {
+		slots_[slot].second.clear();
+		occupied_[slot / kWordBits] &= ~(Word{ 1 } << (slot % kWordBits));
+		--occupied_count_;
+		if (slot == best_slot_) {
+			best_slot_ = NextWorseSlot(slot);
+		}
+	}
+
+	static bool IsBetterSlot(const std::size_t lhs, const std::size_t rhs) {
+		return kHigherIsBetter ? (lhs > rhs) : (lhs < rhs);
+	}
+
+	// Lowest occupied slot at or above `slot`.
+	std::size_t OccupiedAtOrAbove(std::size_t slot) const {
+		if (slot >= WindowTicks) {
+			return kNoSlot;
+		}
+		std::size_t word = slot / kWordBits;
+		Word bits = occupied_[word] & (~Word{ 0 } << (slot % kWordBits));
+		while (0 == bits) {
+			if (++word == kWords) {
+				return kNoSlot;
+			}
+			bits = occupied_[word];
+		}
+		return (word * kWordBits) + static_cast<std::size_t>(__builtin_ctzll(bits));
+	}
+
+	// Highest occupied slot at or below `slot`.
+	std::size_t OccupiedAtOrBelow(const std::size_t slot) const {
+		std::size_t word = slot / kWordBits;
+		const std::size_t bit = slot % kWordBits;
+		Word bits = occupied_[word] & ((kWordBits - 1 == bit) ? ~Word{ 0 } : ((Word{ 1 } << (bit + 1)) - 1));
+		while (0 == bits) {
+			if (0 == word--) {
+				return kNoSlot;
+			}
+			bits = occupied_[word];
+		}
+		return (word * kWordBits) + (kWordBits - 1) - static_cast<std::size_t>(__builtin_clzll(bits));
+	}
+
+	std::size_t NextWorseSlot(const std::size_t slot) const {
+		if (kHigherIsBetter) {
+			return (0 == slot) ? kNoSlot : OccupiedAtOrBelow(slot - 1);
+		}
+		return OccupiedAtOrAbove(slot + 1);
+	}
+
+	// First occupied slot whose price is worse than `price`, which need not be in the window.
+	std::size_t FirstSlotWorseThan(const Price price) const {
+		if (0 == occupied_count_) {
+			return kNoSlot;
+		}
+		if (price < Base()) {
+			return kHigherIsBetter ? kNoSlot : best_slot_;
+		}
+		const Price offset = (price - Base()) / TickSize;
+		if (offset >= WindowTicks) {
+			return kHigherIsBetter ? best_slot_ : kNoSlot;
+		}
+		// Off-grid prices sit between slots `offset` and `offset + 1`.
+		const auto slot = static_cast<std::size_t>(offset);
+		if (kHigherIsBetter) {
+			return (IsSlotPrice(price) && (0 == slot)) ? kNoSlot : OccupiedAtOrBelow(IsSlotPrice(price) ? slot - 1 : slot);
+		}
+		return OccupiedAtOrAbove(slot + 1);
+	}
+
+	// Move the window so that it is centred on `touch`.
+	// Levels falling out of the window go to the sparse map, and sparse levels falling into it are pulled in.
+	void Recentre(const Price touch) {
+		const Price half_window = (WindowTicks / 2) * TickSize;
+		const Price base = (touch > half_window) ? (touch - half_window) : 0;
+		const Price last = base + ((WindowTicks - 1) * TickSize);
+		const auto in_new_window = [base, last](const Price price) {
+			return IsSlotPrice(price) && (price >= base) && (price <= last);
+		};
+
+		Slots slots;
+		slots.reserve(WindowTicks);
+		for (std::size_t slot = 0; slot < WindowTicks; ++slot) {
+			slots.emplace_back(base + (slot * TickSize), Level{});
+		}
+
+		std::vector<Word> occupied(kWords, Word{ 0 });
+		std::size_t occupied_count = 0;
+		const auto occupy = [&](const Price price, Level& level) {
+			const auto slot = static_cast<std::size_t>((price - base) / TickSize);
+			slots[slot].second = std::move(level);
+			occupied[slot / kWordBits] |= (Word{ 1 } << (slot % kWordBits));
+			++occupied_count;
+		};
+
+		for (std::size_t slot = best_slot_; kNoSlot != slot; slot = NextWorseSlot(slot)) {
+			auto& [price, level] = slots_[slot];
+			if (in_new_window(price)) {
+				occupy(price, level);
+			}
+			else {
+				sparse_.emplace(price, std::move(level));
+			}
+		}
+
+		const Price best_edge = kHigherIsBetter ? last : base;
+		const Price worst_edge = kHigherIsBetter ? base : last;
+		for (auto it = sparse_.lower_bound(best_edge), it_end = sparse_.upper_bound(worst_edge); it_end != it;) {
+			if (in_new_window(it->first)) {
+				occupy(it->first, it->second);
+				it = sparse_.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+
+		slots_ = std::move(slots);
+		occupied_ = std::move(occupied);
+		occupied_count_ = occupied_count;
+		best_slot_ = (0 == occupied_count_)
+			? kNoSlot
+			: (kHigherIsBetter ? OccupiedAtOrBelow(WindowTicks - 1) : OccupiedAtOrAbove(0));
+	}
+};
+
+// Ladder policies: choose how an Orderbook stores its price levels.
+
+// Price levels in a std::map. Any price, O(log levels) lookup.
+struct MapLadder {
+	template<typename Level, typename BetterPrice>
+	using Levels = std::map<Price, Level, BetterPrice>;
+};
+
+// Price levels in an ArrayPriceLadder. O(1) lookup for prices within WindowTicks ticks of the touch.
+template<std::size_t WindowTicks = 1024, Price TickSize = 1>
+struct ArrayLadder {
+	template<typename Level, typename BetterPrice>
+	using Levels = ArrayPriceLadder<Level, BetterPrice, WindowTicks, TickSize>;
+};
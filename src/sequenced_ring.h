@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include "threads.h"
+
+// Ring buffer with one producer and several consumers, in the style of the LMAX disruptor.
+// Every consumer reads every entry, in sequence number order, straight out of the ring: nothing is copied per consumer.
+// The producer publishes entries by advancing a sequence, and may only reuse a slot once every consumer is past it.
+// Each consumer advances a sequence of its own, and may be made to wait for another consumer to be past an entry first.
+// Consumers take whatever is available in one batch, and are told which entry ends the batch
+// (e.g. to flush a journal once per batch rather than once per entry).
+// Capacity must be a power of two. Rings are large: allocate them on the heap.
+template<typename T, std::size_t Capacity, std::size_t MaxConsumers = 4>
+class SequencedRing {
+	static_assert((Capacity >= 2) && (0 == (Capacity & (Capacity - 1))), "Capacity must be a power of two");
+	static constexpr std::size_t kMask = Capacity - 1;
+
+	struct alignas(kCacheLineSize) Sequence {
+		std::atomic<std::uint64_t> value{ 0 };
+	};
+
+	// Sequence number after the last published entry
+	Sequence published_;
+	// Sequence number after the last entry each consumer is done with
+	Sequence consumed_[MaxConsumers];
+	// Consumer that each consumer has to stay behind, if any
+	std::optional<std::size_t> dependencies_[MaxConsumers];
+	std::size_t consumer_count_ = 0;
+
+	// Producer only: sequence number after the last claimed entry, and the slowest consumer when last looked at
+	alignas(kCacheLineSize) std::uint64_t claimed_ = 0;
+	std::uint64_t cached_gate_ = 0;
+
+	alignas(kCacheLineSize) T slots_[Capacity];
+
+	std::uint64_t SlowestConsumer() const {
+		std::uint64_t slowest = claimed_;
+		for (std::size_t i = 0; i < consumer_count_; ++i) {
+			const auto consumed = consumed_[i].value.load(std::memory_order_acquire);
+			if (consumed < slowest) {
+				slowest = consumed;
+			}
+		}
+		return slowest;
+	}
+
+public:
+	using ConsumerId = std::size_t;
+
+	SequencedRing() = default;
+	SequencedRing(const SequencedRing&) = delete;
+	SequencedRing& operator=(const SequencedRing&) = delete;
+
+	static constexpr std::size_t capacity() {
+		return Capacity;
+	}
+
+	// Register a consumer, optionally one that only reads entries once `after` is done with them.
+	// Only before anything is published. Returns std::nullopt if there are MaxConsumers already,
+	// or if `after` is not a consumer.
+	std::optional<ConsumerId> AddConsumer(const std::optional<ConsumerId> after = std::nullopt) {
+		if ((MaxConsumers == consumer_count_) || (after && (*after >= consumer_count_))) {
+			return std::nullopt;
+		}
+		dependencies_[consumer_count_] = after;
+		return consumer_count_++;
+	}
+
+	std::size_t ConsumerCount() const {
+		return consumer_count_;
+	}
+
+	// Producer: the next slot to fill in, or nullptr if every slot is still being read. Claimed slots are published by Publish().
+	T* TryClaim() {
+		if (claimed_ - cached_gate_ == Capacity) {
+			cached_gate_ = SlowestConsumer();
+			if (claimed_ - cached_gate_ == Capacity) {
+				return nullptr;
+			}
+		}
+		return &slots_[claimed_++ & kMask];
+	}
+
+	// Producer: make every claimed slot visible to consumers at once.
+	void Publish() {
+		published_.value.store(claimed_, std::memory_order_release);
+	}
+
+	// Producer: sequence number the next claimed entry will have.
+	std::uint64_t NextSequence() const {
+		return claimed_;
+	}
+
+	// Consumer: hand every entry available to this consumer right now, up to `max_count`,
+	// to consume(entry, sequence, end_of_batch), then release them in one go. Returns how many entries were consumed.
+	template<typename Consumer>
+	std::size_t ConsumeAvailable(const ConsumerId consumer, Consumer&& consume, const std::size_t max_count = Capacity) {
+		auto& consumed = consumed_[consumer].value;
+		const auto next = consumed.load(std::memory_order_relaxed);
+		auto available = published_.value.load(std::memory_order_acquire);
+		if (const auto dependency = dependencies_[consumer]) {
+			const auto dependency_consumed = consumed_[*dependency].value.load(std::memory_order_acquire);
+			if (dependency_consumed < available) {
+				available = dependency_consumed;
+			}
+		}
+		std::size_t count = static_cast<std::size_t>(available - next);
+		if (count > max_count) {
+			count = max_count;
+		}
+		for (std::size_t i = 0; i < count; ++i) {
+			const std::uint64_t sequence = next + i;
+			consume(static_cast<const T&>(slots_[sequence & kMask]), sequence, i + 1 == count);
+		}
+		if (count > 0) {
+			consumed.store(next + count, std::memory_order_release);
+		}
+		return count;
+	}
+
+	// Consumer: whether this consumer had read everything published when looked at.
+	bool CaughtUp(const ConsumerId consumer) const {
+		return consumed_[consumer].value.load(std::memory_order_acquire) == published_.value.load(std::memory_order_acquire);
+	}
+};
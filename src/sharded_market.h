@@ -0,0 +1,316 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "common_types.h"
+#include "market.h"
+#include "order_message.h"
+#include "spsc_queue.h"
+#include "threads.h"
+#include "trade_event_handlers.h"
+
+// Instruments never interact in matching, so a market can be split into shards, each owning the orderbooks of
+// the instruments assigned to it (instrument % shard count) and matching them on its own worker thread.
+//
+// One input thread Submit()s messages, which are passed to the shards over SPSC queues, in timestamp order.
+// Cancels and amends go to the shard that the order was entered in. Shards report back the orders that are no longer
+// live, so that their ids stop being routed, and a new order reusing the id of one still live on any shard is rejected,
+// as a single Market rejects it.
+// Shards report fills over another SPSC queue each, and the input thread Poll()s them into a trade event handler,
+// merging them back into message order: exactly the order a single Market would report them in.
+// A fill of message t is only passed on once every other shard has either reported all fills of messages up to t,
+// or has nothing left to do.
+template<typename MatchingOrdersComparator, typename FillAllocator, typename LadderPolicy = MapLadder>
+class ShardedMarket {
+	static constexpr std::size_t kQueueCapacity = 1 << 14;
+	using MessageQueue = SpscQueue<OrderMessage, kQueueCapacity>;
+	using TradeEventQueue = SpscQueue<QueuedTradeEvent, kQueueCapacity>;
+	using IdQueue = SpscQueue<Id, kQueueCapacity>;
+
+	template<typename Queue, typename T>
+	static void PushUnlessStopping(Queue& queue, const T& value, const std::atomic<bool>& stopping) {
+		unsigned spins = 0;
+		while ((!queue.TryPush(value)) && (!stopping.load(std::memory_order_relaxed))) {
+			SpinWait(spins);
+		}
+	}
+
+	// Trade event handler of a shard's Market: queues fills for the merger, and notes which resting orders traded.
+	struct TradeEventQueuer {
+		TradeEventQueue& trade_events;
+		const std::atomic<bool>& stopping;
+		Instrument instrument = 0;
+		std::vector<Id> filled_resting_ids;
+
+		void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
+			PushUnlessStopping(trade_events, QueuedTradeEvent{ side, instrument, matched_price, matched_quantity, aggressor_order, opposite_side_key }, stopping);
+			filled_resting_ids.push_back(opposite_side_key.id);
+		}
+	};
+	using ShardMarket = Market<MatchingOrdersComparator, FillAllocator, TradeEventQueuer, LadderPolicy>;
+
+	struct Shard {
+		MessageQueue messages;
+		TradeEventQueue trade_events;
+		// Ids of orders that stopped being live, pushed before the message that ended them is marked processed
+		IdQueue ended_orders;
+		// Timestamp of the last message processed, written by the worker
+		alignas(kCacheLineSize) std::atomic<TimeStamp> processed{ 0 };
+		// Timestamp of the last message submitted, used by the input thread only
+		alignas(kCacheLineSize) TimeStamp submitted = 0;
+		FillAllocator fill_allocator;
+		TradeEventQueuer trade_event_queuer;
+		ShardMarket market;
+		std::thread worker;
+
+		explicit Shard(const std::atomic<bool>& stopping)
+			: trade_event_queuer{ trade_events, stopping }
+			, market(fill_allocator, trade_event_queuer)
+		{}
+
+		// Has processed everything submitted to it, so it will not report any more fills until more is submitted.
+		bool Idle(const TimeStamp processed_timestamp) const {
+			return processed_timestamp == submitted;
+		}
+	};
+
+	std::atomic<bool> stopping_{ false };
+	std::vector<std::unique_ptr<Shard>> shards_;
+	// Shard of every order entered that has not been reported as ended yet, for routing cancels and amends
+	std::unordered_map<Id, std::size_t> order_shards_;
+	std::vector<TimeStamp> processed_snapshot_;
+
+	Shard& ShardOf(const Instrument instrument) {
+		return *shards_[instrument % shards_.size()];
+	}
+
+	// Report the orders a message may have ended that no longer rest: its own, and the resting orders it filled.
+	void ReportEndedOrders(Shard& shard, const OrderMessage& message) {
+		auto& filled_resting_ids = shard.trade_event_queuer.filled_resting_ids;
+		filled_resting_ids.push_back(message.order.key.id);
+		for (const auto id : filled_resting_ids) {
+			if (!shard.market.RestingOrderInstrument(id)) {
+				PushUnlessStopping(shard.ended_orders, id, stopping_);
+			}
+		}
+		filled_resting_ids.clear();
+	}
+
+	// Stop routing the orders a shard reported as ended, unless their id has been routed afresh since.
+	void ForgetEndedOrders(const std::size_t shard_index) {
+		shards_[shard_index]->ended_orders.ConsumeAvailable([this, shard_index](const Id id) {
+			const auto it = order_shards_.find(id);
+			if ((order_shards_.end() != it) && (shard_index == it->second)) {
+				order_shards_.erase(it);
+			}
+		});
+	}
+
+	// Route a new order to its shard, unless its id is that of an order still live on any shard.
+	// An id that is still routed may be that of an order ended by a message its shard has not reported on yet,
+	// so that shard is waited for first: only reused ids wait, and unique ones cost one lookup as before.
+	template<typename TradeEventHandler>
+	bool RouteNewOrder(const Id id, const std::size_t shard_index, TradeEventHandler& trade_event_handler) {
+		const auto [it, routed] = order_shards_.try_emplace(id, shard_index);
+		if (routed) {
+			return true;
+		}
+		const std::size_t earlier_shard_index = it->second;
+		Shard& earlier_shard = *shards_[earlier_shard_index];
+		unsigned spins = 0;
+		while (!earlier_shard.Idle(earlier_shard.processed.load(std::memory_order_acquire))) {
+			Poll(trade_event_handler);
+			SpinWait(spins);
+		}
+		ForgetEndedOrders(earlier_shard_index);
+		return order_shards_.try_emplace(id, shard_index).second;
+	}
+
+	void Work(Shard& shard) {
+		unsigned spins = 0;
+		for (;;) {
+			const auto count = shard.messages.ConsumeAvailable([this, &shard](OrderMessage& message) {
+				// New orders reusing a live id were rejected by Submit
+				ProcessOrderMessage(shard.market, shard.trade_event_queuer, message);
+				ReportEndedOrders(shard, message);
+				shard.processed.store(message.order.key.timestamp, std::memory_order_release);
+			});
+			if (count > 0) {
+				spins = 0;
+			}
+			else if (stopping_.load(std::memory_order_acquire) && shard.messages.Empty()) {
+				return;
+			}
+			else {
+				SpinWait(spins);
+			}
+		}
+	}
+
+	void Stop() {
+		stopping_.store(true, std::memory_order_release);
+		for (auto& shard : shards_) {
+			if (shard->worker.joinable()) {
+				shard->worker.join();
+			}
+		}
+	}
+
+public:
+	explicit ShardedMarket(const std::size_t shard_count) {
+		for (std::size_t i = 0; i < std::max<std::size_t>(shard_count, 1); ++i) {
+			shards_.push_back(std::make_unique<Shard>(stopping_));
+		}
+		processed_snapshot_.resize(shards_.size());
+	}
+
+	ShardedMarket(const ShardedMarket&) = delete;
+	ShardedMarket& operator=(const ShardedMarket&) = delete;
+
+	~ShardedMarket() {
+		Stop();
+	}
+
+	std::size_t ShardCount() const {
+		return shards_.size();
+	}
+
+	// Create the orderbook of an instrument up front. Only before Start().
+	void AddInstrument(const Instrument instrument) {
+		ShardOf(instrument).market.AddInstrument(instrument);
+	}
+
+	// Start a worker thread per shard. With `pin`, worker i is pinned to CPU i+1, leaving CPU 0 to the input thread,
+	// as long as there are enough CPUs.
+	void Start(const bool pin) {
+		const auto cpus = std::thread::hardware_concurrency();
+		for (std::size_t i = 0; i < shards_.size(); ++i) {
+			Shard& shard = *shards_[i];
+			shard.worker = std::thread([this, &shard, pin, cpus, i]() {
+				if (pin && (i + 1 < cpus)) {
+					PinThisThread(static_cast<unsigned>(i + 1));
+				}
+				Work(shard);
+			});
+		}
+	}
+
+	// Pass a message on to its shard. Messages must be submitted in increasing timestamp order.
+	// While the shard's queue is full, fills are polled into trade_event_handler to let the shards make progress.
+	// Returns false for cancels and amends of orders that are no longer live, which are dropped,
+	// and for new orders reusing the id of an order still live, which are rejected.
+	template<typename TradeEventHandler>
+	bool Submit(const OrderMessage& message, TradeEventHandler& trade_event_handler) {
+		std::size_t shard_index = 0;
+		if (OrderAction::New == message.action) {
+			shard_index = message.instrument % shards_.size();
+			if (!RouteNewOrder(message.order.key.id, shard_index, trade_event_handler)) {
+				return false;
+			}
+		}
+		else {
+			const auto it = order_shards_.find(message.order.key.id);
+			if (order_shards_.end() == it) {
+				return false;
+			}
+			shard_index = it->second;
+		}
+
+		Shard& shard = *shards_[shard_index];
+		shard.submitted = message.order.key.timestamp;
+		unsigned spins = 0;
+		while (!shard.messages.TryPush(message)) {
+			Poll(trade_event_handler);
+			SpinWait(spins);
+		}
+		return true;
+	}
+
+	// Pass every fill that is known to be next in message order to trade_event_handler. Returns how many were passed on.
+	// Also stops routing the orders that the shards have reported as ended.
+	template<typename TradeEventHandler>
+	std::size_t Poll(TradeEventHandler& trade_event_handler) {
+		for (std::size_t i = 0; i < shards_.size(); ++i) {
+			ForgetEndedOrders(i);
+		}
+		std::size_t count = 0;
+		for (;;) {
+			// How far each shard has got, before looking at their fills: fills of processed messages are then all visible
+			for (std::size_t i = 0; i < shards_.size(); ++i) {
+				processed_snapshot_[i] = shards_[i]->processed.load(std::memory_order_acquire);
+			}
+
+			// The earliest fill waiting in any shard
+			std::size_t earliest = shards_.size();
+			TimeStamp earliest_timestamp = 0;
+			for (std::size_t i = 0; i < shards_.size(); ++i) {
+				const QueuedTradeEvent* trade_event = shards_[i]->trade_events.Front();
+				if (trade_event && ((shards_.size() == earliest) || (trade_event->aggressor_order.key.timestamp < earliest_timestamp))) {
+					earliest = i;
+					earliest_timestamp = trade_event->aggressor_order.key.timestamp;
+				}
+			}
+			if (shards_.size() == earliest) {
+				return count;
+			}
+
+			// Other shards may still be matching an earlier message
+			for (std::size_t i = 0; i < shards_.size(); ++i) {
+				if ((i != earliest) && (processed_snapshot_[i] < earliest_timestamp) && (!shards_[i]->Idle(processed_snapshot_[i]))) {
+					return count;
+				}
+			}
+
+			// Pass on all fills of that message
+			TradeEventQueue& trade_events = shards_[earliest]->trade_events;
+			for (QueuedTradeEvent* trade_event = trade_events.Front()
+				; trade_event && (earliest_timestamp == trade_event->aggressor_order.key.timestamp)
+				; trade_event = trade_events.Front()) {
+				trade_event->PassOn(trade_event_handler);
+				trade_events.Pop();
+				++count;
+			}
+		}
+	}
+
+	// Wait for the shards to process everything submitted, passing on all fills, e.g. while there is no input.
+	template<typename TradeEventHandler>
+	void Drain(TradeEventHandler& trade_event_handler) {
+		unsigned spins = 0;
+		for (;;) {
+			Poll(trade_event_handler);
+			const bool done = std::all_of(shards_.begin(), shards_.end(), [](const auto& shard) {
+				return shard->Idle(shard->processed.load(std::memory_order_acquire)) && shard->trade_events.Empty();
+			});
+			if (done) {
+				return;
+			}
+			SpinWait(spins);
+		}
+	}
+
+	// Drain(), then stop the workers.
+	template<typename TradeEventHandler>
+	void Finish(TradeEventHandler& trade_event_handler) {
+		Drain(trade_event_handler);
+		Stop();
+	}
+
+	// Every resting order in all shards, in the same order as Market::ForEachOrderByTime. Only after Finish().
+	// The levels of every shard go into one merge, so nothing is collected or sorted.
+	template<typename FullOrderDetailHandler>
+	void ForEachOrderByTime(FullOrderDetailHandler& full_order_details_handler) const {
+		typename ShardMarket::OrdersByTimeMerge merge;
+		for (const Side side : { Side::Sell, Side::Buy }) {
+			merge.Reset(side);
+			for (const auto& shard : shards_) {
+				shard->market.AddLevelsTo(merge, side);
+			}
+			merge.Drain(full_order_details_handler);
+		}
+	}
+};
@@ -0,0 +1,178 @@
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+	constexpr char kSnapshotMagic[8] = { 'M', 'E', 'S', 'N', 'A', 'P', 'S', 'H' };
+}
+
+const char* ToString(const SnapshotError error) {
+	switch (error) {
+	case SnapshotError::None: return "no error";
+	case SnapshotError::BadHeader: return "not a snapshot, or of another version";
+	case SnapshotError::Truncated: return "snapshot is cut short";
+	case SnapshotError::BadLevel: return "price level of an unknown side or instrument, or with duplicate orders";
+	case SnapshotError::BadName: return "name was interned as another handle";
+	}
+	return "unknown error";
+}
+
+void SnapshotWriter::Header(const TimeStamp last_timestamp, const std::size_t instrument_count, const std::size_t order_count) {
+	char* header = Extend(kSnapshotHeaderSize);
+	memcpy(header, kSnapshotMagic, sizeof(kSnapshotMagic));
+	StoreWireField<std::uint32_t>(header, 8, kSnapshotVersion);
+	StoreWireField<std::uint32_t>(header, 12, 0);
+	StoreWireField<std::uint64_t>(header, 16, last_timestamp);
+	StoreWireField<std::uint64_t>(header, 24, instrument_count);
+	StoreWireField<std::uint64_t>(header, 32, order_count);
+}
+
+void SnapshotWriter::End() {
+	char* end = Extend(kSnapshotLevelSize);
+	memset(end, 0, kSnapshotLevelSize);
+	StoreWireField<std::uint8_t>(end, 0, kSnapshotEnd);
+}
+
+void SnapshotWriter::Names(const NameTables& names) {
+	const auto write_names = [this](const std::size_t count, const auto& name_of) {
+		StoreWireField<std::uint64_t>(Extend(8), 0, count);
+		for (std::size_t handle = 0; handle < count; ++handle) {
+			const std::string& name = name_of(handle);
+			StoreWireField<std::uint32_t>(Extend(4), 0, static_cast<std::uint32_t>(name.size()));
+			for (std::size_t offset = 0; offset < name.size(); offset += kNamePieceSize) {
+				const auto piece_size = std::min(kNamePieceSize, name.size() - offset);
+				name.copy(Extend(piece_size), piece_size, offset);
+			}
+		}
+	};
+	write_names(names.order_ids.Size(), [&names](const std::size_t handle) -> const std::string& { return names.order_ids.Name(static_cast<Id>(handle)); });
+	write_names(names.instruments.Size(), [&names](const std::size_t handle) -> const std::string& { return names.instruments.Name(static_cast<Instrument>(handle)); });
+}
+
+SnapshotError SnapshotReader::Header(TimeStamp& last_timestamp, std::size_t& instrument_count, std::size_t& order_count) {
+	const char* header = Next(kSnapshotHeaderSize);
+	if ((!header)
+		|| (0 != memcmp(header, kSnapshotMagic, sizeof(kSnapshotMagic)))
+		|| (kSnapshotVersion != LoadWireField<std::uint32_t>(header, 8))) {
+		return error_ = SnapshotError::BadHeader;
+	}
+	last_timestamp = LoadWireField<std::uint64_t>(header, 16);
+	instrument_count = static_cast<std::size_t>(LoadWireField<std::uint64_t>(header, 24));
+	order_count = static_cast<std::size_t>(LoadWireField<std::uint64_t>(header, 32));
+	return SnapshotError::None;
+}
+
+bool SnapshotReader::NextLevel(Instrument& instrument, Side& side, Price& price, std::size_t& order_count) {
+	const char* level = Next(kSnapshotLevelSize);
+	if (!level) {
+		return false;
+	}
+	switch (LoadWireField<std::uint8_t>(level, 0)) {
+	case 0: side = Side::Buy; break;
+	case 1: side = Side::Sell; break;
+	case kSnapshotEnd: return false;
+	default:
+		error_ = SnapshotError::BadLevel;
+		return false;
+	}
+	instrument = LoadWireField<std::uint32_t>(level, 4);
+	price = LoadWireField<std::uint64_t>(level, 8);
+	order_count = static_cast<std::size_t>(LoadWireField<std::uint64_t>(level, 16));
+	// Every order takes up room, so a corrupt count cannot make the reader loop for long
+	if (order_count > (bytes_.size() - offset_) / kSnapshotOrderSize) {
+		error_ = SnapshotError::Truncated;
+		return false;
+	}
+	return true;
+}
+
+SnapshotError SnapshotReader::Names(NameTables& names) {
+	const auto read_names = [this](auto& interner) {
+		const char* count = Next(8);
+		if (!count) {
+			return false;
+		}
+		const auto name_count = LoadWireField<std::uint64_t>(count, 0);
+		for (std::uint64_t handle = 0; handle < name_count; ++handle) {
+			const char* length = Next(4);
+			const char* name = length ? Next(LoadWireField<std::uint32_t>(length, 0)) : nullptr;
+			if (!name) {
+				return false;
+			}
+			if (handle != interner.Intern(std::string_view(name, LoadWireField<std::uint32_t>(length, 0)))) {
+				error_ = SnapshotError::BadName;
+				return false;
+			}
+		}
+		return true;
+	};
+	if (read_names(names.order_ids)) {
+		read_names(names.instruments);
+	}
+	return error_;
+}
+
+SnapshotFile::SnapshotFile(const char* path)
+	: path_(path)
+	, temporary_path_(path_ + ".tmp")
+{}
+
+SnapshotFile::~SnapshotFile() {
+	if (fd_ >= 0) {
+		close(fd_);
+		unlink(temporary_path_.c_str());
+	}
+}
+
+int SnapshotFile::Create() {
+	fd_ = open(temporary_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	return fd_;
+}
+
+bool SnapshotFile::Commit() {
+	const bool synced = (0 == fsync(fd_));
+	const bool closed = (0 == close(fd_));
+	fd_ = -1;
+	if (!(synced && closed)) {
+		unlink(temporary_path_.c_str());
+		return false;
+	}
+	return 0 == rename(temporary_path_.c_str(), path_.c_str());
+}
+
+void SnapshotFile::Release() {
+	if (fd_ >= 0) {
+		close(fd_);
+		fd_ = -1;
+	}
+}
+
+bool PeriodicSnapshots::Busy() {
+	if (child_ < 0) {
+		return false;
+	}
+	int status = 0;
+	const pid_t reaped = waitpid(child_, &status, WNOHANG);
+	if (0 == reaped) {
+		return true;
+	}
+	ok_ = (child_ == reaped) && WIFEXITED(status) && (0 == WEXITSTATUS(status)) && ok_;
+	child_ = -1;
+	return false;
+}
+
+bool PeriodicSnapshots::Finish() {
+	if (child_ >= 0) {
+		int status = 0;
+		pid_t reaped = -1;
+		do {
+			reaped = waitpid(child_, &status, 0);
+		} while ((reaped < 0) && (EINTR == errno));
+		ok_ = (child_ == reaped) && WIFEXITED(status) && (0 == WEXITSTATUS(status)) && ok_;
+		child_ = -1;
+	}
+	return ok_;
+}
@@ -0,0 +1,259 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "common_types.h"
+#include "interner.h"
+#include "output_buffer.h"
+#include "wire_format.h"
+
+// Snapshot of every resting order of a Market, for restoring it without replaying its history.
+// Fields are little-endian, and the file is laid out as:
+// - a header of kSnapshotHeaderSize bytes:
+//     offset  size  field
+//          0     8  "MESNAPSH"
+//          8     4  format version
+//         12     4  reserved, 0
+//         16     8  timestamp of the last message applied
+//         24     8  number of instruments
+//         32     8  number of resting orders
+// - each non-empty price level of each orderbook, sells then buys, best price first, as kSnapshotLevelSize bytes:
+//          0     1  side: 0 = buy, 1 = sell
+//          1     3  reserved, 0
+//          4     4  instrument
+//          8     8  price
+//         16     8  number of orders
+//   followed by its orders in priority order, kSnapshotOrderSize bytes each:
+//          0     8  order id
+//          8     8  timestamp
+//         16     8  remaining quantity
+// - an end marker: a level with side kSnapshotEnd,
+// - the names that order id and instrument handles were interned from, so that restored orders keep their names
+//   even if the journal never got to record them: the u64 number of order ids, then each order id's name
+//   in handle order, as its u32 length followed by its bytes; then the same for instruments.
+constexpr std::uint32_t kSnapshotVersion = 2;
+constexpr std::size_t kSnapshotHeaderSize = 40;
+constexpr std::size_t kSnapshotLevelSize = 24;
+constexpr std::size_t kSnapshotOrderSize = 24;
+constexpr std::uint8_t kSnapshotEnd = 0xFF;
+
+enum class SnapshotError {
+	None,
+	BadHeader,
+	// The file ends before the end marker
+	Truncated,
+	// A level with an unknown side or no orders, or of an instrument beyond the instrument count,
+	// or with an order of the same priority or id as another
+	BadLevel,
+	// A name that is already interned as another handle
+	BadName,
+};
+
+const char* ToString(const SnapshotError error);
+
+// Writes the snapshot format into an OutputBuffer, without ever making it grow (see OutputBuffer::FlushIfFull),
+// so that a forked child can write with the buffer its parent allocated.
+class SnapshotWriter {
+	OutputBuffer& output_;
+
+	// Longest piece of a name written at once
+	static constexpr std::size_t kNamePieceSize = 1024;
+	static_assert(kNamePieceSize <= OutputBuffer::kHeadroom);
+
+	// Room for `n` bytes, at most OutputBuffer::kHeadroom, to fill in.
+	char* Extend(const std::size_t n) {
+		output_.FlushIfFull();
+		return output_.Extend(n);
+	}
+
+public:
+	explicit SnapshotWriter(OutputBuffer& output)
+		: output_(output)
+	{}
+
+	void Header(TimeStamp last_timestamp, std::size_t instrument_count, std::size_t order_count);
+
+	// Start a level, whose orders follow.
+	void Level(const Instrument instrument, const Side side, const Price price, const std::size_t order_count) {
+		char* level = Extend(kSnapshotLevelSize);
+		StoreWireField<std::uint8_t>(level, 0, (Side::Buy == side) ? 0 : 1);
+		StoreWireField<std::uint8_t>(level, 1, 0);
+		StoreWireField<std::uint16_t>(level, 2, 0);
+		StoreWireField<std::uint32_t>(level, 4, instrument);
+		StoreWireField<std::uint64_t>(level, 8, price);
+		StoreWireField<std::uint64_t>(level, 16, order_count);
+	}
+
+	void RestingOrder(const PriorityKey& key, const Quantity quantity) {
+		char* order = Extend(kSnapshotOrderSize);
+		StoreWireField<std::uint64_t>(order, 0, key.id);
+		StoreWireField<std::uint64_t>(order, 8, key.timestamp);
+		StoreWireField<std::uint64_t>(order, 16, quantity);
+	}
+
+	void End();
+
+	// Follows End().
+	void Names(const NameTables& names);
+};
+
+// Reads the snapshot format from its bytes, e.g. a MappedFile's contents.
+class SnapshotReader {
+	std::string_view bytes_;
+	std::size_t offset_ = 0;
+	SnapshotError error_ = SnapshotError::None;
+
+	// The next `size` bytes, or nullptr if the snapshot ends before them
+	const char* Next(const std::size_t size) {
+		if (bytes_.size() - offset_ < size) {
+			error_ = SnapshotError::Truncated;
+			return nullptr;
+		}
+		const char* next = bytes_.data() + offset_;
+		offset_ += size;
+		return next;
+	}
+
+public:
+	explicit SnapshotReader(const std::string_view bytes)
+		: bytes_(bytes)
+	{}
+
+	// Read first.
+	SnapshotError Header(TimeStamp& last_timestamp, std::size_t& instrument_count, std::size_t& order_count);
+
+	// The next price level. Returns false at the end marker, or on an error (see Error()).
+	bool NextLevel(Instrument& instrument, Side& side, Price& price, std::size_t& order_count);
+
+	// The next order of the current level. Returns false on an error (see Error()).
+	bool NextOrder(PriorityKey& key, Quantity& quantity) {
+		const char* order = Next(kSnapshotOrderSize);
+		if (!order) {
+			return false;
+		}
+		key.id = LoadWireField<std::uint64_t>(order, 0);
+		key.timestamp = LoadWireField<std::uint64_t>(order, 8);
+		quantity = LoadWireField<std::uint64_t>(order, 16);
+		return true;
+	}
+
+	// Intern the names, after the end marker, into `names`, which may already hold some of them (e.g. the symbol universe)
+	// as long as they have the same handles.
+	SnapshotError Names(NameTables& names);
+
+	SnapshotError Error() const {
+		return error_;
+	}
+};
+
+// Creates a snapshot file under a temporary name, and only renames it into place once it is complete and synced,
+// so that a crash mid-write never leaves a partial snapshot behind.
+class SnapshotFile {
+	std::string path_;
+	std::string temporary_path_;
+	int fd_ = -1;
+
+public:
+	explicit SnapshotFile(const char* path);
+	SnapshotFile(const SnapshotFile&) = delete;
+	SnapshotFile& operator=(const SnapshotFile&) = delete;
+	// Removes the temporary file, unless committed
+	~SnapshotFile();
+
+	// Returns -1 if the temporary file cannot be created.
+	int Create();
+
+	// Sync the temporary file, and rename it into place. Returns false if either fails.
+	bool Commit();
+
+	// Close this process's descriptor, and leave the temporary file to the forked child that writes it.
+	void Release();
+};
+
+// Write a snapshot into a created SnapshotFile through `output`, which writes to it, and commit the file.
+// Allocates nothing. Returns false on an I/O error.
+template<typename Market>
+bool WriteSnapshotTo(const Market& market, const NameTables& names, const TimeStamp last_timestamp, OutputBuffer& output, SnapshotFile& file) {
+	SnapshotWriter writer(output);
+	market.Snapshot(writer, last_timestamp);
+	writer.Names(names);
+	return output.Flush() && file.Commit();
+}
+
+// Write a snapshot of `market`, and the `names` its handles stand for, to `path`, as of the message with timestamp `last_timestamp`.
+// Returns false on an I/O error.
+template<typename Market>
+bool WriteSnapshot(const Market& market, const NameTables& names, const TimeStamp last_timestamp, const char* path) {
+	SnapshotFile file(path);
+	const int fd = file.Create();
+	if (fd < 0) {
+		return false;
+	}
+	OutputBuffer output(fd);
+	return WriteSnapshotTo(market, names, last_timestamp, output, file);
+}
+
+// Write a snapshot from a forked child process. The child sees the market as of the fork through copy-on-write pages,
+// so the caller only stops matching for as long as fork() takes to copy the page tables.
+// The child must be reaped with waitpid(). Returns its pid, or -1 if it cannot be forked.
+// The caller may have other threads running (e.g. the journal's syncer), one of which may hold the allocator's lock
+// at the fork, so the child must not allocate: the file's paths and the output buffer are set up here, before forking,
+// and the child only formats into the buffer and makes system calls.
+template<typename Market>
+pid_t ForkSnapshot(const Market& market, const NameTables& names, const TimeStamp last_timestamp, const char* path) {
+	SnapshotFile file(path);
+	const int fd = file.Create();
+	if (fd < 0) {
+		return -1;
+	}
+	OutputBuffer output(fd);
+	const pid_t pid = fork();
+	if (0 == pid) {
+		_exit(WriteSnapshotTo(market, names, last_timestamp, output, file) ? 0 : 1);
+	}
+	if (pid > 0) {
+		file.Release();
+	}
+	return pid;
+}
+
+// Snapshots a market every `interval` messages from forked children, one at a time:
+// when a snapshot is due while the previous child is still writing, it is put off for another interval.
+class PeriodicSnapshots {
+	const char* path_;
+	std::size_t interval_;
+	std::size_t since_snapshot_ = 0;
+	pid_t child_ = -1;
+	bool ok_ = true;
+
+	// Whether the previous child is still writing. Reaps it otherwise.
+	bool Busy();
+
+public:
+	PeriodicSnapshots(const char* path, const std::size_t interval)
+		: path_(path)
+		, interval_(interval)
+	{}
+	PeriodicSnapshots(const PeriodicSnapshots&) = delete;
+	PeriodicSnapshots& operator=(const PeriodicSnapshots&) = delete;
+
+	// Call after applying each message, with its timestamp.
+	template<typename Market>
+	void AfterMessage(const Market& market, const NameTables& names, const TimeStamp timestamp) {
+		if (++since_snapshot_ < interval_) {
+			return;
+		}
+		since_snapshot_ = 0;
+		if (!Busy()) {
+			child_ = ForkSnapshot(market, names, timestamp, path_);
+			ok_ = (child_ >= 0) && ok_;
+		}
+	}
+
+	// Wait for the last child. Returns false if any snapshot could not be forked or written.
+	bool Finish();
+};
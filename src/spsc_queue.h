@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include "threads.h"
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// The producer and consumer indices live on their own cache lines, and each side keeps a cached copy of
+// the other side's index, so that it only touches the other side's cache line when the queue looks full (or empty).
+// Capacity must be a power of two, so that indices wrap with a mask. Queues are large: allocate them on the heap.
+template<typename T, std::size_t Capacity>
+class SpscQueue {
+	static_assert((Capacity >= 2) && (0 == (Capacity & (Capacity - 1))), "Capacity must be a power of two");
+	static constexpr std::size_t kMask = Capacity - 1;
+
+	// Next slot to read, written by the consumer only
+	alignas(kCacheLineSize) std::atomic<std::size_t> head_{ 0 };
+	std::size_t cached_tail_ = 0;
+
+	// Next slot to write, written by the producer only
+	alignas(kCacheLineSize) std::atomic<std::size_t> tail_{ 0 };
+	std::size_t cached_head_ = 0;
+
+	alignas(kCacheLineSize) T slots_[Capacity];
+
+public:
+	SpscQueue() = default;
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	static constexpr std::size_t capacity() {
+		return Capacity;
+	}
+
+	// Producer: returns false if the queue is full.
+	bool TryPush(const T& value) {
+		const auto tail = tail_.load(std::memory_order_relaxed);
+		if (tail - cached_head_ == Capacity) {
+			cached_head_ = head_.load(std::memory_order_acquire);
+			if (tail - cached_head_ == Capacity) {
+				return false;
+			}
+		}
+		slots_[tail & kMask] = value;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: the oldest value, or nullptr if the queue is empty. It stays valid until Pop().
+	T* Front() {
+		const auto head = head_.load(std::memory_order_relaxed);
+		if (head == cached_tail_) {
+			cached_tail_ = tail_.load(std::memory_order_acquire);
+			if (head == cached_tail_) {
+				return nullptr;
+			}
+		}
+		return &slots_[head & kMask];
+	}
+
+	// Consumer: remove the value returned by Front().
+	void Pop() {
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Consumer: returns false if the queue is empty.
+	bool TryPop(T& value) {
+		T* front = Front();
+		if (!front) {
+			return false;
+		}
+		value = *front;
+		Pop();
+		return true;
+	}
+
+	// Consumer: hand every value available right now, up to `max_count`, to consume(value), then free their slots in one go.
+	// Returns how many values were consumed.
+	template<typename Consumer>
+	std::size_t ConsumeAvailable(Consumer&& consume, const std::size_t max_count = Capacity) {
+		const auto head = head_.load(std::memory_order_relaxed);
+		cached_tail_ = tail_.load(std::memory_order_acquire);
+		std::size_t count = cached_tail_ - head;
+		if (count > max_count) {
+			count = max_count;
+		}
+		for (std::size_t i = 0; i < count; ++i) {
+			consume(slots_[(head + i) & kMask]);
+		}
+		if (count > 0) {
+			head_.store(head + count, std::memory_order_release);
+		}
+		return count;
+	}
+
+	// Either side: whether the queue was empty when looked at.
+	bool Empty() const {
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+};
@@ -0,0 +1,28 @@
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include <cstddef>
+#include <thread>
+
+// Size of a cache line, for keeping data written by different threads apart.
+constexpr std::size_t kCacheLineSize = 64;
+
+// Busy-wait step for spin loops: pause the core for a while, then start yielding it to other threads.
+inline void SpinWait(unsigned& spins) {
+	if (++spins < 1024) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+	else {
+		std::this_thread::yield();
+	}
+}
+
+// Pin the calling thread to one CPU. Best effort: returns false if the CPU cannot be used.
+inline bool PinThisThread(const unsigned cpu) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
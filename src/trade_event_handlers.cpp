@@ -1,12 +1,34 @@
 #include <stdio.h>
 #include "trade_event_handlers.h"
+#include "wire_format.h"
 
 void TradeEventConsolePrinter::HandleTradeEvent(const Side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
 	printf("TRADE %s %s %s %llu %llu\n"
-		, instrument.c_str()
-		, aggressor_order.key.id.c_str()
-		, opposite_side_key.id.c_str()
+		, names.instruments.Name(instrument).c_str()
+		, names.order_ids.Name(aggressor_order.key.id).c_str()
+		, names.order_ids.Name(opposite_side_key.id).c_str()
 		, matched_quantity
 		, matched_price
 		);
 }
+
+void TradeEventBufferedPrinter::HandleTradeEvent(const Side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
+	output.Append("TRADE ");
+	output.Append(names.instruments.Name(instrument));
+	output.Append(' ');
+	output.Append(names.order_ids.Name(aggressor_order.key.id));
+	output.Append(' ');
+	output.Append(names.order_ids.Name(opposite_side_key.id));
+	output.Append(' ');
+	output.Append(matched_quantity);
+	output.Append(' ');
+	output.Append(matched_price);
+	output.Append('\n');
+	output.EndRecord();
+}
+
+void TradeEventWireWriter::HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
+	const TradeReport report{ side, instrument, aggressor_order.key.id, opposite_side_key.id, matched_quantity, matched_price };
+	EncodeWireRecord(report, output.Extend(kWireRecordSize));
+	output.EndRecord();
+}
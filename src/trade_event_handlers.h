@@ -1,7 +1,59 @@
 #pragma once
 #include "common_types.h"
+#include "interner.h"
+#include "output_buffer.h"
 
-struct TradeEventConsolePrinter {
+// A fill as passed between threads, with everything a trade event handler is told about it.
+struct QueuedTradeEvent {
+	Side side;
 	Instrument instrument;
+	Price matched_price;
+	Quantity matched_quantity;
+	Order aggressor_order;
+	PriorityKey opposite_side_key;
+
+	// Hand the fill to a trade event handler with an `instrument` member, as the market would have.
+	template<typename TradeEventHandler>
+	void PassOn(TradeEventHandler& trade_event_handler) const {
+		trade_event_handler.instrument = instrument;
+		trade_event_handler.HandleTradeEvent(side, matched_price, matched_quantity, aggressor_order, opposite_side_key);
+	}
+};
+
+struct TradeEventConsolePrinter {
+	const NameTables& names;
+	Instrument instrument = 0;
+	void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key);
+};
+
+// Prints the same lines as TradeEventConsolePrinter, but formats them into an OutputBuffer rather than going through stdio per fill.
+struct TradeEventBufferedPrinter {
+	const NameTables& names;
+	OutputBuffer& output;
+	Instrument instrument = 0;
+	void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key);
+};
+
+// Writes each fill as a binary trade report record (see wire_format.h) into an OutputBuffer.
+struct TradeEventWireWriter {
+	OutputBuffer& output;
+	Instrument instrument = 0;
 	void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key);
 };
+
+// Passes fills on to another trade event handler with an `instrument` member, unless muted,
+// e.g. while a market is rebuilt by replaying its journal, whose trades have all been reported before.
+template<typename TradeEventHandler>
+struct MutableTradeEventHandler {
+	TradeEventHandler& handler;
+	bool muted = false;
+	Instrument instrument = 0;
+
+	void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
+		if (muted) {
+			return;
+		}
+		handler.instrument = instrument;
+		handler.HandleTradeEvent(side, matched_price, matched_quantity, aggressor_order, opposite_side_key);
+	}
+};
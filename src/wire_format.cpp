@@ -0,0 +1,136 @@
+#include "wire_format.h"
+
+namespace {
+	static_assert(kWireRecordSize == 40);
+
+	void StoreHeader(char* record, const WireRecordType type, const Side side, const Instrument instrument) {
+		StoreWireField<std::uint8_t>(record, 0, static_cast<std::uint8_t>(type));
+		StoreWireField<std::uint8_t>(record, 1, (Side::Buy == side) ? 0 : 1);
+		StoreWireField<std::uint8_t>(record, 2, 0);
+		StoreWireField<std::uint8_t>(record, 3, 0);
+		StoreWireField<std::uint32_t>(record, 4, instrument);
+	}
+
+	bool LoadSide(const char* record, Side& side) {
+		switch (LoadWireField<std::uint8_t>(record, 1)) {
+		case 0: side = Side::Buy; return true;
+		case 1: side = Side::Sell; return true;
+		}
+		return false;
+	}
+
+	bool LoadTimeInForce(const char* record, TimeInForce& time_in_force) {
+		switch (LoadWireField<std::uint8_t>(record, 2)) {
+		case 0: time_in_force = TimeInForce::GoodTillCancel; return true;
+		case 1: time_in_force = TimeInForce::ImmediateOrCancel; return true;
+		case 2: time_in_force = TimeInForce::FillOrKill; return true;
+		}
+		return false;
+	}
+
+	bool LoadOrderType(const char* record, OrderType& order_type) {
+		switch (LoadWireField<std::uint8_t>(record, 3)) {
+		case 0: order_type = OrderType::Limit; return true;
+		case 1: order_type = OrderType::Market; return true;
+		}
+		return false;
+	}
+}
+
+const char* ToString(const WireError error) {
+	switch (error) {
+	case WireError::None: return "no error";
+	case WireError::UnknownType: return "unknown record type";
+	case WireError::InvalidSide: return "side is neither buy nor sell";
+	case WireError::UnknownInstrument: return "instrument is out of range";
+	case WireError::InvalidTimeInForce: return "time in force is unknown";
+	case WireError::InvalidOrderType: return "order type is neither limit nor market";
+	}
+	return "unknown error";
+}
+
+void EncodeWireRecord(const OrderMessage& message, char* record) {
+	WireRecordType type = WireRecordType::NewOrder;
+	switch (message.action) {
+	case OrderAction::New: type = WireRecordType::NewOrder; break;
+	case OrderAction::Cancel: type = WireRecordType::Cancel; break;
+	case OrderAction::Amend: type = WireRecordType::Amend; break;
+	}
+	StoreHeader(record, type, message.side, message.instrument);
+	if (OrderAction::New == message.action) {
+		std::uint8_t time_in_force = 0;
+		switch (message.time_in_force) {
+		case TimeInForce::GoodTillCancel: time_in_force = 0; break;
+		case TimeInForce::ImmediateOrCancel: time_in_force = 1; break;
+		case TimeInForce::FillOrKill: time_in_force = 2; break;
+		}
+		StoreWireField<std::uint8_t>(record, 2, time_in_force);
+		StoreWireField<std::uint8_t>(record, 3, (OrderType::Limit == message.type) ? 0 : 1);
+	}
+	StoreWireField<std::uint64_t>(record, 8, message.order.key.id);
+	StoreWireField<std::uint64_t>(record, 16, message.order.quantity);
+	StoreWireField<std::uint64_t>(record, 24, message.order.price);
+	StoreWireField<std::uint64_t>(record, 32, 0);
+}
+
+void EncodeWireRecord(const TradeReport& report, char* record) {
+	StoreHeader(record, WireRecordType::TradeReport, report.aggressor_side, report.instrument);
+	StoreWireField<std::uint64_t>(record, 8, report.aggressor_id);
+	StoreWireField<std::uint64_t>(record, 16, report.quantity);
+	StoreWireField<std::uint64_t>(record, 24, report.price);
+	StoreWireField<std::uint64_t>(record, 32, report.resting_id);
+}
+
+WireRecordType WireRecordTypeOf(const char* record) {
+	return static_cast<WireRecordType>(LoadWireField<std::uint8_t>(record, 0));
+}
+
+WireError DecodeWireRecord(const TimeStamp timestamp, const char* record, const Instrument instrument_limit, OrderMessage& message) {
+	switch (WireRecordTypeOf(record)) {
+	case WireRecordType::NewOrder:
+		message.action = OrderAction::New;
+		if (!LoadSide(record, message.side)) {
+			return WireError::InvalidSide;
+		}
+		message.instrument = LoadWireField<std::uint32_t>(record, 4);
+		if (message.instrument >= instrument_limit) {
+			return WireError::UnknownInstrument;
+		}
+		if (!LoadTimeInForce(record, message.time_in_force)) {
+			return WireError::InvalidTimeInForce;
+		}
+		if (!LoadOrderType(record, message.type)) {
+			return WireError::InvalidOrderType;
+		}
+		break;
+	case WireRecordType::Cancel:
+		message.action = OrderAction::Cancel;
+		break;
+	case WireRecordType::Amend:
+		message.action = OrderAction::Amend;
+		break;
+	default:
+		return WireError::UnknownType;
+	}
+	Order& order = message.order;
+	order.key.id = LoadWireField<std::uint64_t>(record, 8);
+	order.key.timestamp = timestamp;
+	order.quantity = LoadWireField<std::uint64_t>(record, 16);
+	order.price = LoadWireField<std::uint64_t>(record, 24);
+	return WireError::None;
+}
+
+WireError DecodeWireRecord(const char* record, TradeReport& report) {
+	if (WireRecordType::TradeReport != WireRecordTypeOf(record)) {
+		return WireError::UnknownType;
+	}
+	if (!LoadSide(record, report.aggressor_side)) {
+		return WireError::InvalidSide;
+	}
+	report.instrument = LoadWireField<std::uint32_t>(record, 4);
+	report.aggressor_id = LoadWireField<std::uint64_t>(record, 8);
+	report.quantity = LoadWireField<std::uint64_t>(record, 16);
+	report.price = LoadWireField<std::uint64_t>(record, 24);
+	report.resting_id = LoadWireField<std::uint64_t>(record, 32);
+	return WireError::None;
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include "common_types.h"
+#include "line_reader.h"
+#include "order_message.h"
+
+// Binary order entry and trade report format: fixed-size little-endian records, with no delimiters.
+// Every record is kWireRecordSize bytes:
+//   offset  size  field
+//        0     1  type (WireRecordType)
+//        1     1  side: 0 = buy, 1 = sell (aggressor side for trade reports)
+//        2     1  time in force for new orders: 0 = good till cancel, 1 = immediate or cancel, 2 = fill or kill;
+//                 otherwise reserved, 0
+//        3     1  order type for new orders: 0 = limit, 1 = market (the price is then ignored); otherwise reserved, 0
+//        4     4  instrument
+//        8     8  order id (aggressor id for trade reports)
+//       16     8  quantity
+//       24     8  price
+//       32     8  resting order id for trade reports, otherwise reserved, 0
+// Unlike the text format, ids and instruments are carried as the engine's integer handles,
+// so binary gateways assign them (e.g. instruments by their position in the --symbols file).
+// Cancels only use the order id; amends use the order id, quantity and price.
+constexpr std::size_t kWireRecordSize = 40;
+
+enum class WireRecordType : std::uint8_t {
+	NewOrder = 1,
+	Cancel = 2,
+	Amend = 3,
+	TradeReport = 4,
+};
+
+// Fields of a record are stored little-endian, whatever the host's byte order.
+template<typename T>
+T ToLittleEndian(const T value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	if constexpr (sizeof(T) == 8) {
+		return __builtin_bswap64(value);
+	}
+	else if constexpr (sizeof(T) == 4) {
+		return __builtin_bswap32(value);
+	}
+	else if constexpr (sizeof(T) == 2) {
+		return __builtin_bswap16(value);
+	}
+	else {
+		return value;
+	}
+#else
+	return value;
+#endif
+}
+
+template<typename T>
+void StoreWireField(char* record, const std::size_t offset, const T value) {
+	const T little_endian = ToLittleEndian(value);
+	memcpy(record + offset, &little_endian, sizeof(T));
+}
+
+template<typename T>
+T LoadWireField(const char* record, const std::size_t offset) {
+	T little_endian;
+	memcpy(&little_endian, record + offset, sizeof(T));
+	return ToLittleEndian(little_endian);
+}
+
+// Why a record could not be decoded.
+enum class WireError {
+	None,
+	UnknownType,
+	InvalidSide,
+	UnknownInstrument,
+	InvalidTimeInForce,
+	InvalidOrderType,
+};
+
+const char* ToString(const WireError error);
+
+struct TradeReport {
+	Side aggressor_side;
+	Instrument instrument;
+	Id aggressor_id;
+	Id resting_id;
+	Quantity quantity;
+	Price price;
+};
+
+// Encode an inbound message into `record`, which must have room for kWireRecordSize bytes.
+void EncodeWireRecord(const OrderMessage& message, char* record);
+void EncodeWireRecord(const TradeReport& report, char* record);
+
+WireRecordType WireRecordTypeOf(const char* record);
+
+// Decode an inbound record, i.e. a new order, cancel or amend, stamping the order with `timestamp`.
+// Instruments must be below `instrument_limit`, so that a corrupt record cannot make the market create orderbooks without bound.
+WireError DecodeWireRecord(const TimeStamp timestamp, const char* record, const Instrument instrument_limit, OrderMessage& message);
+WireError DecodeWireRecord(const char* record, TradeReport& report);
+
+// Call handle_record for each whole record in `bytes`. Returns false if `bytes` ends with a partial record.
+template<typename RecordHandler>
+bool ForEachWireRecord(const std::string_view bytes, RecordHandler&& handle_record) {
+	const char* record = bytes.data();
+	const char* const end = bytes.data() + (bytes.size() - (bytes.size() % kWireRecordSize));
+	for (; record != end; record += kWireRecordSize) {
+		handle_record(record);
+	}
+	return 0 == (bytes.size() % kWireRecordSize);
+}
+
+// Read records from a file descriptor (e.g. stdin) in large blocks, and call handle_record for each one.
+// on_idle() is called whenever the reader is about to wait for input.
+// Returns false on a read error, or if the stream ends with a partial record.
+template<typename RecordHandler, typename IdleHandler = NoIdleHandler>
+bool ForEachWireRecordOfStream(const int fd, RecordHandler&& handle_record, const std::size_t block_size = kStreamBlockSize, IdleHandler&& on_idle = {}) {
+	std::vector<char> buffer(block_size);
+	std::size_t filled = 0;
+	for (;;) {
+		const std::size_t previously_filled = filled;
+		if (!ReadMore(fd, buffer, filled, on_idle)) {
+			return false;
+		}
+		if (previously_filled == filled) {
+			return 0 == filled;
+		}
+
+		// Hand over every whole record, and keep the partial one for the next read.
+		const std::size_t complete = filled - (filled % kWireRecordSize);
+		ForEachWireRecord(std::string_view(buffer.data(), complete), handle_record);
+		memmove(buffer.data(), buffer.data() + complete, filled - complete);
+		filled -= complete;
+	}
+}
@@ -1,10 +1,40 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
 #include <iostream>
+#include <optional>
+#include <set>
+#include <span>
+#include <unordered_map>
 #include "orderbook.h"
 #include "fill_allocator.h"
+#include "full_order_detail_handlers.h"
+#include "interner.h"
+#include "journal.h"
+#include "latency_histogram.h"
+#include "line_reader.h"
 #include "trade_event_handlers.h"
 #include "market.h"
+#include "market_data_handlers.h"
+#include "order_flow_generator.h"
+#include "order_parser.h"
+#include "order_queue.h"
+#include "output_buffer.h"
+#include "price_ladder.h"
+#include "pipelined_market.h"
+#include "sequenced_ring.h"
+#include "sharded_market.h"
+#include "snapshot.h"
+#include "spsc_queue.h"
+#include "wire_format.h"
+
+// Instrument and order id handles, as the gateway would have interned them
+constexpr Instrument ABC = 0;
+constexpr Instrument DEF = 1;
+constexpr Id unknown_id = 1000000;
 
 struct PriceAndQuantity {
 	Price price;
@@ -13,11 +43,9 @@ struct PriceAndQuantity {
 
 struct OrderMaker {
 	TimeStamp timestamp = 1;
-	unsigned long long id_number = 1;
+	Id id_number = 1;
 	Order MakeOrder(const Price price, const Quantity quantity) {
-		char id_string[32] = { 0 };
-		snprintf(id_string, sizeof(id_string), "%llu", id_number++);
-		return { price, quantity, { id_string, timestamp++ } };
+		return { price, quantity, { id_number++, timestamp++ } };
 	}
 };
 
@@ -39,6 +67,13 @@ struct TradeEvent {
 	Quantity matched_quantity;
 	Order aggressor_order;
 	PriorityKey opposite_side_key;
+	bool operator==(const TradeEvent& rhs) const {
+		return (side == rhs.side)
+			&& (matched_price == rhs.matched_price)
+			&& (matched_quantity == rhs.matched_quantity)
+			&& (aggressor_order == rhs.aggressor_order)
+			&& (opposite_side_key == rhs.opposite_side_key);
+	}
 };
 using TradeEvents = std::vector<TradeEvent>;
 
@@ -85,6 +120,25 @@ struct FullOrderDetailHandler {
 	}
 };
 
+// Deterministic pseudo-random numbers, so that randomised scenarios are reproducible.
+struct Lcg {
+	unsigned long long state = 1;
+	unsigned long long Next(const unsigned long long bound) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (state >> 33) % bound;
+	}
+};
+
+// Prices of all levels of a ladder, in iteration order.
+template<typename Levels>
+std::vector<Price> LevelPrices(const Levels& levels) {
+	std::vector<Price> prices;
+	for (const auto& [price, level] : levels) {
+		prices.push_back(price);
+	}
+	return prices;
+}
+
 SCENARIO("FIFO prioritiser and greedy allocator are used for filling orders in FIFO manner", "[matcher]") {
 	GIVEN("zero or more resting orders on the opposite side") {
 		GreedyFillAllocator matcher;
@@ -92,9 +146,9 @@ SCENARIO("FIFO prioritiser and greedy allocator are used for filling orders in F
 		const Price matched_price = 999;
 		using PrioritySortedOrders = std::map<PriorityKey, Quantity, PriorityKey::TimeStampComparator>;
 		PrioritySortedOrders opposite_side_resting_orders;
-		opposite_side_resting_orders[{"1", 1 }] = 10;
-		opposite_side_resting_orders[{ "2", 2 }] = 20;
-		opposite_side_resting_orders[{ "3", 3 }] = 30;
+		opposite_side_resting_orders[{1, 1 }] = 10;
+		opposite_side_resting_orders[{ 2, 2 }] = 20;
+		opposite_side_resting_orders[{ 3, 3 }] = 30;
 		Quantity total_available_opposite_side_quantity = TotalQuantity(opposite_side_resting_orders);
 		OrderMaker order_maker;
 		TradeEventAccumulator trade_event_accumulator;
@@ -218,13 +272,13 @@ SCENARIO("Market has orders", "[market]") {
 		};
 		for (const auto& order : orders) {
 			Order aggressor_order = order_maker.MakeOrder(order.price, order.quantity);
-			REQUIRE(FillExtent::None == market.Buy("ABC", aggressor_order));
+			REQUIRE(FillExtent::None == market.Buy(ABC, aggressor_order));
 		}
 
 		WHEN("there are no sells") {
 			const Quantity order_quantity = 1000;
 			Order aggressor_order = order_maker.MakeOrder(10008, order_quantity);
-			const FillExtent fill_extent = market.Buy("ABC", aggressor_order);
+			const auto fill_extent = market.Buy(ABC, aggressor_order);
 			THEN("no fills are performed") {
 				REQUIRE(FillExtent::None == fill_extent);
 				REQUIRE(order_quantity == aggressor_order.quantity);
@@ -232,14 +286,14 @@ SCENARIO("Market has orders", "[market]") {
 			THEN("final state of all orderbooks are correct") {
 				market.ForEachOrderByTime(full_order_details_handler);
 				const std::map<Id, FullOrderDetail> expected_orders = {
-					{"1", { Side::Buy, "ABC", { 10002, 1, { "1", 1 } } } },
-					{"2", { Side::Buy, "ABC", { 10002, 2, { "2", 2 } } } },
-					{"3", { Side::Buy, "ABC", { 10004, 3, { "3", 3 } } } },
-					{"4", { Side::Buy, "ABC", { 10005, 4, { "4", 4 } } } },
-					{"5", { Side::Buy, "ABC", { 10006, 5, { "5", 5 } } } },
-					{"6", { Side::Buy, "ABC", { 10006, 6, { "6", 6 } } } },
-					{"7", { Side::Buy, "ABC", { 10008, 7, { "7", 7 } } } },
-					{"8", { Side::Buy, "ABC", { 10008, order_quantity, { "8", 8 } } } },
+					{1, { Side::Buy, ABC, { 10002, 1, { 1, 1 } } } },
+					{2, { Side::Buy, ABC, { 10002, 2, { 2, 2 } } } },
+					{3, { Side::Buy, ABC, { 10004, 3, { 3, 3 } } } },
+					{4, { Side::Buy, ABC, { 10005, 4, { 4, 4 } } } },
+					{5, { Side::Buy, ABC, { 10006, 5, { 5, 5 } } } },
+					{6, { Side::Buy, ABC, { 10006, 6, { 6, 6 } } } },
+					{7, { Side::Buy, ABC, { 10008, 7, { 7, 7 } } } },
+					{8, { Side::Buy, ABC, { 10008, order_quantity, { 8, 8 } } } },
 				};
 				REQUIRE(full_order_details_handler.orders == expected_orders);
 			}
@@ -248,7 +302,7 @@ SCENARIO("Market has orders", "[market]") {
 			const Price order_price = 10005;
 			const Quantity order_quantity = 25;
 			Order aggressor_order = order_maker.MakeOrder(order_price, order_quantity);
-			const FillExtent fill_extent = market.Sell("DEF", aggressor_order);
+			const auto fill_extent = market.Sell(DEF, aggressor_order);
 			THEN("no fills are performed") {
 				REQUIRE(FillExtent::None == fill_extent);
 				REQUIRE(order_quantity == aggressor_order.quantity);
@@ -256,14 +310,14 @@ SCENARIO("Market has orders", "[market]") {
 			THEN("final state of all orderbooks are correct") {
 				market.ForEachOrderByTime(full_order_details_handler);
 				const std::map<Id, FullOrderDetail> expected_orders = {
-					{"1", { Side::Buy, "ABC", { 10002, 1, { "1", 1 } } } },
-					{"2", { Side::Buy, "ABC", { 10002, 2, { "2", 2 } } } },
-					{"3", { Side::Buy, "ABC", { 10004, 3, { "3", 3 } } } },
-					{"4", { Side::Buy, "ABC", { 10005, 4, { "4", 4 } } } },
-					{"5", { Side::Buy, "ABC", { 10006, 5, { "5", 5 } } } },
-					{"6", { Side::Buy, "ABC", { 10006, 6, { "6", 6 } } } },
-					{"7", { Side::Buy, "ABC", { 10008, 7, { "7", 7 } } } },
-					{"8", { Side::Sell, "DEF", { order_price, order_quantity, { "8", 8 } } } },
+					{1, { Side::Buy, ABC, { 10002, 1, { 1, 1 } } } },
+					{2, { Side::Buy, ABC, { 10002, 2, { 2, 2 } } } },
+					{3, { Side::Buy, ABC, { 10004, 3, { 3, 3 } } } },
+					{4, { Side::Buy, ABC, { 10005, 4, { 4, 4 } } } },
+					{5, { Side::Buy, ABC, { 10006, 5, { 5, 5 } } } },
+					{6, { Side::Buy, ABC, { 10006, 6, { 6, 6 } } } },
+					{7, { Side::Buy, ABC, { 10008, 7, { 7, 7 } } } },
+					{8, { Side::Sell, DEF, { order_price, order_quantity, { 8, 8 } } } },
 				};
 				REQUIRE(full_order_details_handler.orders == expected_orders);
 			}
@@ -272,7 +326,7 @@ SCENARIO("Market has orders", "[market]") {
 			const Price order_price = 10009;
 			const Quantity order_quantity = 1;
 			Order aggressor_order = order_maker.MakeOrder(order_price, order_quantity);
-			const FillExtent fill_extent = market.Sell("ABC", aggressor_order);
+			const auto fill_extent = market.Sell(ABC, aggressor_order);
 			THEN("no fills are performed") {
 				REQUIRE(FillExtent::None == fill_extent);
 				REQUIRE(order_quantity == aggressor_order.quantity);
@@ -280,14 +334,14 @@ SCENARIO("Market has orders", "[market]") {
 			THEN("final state of all orderbooks are correct") {
 				market.ForEachOrderByTime(full_order_details_handler);
 				const std::map<Id, FullOrderDetail> expected_orders = {
-					{"1", { Side::Buy, "ABC", { 10002, 1, { "1", 1 } } } },
-					{"2", { Side::Buy, "ABC", { 10002, 2, { "2", 2 } } } },
-					{"3", { Side::Buy, "ABC", { 10004, 3, { "3", 3 } } } },
-					{"4", { Side::Buy, "ABC", { 10005, 4, { "4", 4 } } } },
-					{"5", { Side::Buy, "ABC", { 10006, 5, { "5", 5 } } } },
-					{"6", { Side::Buy, "ABC", { 10006, 6, { "6", 6 } } } },
-					{"7", { Side::Buy, "ABC", { 10008, 7, { "7", 7 } } } },
-					{"8", { Side::Sell, "ABC", { order_price, order_quantity, { "8", 8 } } } },
+					{1, { Side::Buy, ABC, { 10002, 1, { 1, 1 } } } },
+					{2, { Side::Buy, ABC, { 10002, 2, { 2, 2 } } } },
+					{3, { Side::Buy, ABC, { 10004, 3, { 3, 3 } } } },
+					{4, { Side::Buy, ABC, { 10005, 4, { 4, 4 } } } },
+					{5, { Side::Buy, ABC, { 10006, 5, { 5, 5 } } } },
+					{6, { Side::Buy, ABC, { 10006, 6, { 6, 6 } } } },
+					{7, { Side::Buy, ABC, { 10008, 7, { 7, 7 } } } },
+					{8, { Side::Sell, ABC, { order_price, order_quantity, { 8, 8 } } } },
 				};
 				REQUIRE(full_order_details_handler.orders == expected_orders);
 			}
@@ -296,7 +350,7 @@ SCENARIO("Market has orders", "[market]") {
 			const Price order_price = 10005;
 			const Quantity order_quantity = 25;
 			Order aggressor_order = order_maker.MakeOrder(order_price, order_quantity);
-			const FillExtent fill_extent = market.Sell("ABC", aggressor_order);
+			const auto fill_extent = market.Sell(ABC, aggressor_order);
 			const Quantity expected_unfillled_quantity = order_quantity - (4 + 5 + 6 + 7);
 			THEN("partial fills are performed") {
 				REQUIRE(FillExtent::Partial == fill_extent);
@@ -305,23 +359,23 @@ SCENARIO("Market has orders", "[market]") {
 			THEN("final state of all orderbooks are correct") {
 				market.ForEachOrderByTime(full_order_details_handler);
 				const std::map<Id, FullOrderDetail> expected_orders = {
-					{"1", { Side::Buy, "ABC", { 10002, 1, { "1", 1 } } } },
-					{"2", { Side::Buy, "ABC", { 10002, 2, { "2", 2 } } } },
-					{"3", { Side::Buy, "ABC", { 10004, 3, { "3", 3 } } } },
+					{1, { Side::Buy, ABC, { 10002, 1, { 1, 1 } } } },
+					{2, { Side::Buy, ABC, { 10002, 2, { 2, 2 } } } },
+					{3, { Side::Buy, ABC, { 10004, 3, { 3, 3 } } } },
 					/*
-					{"4", { Side::Buy, "ABC", { 10005, 4, { "4", 4 } } } },
-					{"5", { Side::Buy, "ABC", { 10006, 5, { "5", 5 } } } },
-					{"6", { Side::Buy, "ABC", { 10006, 6, { "6", 6 } } } },
-					{"7", { Side::Buy, "ABC", { 10008, 7, { "7", 7 } } } },
+					{4, { Side::Buy, ABC, { 10005, 4, { 4, 4 } } } },
+					{5, { Side::Buy, ABC, { 10006, 5, { 5, 5 } } } },
+					{6, { Side::Buy, ABC, { 10006, 6, { 6, 6 } } } },
+					{7, { Side::Buy, ABC, { 10008, 7, { 7, 7 } } } },
 					*/
-					{"8", { Side::Sell, "ABC", { order_price, expected_unfillled_quantity, { "8", 8 } } } },
+					{8, { Side::Sell, ABC, { order_price, expected_unfillled_quantity, { 8, 8 } } } },
 				};
 				REQUIRE(full_order_details_handler.orders == expected_orders);
 			}
 		}
 		WHEN("complete fills are possible") {
 			Order aggressor_order = order_maker.MakeOrder(10005, 10);
-			const FillExtent fill_extent = market.Sell("ABC", aggressor_order);
+			const auto fill_extent = market.Sell(ABC, aggressor_order);
 			THEN("complete fills are performed") {
 				REQUIRE(FillExtent::Full == fill_extent);
 				REQUIRE(0 == aggressor_order.quantity);
@@ -329,14 +383,14 @@ SCENARIO("Market has orders", "[market]") {
 			THEN("final state of all orderbooks are correct") {
 				market.ForEachOrderByTime(full_order_details_handler);
 				const std::map<Id, FullOrderDetail> expected_orders = {
-					{"1", { Side::Buy, "ABC", { 10002, 1, { "1", 1 } } } },
-					{"2", { Side::Buy, "ABC", { 10002, 2, { "2", 2 } } } },
-					{"3", { Side::Buy, "ABC", { 10004, 3, { "3", 3 } } } },
-					{"4", { Side::Buy, "ABC", { 10005, 4, { "4", 4 } } } },
-					{"5", { Side::Buy, "ABC", { 10006, 5 - 3, { "5", 5 } } } },
-					{"6", { Side::Buy, "ABC", { 10006, 6, { "6", 6 } } } },
+					{1, { Side::Buy, ABC, { 10002, 1, { 1, 1 } } } },
+					{2, { Side::Buy, ABC, { 10002, 2, { 2, 2 } } } },
+					{3, { Side::Buy, ABC, { 10004, 3, { 3, 3 } } } },
+					{4, { Side::Buy, ABC, { 10005, 4, { 4, 4 } } } },
+					{5, { Side::Buy, ABC, { 10006, 5 - 3, { 5, 5 } } } },
+					{6, { Side::Buy, ABC, { 10006, 6, { 6, 6 } } } },
 					/*
-					{"7", { Side::Buy, "ABC", { 10008, 7, { "7", 7 } } } },
+					{7, { Side::Buy, ABC, { 10008, 7, { 7, 7 } } } },
 					*/
 				};
 				REQUIRE(full_order_details_handler.orders == expected_orders);
@@ -344,3 +398,2600 @@ SCENARIO("Market has orders", "[market]") {
 		}
 	}
 }
+
+template<typename BetterPrice>
+void RequireLadderBehavesLikeMap(Lcg& lcg) {
+	using Level = std::vector<Quantity>;
+	ArrayPriceLadder<Level, BetterPrice, 64, 5> ladder;
+	std::map<Price, Level, BetterPrice> reference;
+
+	for (int i = 0; i < 5000; ++i) {
+		const auto action = lcg.Next(10);
+		if (action < 6) {
+			// Mostly near the touch, sometimes far away or off the tick grid
+			const auto r = lcg.Next(20);
+			const Price price = (r < 14) ? (10000 + 5 * lcg.Next(60))
+				: (r < 17) ? (5 * lcg.Next(100000))
+				: (9000 + lcg.Next(2000));
+			ladder[price].push_back(i);
+			reference[price].push_back(i);
+		}
+		else if (action < 8) {
+			if (!reference.empty()) {
+				REQUIRE(!ladder.empty());
+				REQUIRE(ladder.begin()->first == reference.begin()->first);
+				ladder.erase(ladder.begin());
+				reference.erase(reference.begin());
+			}
+		}
+		else {
+			auto it_reference = reference.begin();
+			std::advance(it_reference, reference.empty() ? 0 : lcg.Next(reference.size()));
+			if (reference.end() != it_reference) {
+				auto it = ladder.find(it_reference->first);
+				REQUIRE(ladder.end() != it);
+				REQUIRE(it->second == it_reference->second);
+				it = ladder.erase(it);
+				it_reference = reference.erase(it_reference);
+				REQUIRE(((ladder.end() == it) ? 0 : it->first) == ((reference.end() == it_reference) ? 0 : it_reference->first));
+			}
+		}
+		REQUIRE(ladder.size() == reference.size());
+		REQUIRE(LevelPrices(ladder) == LevelPrices(reference));
+	}
+	REQUIRE(ladder.end() == ladder.find(1));
+}
+
+SCENARIO("Array price ladder keeps levels in the same order as std::map", "[ladder]") {
+	GIVEN("a stream of inserts and erases, near and far from the touch") {
+		Lcg lcg;
+		WHEN("the ladder holds bids") {
+			THEN("levels are iterated highest price first, exactly like std::map") {
+				RequireLadderBehavesLikeMap<std::greater<Price>>(lcg);
+			}
+		}
+		WHEN("the ladder holds asks") {
+			THEN("levels are iterated lowest price first, exactly like std::map") {
+				RequireLadderBehavesLikeMap<std::less<Price>>(lcg);
+			}
+		}
+	}
+}
+
+// Everything a market did in response to an order flow.
+struct OrderFlowResult {
+	TradeEventAccumulator trade_events;
+	std::vector<bool> cancel_results;
+	std::vector<std::optional<FillExtent>> amend_results;
+	FullOrderDetailHandler orders;
+	bool operator==(const OrderFlowResult& rhs) const {
+		return (trade_events.trade_event_history == rhs.trade_events.trade_event_history)
+			&& (cancel_results == rhs.cancel_results)
+			&& (amend_results == rhs.amend_results)
+			&& (orders == rhs.orders);
+	}
+};
+
+template<typename MatchingOrdersComparator, typename LadderPolicy>
+OrderFlowResult RunRandomOrderFlow() {
+	OrderFlowResult result;
+	Lcg lcg;
+	OrderMaker order_maker;
+	GreedyFillAllocator fill_allocator;
+	Market<MatchingOrdersComparator, GreedyFillAllocator, TradeEventAccumulator, LadderPolicy> market(fill_allocator, result.trade_events);
+	std::vector<Id> ids;
+	Price mid = 10000;
+	for (int i = 0; i < 20000; ++i) {
+		if ((!ids.empty()) && (0 == lcg.Next(4))) {
+			result.cancel_results.push_back(market.Cancel(ids[lcg.Next(ids.size())]));
+			continue;
+		}
+
+		// Let the touch wander so that the window has to follow it
+		mid = mid + lcg.Next(3) - 1;
+		const Price price = mid + lcg.Next(41) - 20;
+
+		if ((!ids.empty()) && (0 == lcg.Next(5))) {
+			const auto& id = ids[lcg.Next(ids.size())];
+			result.amend_results.push_back(market.Amend(id, lcg.Next(2) ? price : mid, lcg.Next(50), order_maker.timestamp++));
+			continue;
+		}
+		Order aggressor_order = order_maker.MakeOrder(price, 1 + lcg.Next(50));
+		ids.push_back(aggressor_order.key.id);
+		const Instrument instrument = lcg.Next(2) ? ABC : DEF;
+		if (lcg.Next(2)) {
+			market.Buy(instrument, aggressor_order);
+		}
+		else {
+			market.Sell(instrument, aggressor_order);
+		}
+	}
+	market.ForEachOrderByTime(result.orders);
+	return result;
+}
+
+SCENARIO("Orderbooks with array price ladders match exactly like those with std::map price levels", "[ladder][market]") {
+	GIVEN("the same random order flow sent to markets with different ladders") {
+		const auto map_result = RunRandomOrderFlow<PriorityKey::TimeStampComparator, MapLadder>();
+		REQUIRE(!map_result.trade_events.trade_event_history.empty());
+
+		WHEN("the window is wide enough to hold the whole book") {
+			const auto result = RunRandomOrderFlow<PriorityKey::TimeStampComparator, ArrayLadder<>>();
+			THEN("trades, cancels and resting orders are identical") {
+				REQUIRE(result == map_result);
+			}
+		}
+		WHEN("the window is narrow, so that many levels fall back to sparse storage") {
+			const auto result = RunRandomOrderFlow<PriorityKey::TimeStampComparator, ArrayLadder<16>>();
+			THEN("trades, cancels and resting orders are identical") {
+				REQUIRE(result == map_result);
+			}
+		}
+		WHEN("price levels are FIFO order queues instead of sorted maps") {
+			const auto result = RunRandomOrderFlow<FifoPriority, ArrayLadder<>>();
+			THEN("trades, cancels and resting orders are identical") {
+				REQUIRE(result == map_result);
+			}
+		}
+	}
+}
+
+SCENARIO("Order queues keep resting orders in arrival order", "[queue]") {
+	GIVEN("a queue with some resting orders") {
+		OrderQueue orders;
+		const auto it_1 = orders.emplace({ 1, 1 }, 10).first;
+		const auto it_2 = orders.emplace({ 2, 2 }, 20).first;
+		const auto it_3 = orders.emplace({ 3, 3 }, 30).first;
+		const auto ids = [&orders]() {
+			std::vector<Id> ids;
+			for (const auto& [key, quantity] : orders) {
+				ids.push_back(key.id);
+			}
+			return ids;
+		};
+
+		THEN("orders are iterated in arrival order") {
+			REQUIRE(orders.size() == 3);
+			REQUIRE(ids() == std::vector<Id>{ 1, 2, 3 });
+			REQUIRE(TotalQuantity(orders) == 60);
+		}
+		WHEN("an order in the middle is erased") {
+			const auto it = orders.erase(it_2);
+			THEN("its neighbours are linked up") {
+				REQUIRE(it == it_3);
+				REQUIRE(ids() == std::vector<Id>{ 1, 3 });
+			}
+		}
+		WHEN("the orders at both ends are erased") {
+			orders.pop_front();
+			REQUIRE(orders.end() == orders.erase(it_3));
+			THEN("only the middle order remains") {
+				REQUIRE(ids() == std::vector<Id>{ 2 });
+				REQUIRE(orders.front().second == 20);
+			}
+			THEN("new orders still go to the back") {
+				orders.emplace({ 4, 4 }, 40);
+				REQUIRE(ids() == std::vector<Id>{ 2, 4 });
+			}
+		}
+		WHEN("all orders are erased") {
+			REQUIRE(orders.erase(it_1) == it_2);
+			orders.clear();
+			THEN("the queue is empty") {
+				REQUIRE(orders.empty());
+				REQUIRE(orders.size() == 0);
+				REQUIRE(orders.begin() == orders.end());
+			}
+		}
+		WHEN("ranges of orders are erased") {
+			THEN("an empty range erases nothing") {
+				REQUIRE(orders.erase(it_2, it_2) == it_2);
+				REQUIRE(orders.size() == 3);
+			}
+			THEN("a range at the front leaves the rest linked up") {
+				REQUIRE(orders.erase(it_1, it_3) == it_3);
+				REQUIRE(orders.size() == 1);
+				REQUIRE(ids() == std::vector<Id>{ 3 });
+				orders.emplace({ 4, 4 }, 40);
+				REQUIRE(ids() == std::vector<Id>{ 3, 4 });
+			}
+			THEN("a range at the back leaves the rest linked up") {
+				REQUIRE(orders.erase(it_2, orders.end()) == orders.end());
+				REQUIRE(orders.size() == 1);
+				orders.emplace({ 4, 4 }, 40);
+				REQUIRE(ids() == std::vector<Id>{ 1, 4 });
+			}
+			THEN("the whole queue is released at once") {
+				REQUIRE(orders.erase(orders.begin(), orders.end()) == orders.end());
+				REQUIRE(orders.empty());
+				REQUIRE(orders.size() == 0);
+			}
+		}
+		WHEN("the greedy allocator sweeps the whole queue") {
+			GreedyFillAllocator matcher;
+			TradeEventAccumulator trade_event_accumulator;
+			Order aggressor_order{ 999, 100, { 4, 4 } };
+			matcher.Fill(Side::Buy, 999, aggressor_order, orders, trade_event_accumulator);
+			THEN("every order trades, and the queue is left empty") {
+				REQUIRE(aggressor_order.quantity == 40);
+				REQUIRE(trade_event_accumulator.trade_event_history.size() == 3);
+				REQUIRE(trade_event_accumulator.WereFillsFIFO());
+				REQUIRE(orders.empty());
+			}
+		}
+		WHEN("the greedy allocator fills an aggressor from the queue") {
+			GreedyFillAllocator matcher;
+			TradeEventAccumulator trade_event_accumulator;
+			OrderMaker order_maker;
+			order_maker.timestamp = 4;
+			Order aggressor_order = order_maker.MakeOrder(999, 35);
+			matcher.Fill(Side::Buy, 999, aggressor_order, orders, trade_event_accumulator);
+			THEN("orders are consumed from the front, FIFO") {
+				REQUIRE(aggressor_order.quantity == 0);
+				REQUIRE(trade_event_accumulator.WereFillsFIFO());
+				REQUIRE(ids() == std::vector<Id>{ 3 });
+				REQUIRE(TotalQuantity(orders) == 25);
+			}
+		}
+	}
+}
+
+template<typename MatchingOrdersComparator, typename LadderPolicy>
+void RequireCancelsRemoveRestingOrders() {
+	OrderMaker order_maker;
+	GreedyFillAllocator fill_allocator;
+	TradeEventAccumulator trade_event_accumulator;
+	Market<MatchingOrdersComparator, GreedyFillAllocator, TradeEventAccumulator, LadderPolicy> market(fill_allocator, trade_event_accumulator);
+	for (const auto& [price, quantity] : { PriceAndQuantity{ 10002, 1 }, { 10002, 2 }, { 10004, 3 } }) {
+		Order aggressor_order = order_maker.MakeOrder(price, quantity);
+		market.Buy(ABC, aggressor_order);
+	}
+
+	const auto remaining_orders = [&market]() {
+		FullOrderDetailHandler full_order_details_handler;
+		market.ForEachOrderByTime(full_order_details_handler);
+		std::vector<Id> ids;
+		for (const auto& [id, full_order_detail] : full_order_details_handler.orders) {
+			ids.push_back(id);
+		}
+		return ids;
+	};
+
+	// Cancelling one of two orders at a price keeps the level
+	REQUIRE(market.Cancel(1));
+	REQUIRE(remaining_orders() == std::vector<Id>{ 2, 3 });
+	REQUIRE(LevelPrices(market.Buys(ABC)) == std::vector<Price>{ 10004, 10002 });
+
+	// Cancelling the last order at a price removes the level
+	REQUIRE(market.Cancel(3));
+	REQUIRE(remaining_orders() == std::vector<Id>{ 2 });
+	REQUIRE(LevelPrices(market.Buys(ABC)) == std::vector<Price>{ 10002 });
+
+	// Orders can only be cancelled once, and unknown ids are rejected
+	REQUIRE(!market.Cancel(3));
+	REQUIRE(!market.Cancel(unknown_id));
+
+	// Partially filled orders can still be cancelled
+	Order partial_fill = order_maker.MakeOrder(10002, 1);
+	REQUIRE(FillExtent::Full == market.Sell(ABC, partial_fill));
+	REQUIRE(market.Cancel(2));
+	REQUIRE(market.Buys(ABC).empty());
+
+	// Completely filled orders are no longer resting
+	Order resting = order_maker.MakeOrder(10002, 5);
+	market.Buy(ABC, resting);
+	Order full_fill = order_maker.MakeOrder(10002, 5);
+	REQUIRE(FillExtent::Full == market.Sell(ABC, full_fill));
+	REQUIRE(!market.Cancel(resting.key.id));
+	REQUIRE(!market.Cancel(full_fill.key.id));
+	REQUIRE(remaining_orders().empty());
+
+	// An order reusing the id of one still resting is rejected, whichever side and price it has
+	Order live = order_maker.MakeOrder(10002, 5);
+	market.Buy(ABC, live);
+	Order reused_id = { 10001, 5, { live.key.id, order_maker.timestamp++ } };
+	trade_event_accumulator.trade_event_history.clear();
+	REQUIRE(!market.Sell(ABC, reused_id).has_value());
+	REQUIRE(trade_event_accumulator.trade_event_history.empty());
+	REQUIRE(remaining_orders() == std::vector<Id>{ live.key.id });
+	REQUIRE(market.LevelAt(ABC, Side::Buy, 10002) == LevelSummary{ 10002, 5, 1 });
+
+	// The rejection tells message processing apart from an order that rests without trading
+	struct {
+		Instrument instrument = 0;
+	} instrument_setter;
+	OrderMessage reused_id_message{ OrderAction::New, Side::Buy, ABC, OrderType::Limit, TimeInForce::GoodTillCancel, { 10001, 5, { live.key.id, order_maker.timestamp++ } } };
+	REQUIRE(!ProcessOrderMessage(market, instrument_setter, reused_id_message));
+	OrderMessage fresh_id_message{ OrderAction::New, Side::Buy, ABC, OrderType::Limit, TimeInForce::GoodTillCancel, order_maker.MakeOrder(10001, 5) };
+	REQUIRE(ProcessOrderMessage(market, instrument_setter, fresh_id_message));
+	REQUIRE(market.Cancel(fresh_id_message.order.key.id));
+	REQUIRE(remaining_orders() == std::vector<Id>{ live.key.id });
+	REQUIRE(market.Cancel(live.key.id));
+	REQUIRE(remaining_orders().empty());
+
+	// Once that order is gone, its id can be used again
+	REQUIRE(FillExtent::None == market.Sell(ABC, reused_id));
+	REQUIRE(remaining_orders() == std::vector<Id>{ live.key.id });
+}
+
+SCENARIO("Resting orders can be cancelled by id", "[market][cancel]") {
+	GIVEN("a market with std::map price levels") {
+		THEN("cancels remove resting orders and empty levels, and live ids are not reused") {
+			RequireCancelsRemoveRestingOrders<PriorityKey::TimeStampComparator, MapLadder>();
+		}
+	}
+	GIVEN("a market with an array price ladder and FIFO order queues") {
+		THEN("cancels remove resting orders and empty levels, and live ids are not reused") {
+			RequireCancelsRemoveRestingOrders<FifoPriority, ArrayLadder<>>();
+		}
+	}
+}
+
+SCENARIO("Resting orders can be amended", "[market][amend]") {
+	GIVEN("a market with two resting buys at the same price, and one at a lower price") {
+		OrderMaker order_maker;
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> market(fill_allocator, trade_event_accumulator);
+		for (const auto& [price, quantity] : { PriceAndQuantity{ 10002, 10 }, { 10002, 20 }, { 10001, 30 } }) {
+			Order aggressor_order = order_maker.MakeOrder(price, quantity);
+			market.Buy(ABC, aggressor_order);
+		}
+		const auto first_fill_against = [&]() {
+			Order aggressor_order = order_maker.MakeOrder(10001, 1);
+			market.Sell(ABC, aggressor_order);
+			return trade_event_accumulator.trade_event_history.back().opposite_side_key;
+		};
+		const auto resting_orders = [&market]() {
+			FullOrderDetailHandler full_order_details_handler;
+			market.ForEachOrderByTime(full_order_details_handler);
+			return full_order_details_handler.orders;
+		};
+
+		WHEN("the first order's quantity is reduced at the same price") {
+			const auto fill_extent = market.Amend(1, 10002, 5, 100);
+			THEN("it is amended in place and keeps its priority") {
+				REQUIRE(FillExtent::None == fill_extent);
+				REQUIRE(resting_orders().at(1).order == Order{ 10002, 5, { 1, 1 } });
+				REQUIRE(first_fill_against() == PriorityKey{ 1, 1 });
+			}
+		}
+		WHEN("the first order's quantity is increased") {
+			market.Amend(1, 10002, 15, 100);
+			THEN("it goes to the back of its level with the new timestamp") {
+				REQUIRE(resting_orders().at(1).order == Order{ 10002, 15, { 1, 100 } });
+				REQUIRE(first_fill_against() == PriorityKey{ 2, 2 });
+			}
+		}
+		WHEN("the lower order's price is raised to the best bid") {
+			market.Amend(3, 10002, 30, 100);
+			THEN("it joins the back of the best level") {
+				REQUIRE(resting_orders().at(3).order == Order{ 10002, 30, { 3, 100 } });
+				REQUIRE(LevelPrices(market.Buys(ABC)) == std::vector<Price>{ 10002 });
+				REQUIRE(first_fill_against() == PriorityKey{ 1, 1 });
+			}
+		}
+		WHEN("an order's price is amended across the spread") {
+			Order sell = order_maker.MakeOrder(10005, 25);
+			market.Sell(ABC, sell);
+			const auto fill_extent = market.Amend(2, 10005, 20, 100);
+			THEN("it trades as an aggressor with the new timestamp") {
+				REQUIRE(FillExtent::Full == fill_extent);
+				REQUIRE(trade_event_accumulator.trade_event_history.size() == 1);
+				const auto& trade_event = trade_event_accumulator.trade_event_history.back();
+				REQUIRE(trade_event.aggressor_order.key == PriorityKey{ 2, 100 });
+				REQUIRE(trade_event.opposite_side_key == sell.key);
+				REQUIRE(trade_event.matched_quantity == 20);
+				REQUIRE(resting_orders().at(sell.key.id).order.quantity == 5);
+				REQUIRE(!market.Cancel(2));
+			}
+		}
+		WHEN("an order is amended to zero quantity") {
+			market.Amend(3, 10001, 0, 100);
+			THEN("it is cancelled") {
+				REQUIRE(resting_orders().count(3) == 0);
+				REQUIRE(LevelPrices(market.Buys(ABC)) == std::vector<Price>{ 10002 });
+			}
+		}
+		WHEN("an unknown order is amended") {
+			THEN("the amend is rejected") {
+				REQUIRE(!market.Amend(unknown_id, 10002, 1, 100).has_value());
+				REQUIRE(resting_orders().size() == 3);
+			}
+		}
+	}
+}
+
+SCENARIO("Immediate-or-cancel and fill-or-kill orders never rest", "[market][tif]") {
+	GIVEN("a market with resting sells of 10 at 10001 and 20 at 10002") {
+		OrderMaker order_maker;
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> market(fill_allocator, trade_event_accumulator);
+		for (const auto& [price, quantity] : { PriceAndQuantity{ 10001, 10 }, { 10002, 20 } }) {
+			Order aggressor_order = order_maker.MakeOrder(price, quantity);
+			market.Sell(ABC, aggressor_order);
+		}
+		const auto resting_orders = [&market]() {
+			FullOrderDetailHandler full_order_details_handler;
+			market.ForEachOrderByTime(full_order_details_handler);
+			return full_order_details_handler.orders;
+		};
+
+		WHEN("an immediate-or-cancel buy reaches part of its quantity") {
+			Order aggressor_order = order_maker.MakeOrder(10001, 15);
+			const auto fill_extent = market.Buy(ABC, aggressor_order, TimeInForce::ImmediateOrCancel);
+			THEN("it trades what it can, and the rest is discarded") {
+				REQUIRE(FillExtent::Partial == fill_extent);
+				REQUIRE(trade_event_accumulator.trade_event_history.size() == 1);
+				REQUIRE(trade_event_accumulator.trade_event_history.back().matched_quantity == 10);
+				REQUIRE(resting_orders().size() == 1);
+				REQUIRE(market.Buys(ABC).empty());
+				REQUIRE(!market.Cancel(aggressor_order.key.id));
+			}
+		}
+		WHEN("an immediate-or-cancel buy does not reach the offer") {
+			Order aggressor_order = order_maker.MakeOrder(10000, 15);
+			const auto fill_extent = market.Buy(ABC, aggressor_order, TimeInForce::ImmediateOrCancel);
+			THEN("nothing trades or rests") {
+				REQUIRE(FillExtent::None == fill_extent);
+				REQUIRE(trade_event_accumulator.trade_event_history.empty());
+				REQUIRE(resting_orders().size() == 2);
+			}
+		}
+		WHEN("a fill-or-kill buy can trade in full across levels") {
+			Order aggressor_order = order_maker.MakeOrder(10002, 30);
+			const auto fill_extent = market.Buy(ABC, aggressor_order, TimeInForce::FillOrKill);
+			THEN("it trades in full") {
+				REQUIRE(FillExtent::Full == fill_extent);
+				REQUIRE(trade_event_accumulator.trade_event_history.size() == 2);
+				REQUIRE(market.Sells(ABC).empty());
+			}
+		}
+		WHEN("a fill-or-kill buy is larger than the offers its price reaches") {
+			Order aggressor_order = order_maker.MakeOrder(10001, 11);
+			const auto fill_extent = market.Buy(ABC, aggressor_order, TimeInForce::FillOrKill);
+			THEN("nothing trades or rests, and the book is untouched") {
+				REQUIRE(FillExtent::None == fill_extent);
+				REQUIRE(aggressor_order.quantity == 11);
+				REQUIRE(trade_event_accumulator.trade_event_history.empty());
+				REQUIRE(resting_orders().at(1).order == Order{ 10001, 10, { 1, 1 } });
+				REQUIRE(resting_orders().at(2).order == Order{ 10002, 20, { 2, 2 } });
+				REQUIRE(market.Buys(ABC).empty());
+			}
+		}
+		WHEN("a fill-or-kill sell meets no bids") {
+			Order aggressor_order = order_maker.MakeOrder(1, 1);
+			THEN("it is killed") {
+				REQUIRE(FillExtent::None == market.Sell(ABC, aggressor_order, TimeInForce::FillOrKill));
+				REQUIRE(market.Buys(ABC).empty());
+				REQUIRE(resting_orders().size() == 2);
+			}
+		}
+		WHEN("the same orders are sent as text messages") {
+			NameTables names;
+			names.instruments.Intern("ABC");
+			for (Id id = 0; id < 3; ++id) {
+				names.order_ids.Intern(std::to_string(id));
+			}
+			// Only told the instrument of each message; fills still go to the market's accumulator
+			struct {
+				Instrument instrument = 0;
+			} instrument_setter;
+			TimeStamp t = 100;
+			for (const char* line : { "fok BUY ABC 11 10001 FOK", "ioc BUY ABC 15 10001 IOC", "gtc BUY ABC 5 10001 GTC" }) {
+				OrderMessage message{};
+				REQUIRE(ParseError::None == ParseLineToOrderParams(++t, line, names, message));
+				ProcessOrderMessage(market, instrument_setter, message);
+			}
+			THEN("the fill-or-kill order is killed, the immediate-or-cancel one trades then goes, and the good-till-cancel one rests") {
+				REQUIRE(trade_event_accumulator.trade_event_history.size() == 1);
+				REQUIRE(trade_event_accumulator.trade_event_history.back().aggressor_order.key.timestamp == 102);
+				REQUIRE(LevelPrices(market.Buys(ABC)) == std::vector<Price>{ 10001 });
+				REQUIRE(resting_orders().size() == 2);
+			}
+		}
+	}
+}
+
+SCENARIO("Market orders sweep the opposite side at any price, and never rest", "[market][tif]") {
+	GIVEN("a market with resting sells of 10 at 10001 and 20 at 10002, and a buy of 5 at 9000") {
+		OrderMaker order_maker;
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> market(fill_allocator, trade_event_accumulator);
+		for (const auto& [price, quantity] : { PriceAndQuantity{ 10001, 10 }, { 10002, 20 } }) {
+			Order aggressor_order = order_maker.MakeOrder(price, quantity);
+			market.Sell(ABC, aggressor_order);
+		}
+		Order bid = order_maker.MakeOrder(9000, 5);
+		market.Buy(ABC, bid);
+
+		WHEN("a market buy is larger than the whole offer side") {
+			Order aggressor_order = order_maker.MakeOrder(0, 45);
+			const auto fill_extent = market.Buy(ABC, aggressor_order, TimeInForce::GoodTillCancel, OrderType::Market);
+			THEN("it trades with every level at the levels' prices, and the rest is discarded") {
+				REQUIRE(FillExtent::Partial == fill_extent);
+				const auto& trade_events = trade_event_accumulator.trade_event_history;
+				REQUIRE(trade_events.size() == 2);
+				REQUIRE(trade_events[0].matched_price == 10001);
+				REQUIRE(trade_events[0].matched_quantity == 10);
+				REQUIRE(trade_events[1].matched_price == 10002);
+				REQUIRE(trade_events[1].matched_quantity == 20);
+				REQUIRE(aggressor_order.quantity == 15);
+				REQUIRE(market.Sells(ABC).empty());
+				REQUIRE(LevelPrices(market.Buys(ABC)) == std::vector<Price>{ 9000 });
+				REQUIRE(!market.Cancel(aggressor_order.key.id));
+			}
+		}
+		WHEN("a market sell meets the bid far below the offers") {
+			Order aggressor_order = order_maker.MakeOrder(20000, 3);
+			const auto fill_extent = market.Sell(ABC, aggressor_order, TimeInForce::ImmediateOrCancel, OrderType::Market);
+			THEN("its own price is ignored") {
+				REQUIRE(FillExtent::Full == fill_extent);
+				REQUIRE(trade_event_accumulator.trade_event_history.back().matched_price == 9000);
+				REQUIRE(TotalQuantity(market.Buys(ABC).begin()->second) == 2);
+			}
+		}
+		WHEN("a fill-or-kill market buy is larger than the whole offer side") {
+			Order aggressor_order = order_maker.MakeOrder(0, 31);
+			const auto fill_extent = market.Buy(ABC, aggressor_order, TimeInForce::FillOrKill, OrderType::Market);
+			THEN("it is killed without trading") {
+				REQUIRE(FillExtent::None == fill_extent);
+				REQUIRE(trade_event_accumulator.trade_event_history.empty());
+				REQUIRE(LevelPrices(market.Sells(ABC)) == std::vector<Price>{ 10001, 10002 });
+			}
+		}
+		WHEN("market orders are sent as text messages") {
+			NameTables names;
+			names.instruments.Intern("ABC");
+			for (Id id = 0; id < 4; ++id) {
+				names.order_ids.Intern(std::to_string(id));
+			}
+			struct {
+				Instrument instrument = 0;
+			} instrument_setter;
+			TimeStamp t = 100;
+			for (const char* line : { "m1 BUY ABC 15 MKT", "m2 SELL ABC 100 MKT" }) {
+				OrderMessage message{};
+				REQUIRE(ParseError::None == ParseLineToOrderParams(++t, line, names, message));
+				REQUIRE(OrderType::Market == message.type);
+				ProcessOrderMessage(market, instrument_setter, message);
+			}
+			THEN("they trade and leave nothing resting") {
+				REQUIRE(trade_event_accumulator.trade_event_history.size() == 3);
+				REQUIRE(LevelPrices(market.Sells(ABC)) == std::vector<Price>{ 10002 });
+				REQUIRE(market.Buys(ABC).empty());
+			}
+		}
+	}
+}
+
+SCENARIO("Gateways intern external names into dense handles", "[interner]") {
+	GIVEN("an interner for instrument names") {
+		Interner<Instrument> instruments;
+		const Instrument btc = instruments.Intern("BTCUSD");
+		const Instrument eth = instruments.Intern("ETHUSD");
+
+		THEN("handles are dense, in order of first sight") {
+			REQUIRE(btc == 0);
+			REQUIRE(eth == 1);
+			REQUIRE(instruments.Size() == 2);
+		}
+		THEN("the same name always gets the same handle") {
+			REQUIRE(instruments.Intern(std::string("BTC") + "USD") == btc);
+			REQUIRE(instruments.Find("ETHUSD") == eth);
+			REQUIRE(instruments.Size() == 2);
+		}
+		THEN("names can be looked up again from handles") {
+			REQUIRE(instruments.Name(btc) == "BTCUSD");
+			REQUIRE(instruments.Name(eth) == "ETHUSD");
+		}
+		THEN("unknown names are not found, and not added") {
+			REQUIRE(!instruments.Find("XRPUSD").has_value());
+			REQUIRE(instruments.Size() == 2);
+		}
+	}
+}
+
+SCENARIO("Market routes orders to orderbooks by instrument handle", "[market]") {
+	GIVEN("a market with a large pre-registered symbol universe") {
+		OrderMaker order_maker;
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> market(fill_allocator, trade_event_accumulator);
+		const Instrument last_instrument = 7999;
+		market.AddInstrument(last_instrument);
+		REQUIRE(market.InstrumentCount() == 8000);
+
+		Order first_buy = order_maker.MakeOrder(100, 10);
+		market.Buy(0, first_buy);
+		Order last_buy = order_maker.MakeOrder(100, 10);
+		market.Buy(last_instrument, last_buy);
+
+		WHEN("an order for a registered instrument arrives") {
+			Order sell = order_maker.MakeOrder(100, 4);
+			market.Sell(last_instrument, sell);
+			THEN("it only trades in that instrument's orderbook") {
+				REQUIRE(trade_event_accumulator.trade_event_history.size() == 1);
+				REQUIRE(trade_event_accumulator.trade_event_history.back().opposite_side_key == last_buy.key);
+				REQUIRE(market.RestingOrderInstrument(first_buy.key.id) == Instrument{ 0 });
+				REQUIRE(market.RestingOrderInstrument(last_buy.key.id) == last_instrument);
+			}
+		}
+		WHEN("an order for a new instrument arrives") {
+			Order buy = order_maker.MakeOrder(100, 4);
+			market.Buy(last_instrument + 1, buy);
+			THEN("its orderbook is added, and resting orders elsewhere can still be cancelled") {
+				REQUIRE(market.InstrumentCount() == 8001);
+				REQUIRE(market.Cancel(first_buy.key.id));
+				REQUIRE(market.Cancel(last_buy.key.id));
+				REQUIRE(market.Buys(0).empty());
+				REQUIRE(market.Buys(last_instrument).empty());
+				REQUIRE(!market.Buys(last_instrument + 1).empty());
+			}
+		}
+	}
+}
+
+SCENARIO("The text gateway parses order entry lines", "[parser]") {
+	GIVEN("name tables that have not seen any order yet") {
+		NameTables names;
+		OrderMessage message{};
+
+		WHEN("a new order is parsed") {
+			const auto error = ParseLineToOrderParams(7, "abc12 SELL BTCUSD 5 10000", names, message);
+			THEN("the order's fields are filled in, with names interned") {
+				REQUIRE(ParseError::None == error);
+				REQUIRE(OrderAction::New == message.action);
+				REQUIRE(Side::Sell == message.side);
+				REQUIRE(names.instruments.Name(message.instrument) == "BTCUSD");
+				REQUIRE(names.order_ids.Name(message.order.key.id) == "abc12");
+				REQUIRE(message.order == Order{ 10000, 5, { message.order.key.id, 7 } });
+				REQUIRE(TimeInForce::GoodTillCancel == message.time_in_force);
+				REQUIRE(OrderType::Limit == message.type);
+			}
+			THEN("MKT in place of the price makes a market order, but not an amend to one") {
+				REQUIRE(ParseError::None == ParseLineToOrderParams(8, "m BUY BTCUSD 5 MKT IOC", names, message));
+				REQUIRE(OrderType::Market == message.type);
+				REQUIRE(TimeInForce::ImmediateOrCancel == message.time_in_force);
+				REQUIRE(ParseError::None == ParseLineToOrderParams(9, "l BUY BTCUSD 5 10000", names, message));
+				REQUIRE(OrderType::Limit == message.type);
+				REQUIRE(ParseError::InvalidPrice == ParseLineToOrderParams(10, "m AMEND 5 MKT", names, message));
+			}
+			THEN("a time in force can follow, and applies to that order only") {
+				REQUIRE(ParseError::None == ParseLineToOrderParams(8, "x SELL BTCUSD 5 10000 IOC", names, message));
+				REQUIRE(TimeInForce::ImmediateOrCancel == message.time_in_force);
+				REQUIRE(ParseError::None == ParseLineToOrderParams(9, "y BUY BTCUSD 5 10000\tFOK\r", names, message));
+				REQUIRE(TimeInForce::FillOrKill == message.time_in_force);
+				REQUIRE(ParseError::None == ParseLineToOrderParams(10, "z BUY BTCUSD 5 10000", names, message));
+				REQUIRE(TimeInForce::GoodTillCancel == message.time_in_force);
+			}
+			THEN("anything after the time in force is ignored") {
+				REQUIRE(ParseError::None == ParseLineToOrderParams(10, "z BUY BTCUSD 5 10000 IOC note", names, message));
+				REQUIRE(TimeInForce::ImmediateOrCancel == message.time_in_force);
+			}
+			THEN("the order can then be cancelled and amended by the same id") {
+				const Id id = message.order.key.id;
+				REQUIRE(ParseError::None == ParseLineToOrderParams(8, "abc12 CANCEL", names, message));
+				REQUIRE(OrderAction::Cancel == message.action);
+				REQUIRE(message.order.key.id == id);
+
+				REQUIRE(ParseError::None == ParseLineToOrderParams(9, "abc12  AMEND\t3 9999\r", names, message));
+				REQUIRE(OrderAction::Amend == message.action);
+				REQUIRE(message.order == Order{ 9999, 3, { id, 9 } });
+			}
+		}
+		WHEN("lines are malformed") {
+			THEN("the reason is reported, and no names are interned") {
+				REQUIRE(ParseError::EmptyLine == ParseLineToOrderParams(1, "  ", names, message));
+				REQUIRE(ParseError::MissingFields == ParseLineToOrderParams(1, "1", names, message));
+				REQUIRE(ParseError::MissingFields == ParseLineToOrderParams(1, "1 BUY BTCUSD 5", names, message));
+				REQUIRE(ParseError::UnknownAction == ParseLineToOrderParams(1, "1 HOLD BTCUSD 5 10000", names, message));
+				REQUIRE(ParseError::InvalidQuantity == ParseLineToOrderParams(1, "1 BUY BTCUSD 5x 10000", names, message));
+				REQUIRE(ParseError::InvalidQuantity == ParseLineToOrderParams(1, "1 BUY BTCUSD -5 10000", names, message));
+				REQUIRE(ParseError::InvalidPrice == ParseLineToOrderParams(1, "1 BUY BTCUSD 5 99999999999999999999", names, message));
+				REQUIRE(ParseError::UnknownOrderId == ParseLineToOrderParams(1, "1 CANCEL", names, message));
+				REQUIRE(ParseError::UnknownOrderId == ParseLineToOrderParams(1, "1 AMEND 5 10000", names, message));
+				REQUIRE(ParseError::UnknownTimeInForce == ParseLineToOrderParams(1, "1 BUY BTCUSD 5 10000 DAY", names, message));
+				REQUIRE(names.order_ids.Size() == 0);
+				REQUIRE(names.instruments.Size() == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("Input is split into lines without copying", "[input]") {
+	GIVEN("text with empty lines and no final newline") {
+		const std::string text = "a BUY\n\nb SELL\r\nc";
+		const std::vector<std::string> expected_lines = { "a BUY", "", "b SELL\r", "c" };
+
+		WHEN("the text is in memory, as if memory-mapped") {
+			std::vector<std::string> lines;
+			ForEachLine(text, [&lines](const std::string_view line) { lines.emplace_back(line); });
+			THEN("lines are split like std::getline splits them") {
+				REQUIRE(lines == expected_lines);
+			}
+		}
+		WHEN("the text is read from a pipe in blocks smaller than a line") {
+			int fds[2] = { -1, -1 };
+			REQUIRE(0 == pipe(fds));
+			REQUIRE(static_cast<ssize_t>(text.size()) == write(fds[1], text.data(), text.size()));
+			close(fds[1]);
+
+			std::vector<std::string> lines;
+			const bool ok = ForEachLineOfStream(fds[0], [&lines](const std::string_view line) { lines.emplace_back(line); }, 2);
+			close(fds[0]);
+			THEN("lines straddling blocks are put back together") {
+				REQUIRE(ok);
+				REQUIRE(lines == expected_lines);
+			}
+		}
+	}
+}
+
+// Everything readable from the read end of a pipe whose write end is closed.
+std::string ReadAll(const int fd) {
+	std::string contents;
+	char block[256];
+	for (ssize_t n = 0; (n = read(fd, block, sizeof(block))) > 0;) {
+		contents.append(block, static_cast<std::size_t>(n));
+	}
+	return contents;
+}
+
+SCENARIO("Output is formatted into a buffer and written in batches", "[output]") {
+	GIVEN("a market printing trades into an output buffer") {
+		NameTables names;
+		const auto abc = names.instruments.Intern("ABC");
+		const auto seller = names.order_ids.Intern("seller");
+		const auto buyer = names.order_ids.Intern("buyer");
+
+		WHEN("orders trade, and the remaining order is printed") {
+			int fds[2] = { -1, -1 };
+			REQUIRE(0 == pipe(fds));
+			{
+				OutputBuffer output(fds[1], 1 << 12, 1000000000);
+				GreedyFillAllocator fill_allocator;
+				TradeEventBufferedPrinter trade_printer{ names, output, abc };
+				Market<FifoPriority, GreedyFillAllocator, TradeEventBufferedPrinter> market(fill_allocator, trade_printer);
+				Order sell{ 18446744073709551615ULL, 100, { seller, 1 } };
+				Order buy{ 18446744073709551615ULL, 30, { buyer, 2 } };
+				market.Sell(abc, sell);
+				market.Buy(abc, buy);
+				// Nothing is written until the batch is due
+				REQUIRE(0 < output.Pending());
+
+				MarketBufferedPrinter market_printer{ names, output };
+				market.ForEachOrderByTime(market_printer);
+				REQUIRE(output.Flush());
+				REQUIRE(0 == output.Pending());
+			}
+			close(fds[1]);
+			const auto contents = ReadAll(fds[0]);
+			close(fds[0]);
+			THEN("lines are formatted exactly like the console printers format them") {
+				REQUIRE(contents ==
+					"TRADE ABC buyer seller 30 18446744073709551615\n"
+					"seller SELL ABC 70 18446744073709551615\n");
+			}
+		}
+	}
+	GIVEN("an output buffer with a small flush threshold") {
+		WHEN("records add up to more than the threshold") {
+			int fds[2] = { -1, -1 };
+			REQUIRE(0 == pipe(fds));
+			std::string expected;
+			{
+				OutputBuffer output(fds[1], 16, 1000000000);
+				for (const unsigned long long value : { 0ULL, 7ULL, 10ULL, 99ULL, 100ULL, 12345ULL, 18446744073709551615ULL }) {
+					output.Append(value);
+					output.Append('\n');
+					output.EndRecord();
+					expected += std::to_string(value) + "\n";
+				}
+				// Whole records have been written out, and only a partial batch is pending
+				REQUIRE(output.Pending() < 16);
+			}
+			close(fds[1]);
+			const auto contents = ReadAll(fds[0]);
+			close(fds[0]);
+			THEN("integers are formatted like printf formats them, and the rest is written on destruction") {
+				REQUIRE(contents == expected);
+			}
+		}
+	}
+	GIVEN("an output buffer with a long delay, echoing each line read from a pipe that is still open") {
+		int input_fds[2] = { -1, -1 };
+		int output_fds[2] = { -1, -1 };
+		REQUIRE(0 == pipe(input_fds));
+		REQUIRE(0 == pipe(output_fds));
+		const std::string first_line = "a BUY ABC 5 100\n";
+		REQUIRE(static_cast<ssize_t>(first_line.size()) == write(input_fds[1], first_line.data(), first_line.size()));
+
+		WHEN("the reader flushes the output whenever it is about to wait for input") {
+			std::size_t idle_count = 0;
+			std::size_t pending_when_idle = 0;
+			std::string written_when_idle;
+			{
+				OutputBuffer output(output_fds[1], 1 << 12, 1000000000);
+				const bool ok = ForEachLineOfStream(input_fds[0], [&output](const std::string_view line) {
+					output.Append(line);
+					output.Append('\n');
+					output.EndRecord();
+				}, kStreamBlockSize, [&]() {
+					++idle_count;
+					pending_when_idle = output.Pending();
+					REQUIRE(output.Flush());
+					// Only the first line's record is out; the writer sends the rest now
+					char block[256];
+					const auto n = read(output_fds[0], block, sizeof(block));
+					written_when_idle.assign(block, static_cast<std::size_t>(std::max<ssize_t>(n, 0)));
+					const std::string last_line = "b SELL ABC 5 100\n";
+					REQUIRE(static_cast<ssize_t>(last_line.size()) == write(input_fds[1], last_line.data(), last_line.size()));
+					close(input_fds[1]);
+				});
+				REQUIRE(ok);
+				// The last record waits for its batch until the end of the stream is reached
+				REQUIRE(0 < output.Pending());
+			}
+			close(input_fds[0]);
+			close(output_fds[1]);
+			const auto contents = ReadAll(output_fds[0]);
+			close(output_fds[0]);
+			THEN("the record pending while the input was idle is written out before the next input arrives") {
+				REQUIRE(1 == idle_count);
+				REQUIRE(first_line.size() == pending_when_idle);
+				REQUIRE(written_when_idle == first_line);
+				REQUIRE(contents == "b SELL ABC 5 100\n");
+			}
+		}
+	}
+	GIVEN("an output buffer with a delay of a millisecond") {
+		WHEN("a record has waited longer than that without another one being finished") {
+			int fds[2] = { -1, -1 };
+			REQUIRE(0 == pipe(fds));
+			OutputBuffer output(fds[1], 1 << 12, 1000000);
+			output.Append("TRADE\n");
+			output.EndRecord();
+			const auto pending_after_record = output.Pending();
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			output.FlushIfDue();
+			THEN("checking the delay between records writes it out") {
+				REQUIRE(6 == pending_after_record);
+				REQUIRE(0 == output.Pending());
+			}
+			close(fds[0]);
+			close(fds[1]);
+		}
+	}
+}
+
+SCENARIO("Orders and trades have a fixed-width binary wire format", "[wire]") {
+	GIVEN("order messages parsed from text") {
+		NameTables names;
+		std::vector<OrderMessage> messages;
+		TimeStamp t = 0;
+		for (const char* line : { "a BUY ABC 5 100", "b SELL DEF 7 18446744073709551615", "a AMEND 3 99", "b CANCEL", "c BUY ABC 1 100 IOC", "d SELL DEF 2 100 FOK", "e SELL DEF 3 MKT" }) {
+			OrderMessage message{};
+			REQUIRE(ParseError::None == ParseLineToOrderParams(++t, line, names, message));
+			messages.push_back(message);
+		}
+
+		WHEN("they are encoded and decoded again") {
+			std::vector<char> records(messages.size() * kWireRecordSize);
+			for (std::size_t i = 0; i < messages.size(); ++i) {
+				EncodeWireRecord(messages[i], records.data() + i * kWireRecordSize);
+			}
+			std::vector<OrderMessage> decoded;
+			std::vector<WireError> errors;
+			const bool whole = ForEachWireRecord(std::string_view(records.data(), records.size()), [&](const char* record) {
+				OrderMessage message{};
+				errors.push_back(DecodeWireRecord(static_cast<TimeStamp>(decoded.size() + 1), record, 2, message));
+				decoded.push_back(message);
+			});
+			THEN("every record decodes to the same message") {
+				REQUIRE(whole);
+				REQUIRE(errors == std::vector<WireError>(messages.size(), WireError::None));
+				for (std::size_t i = 0; i < messages.size(); ++i) {
+					REQUIRE(messages[i].action == decoded[i].action);
+					REQUIRE(messages[i].order == decoded[i].order);
+					if (OrderAction::New == messages[i].action) {
+						REQUIRE(messages[i].side == decoded[i].side);
+						REQUIRE(messages[i].instrument == decoded[i].instrument);
+						REQUIRE(messages[i].time_in_force == decoded[i].time_in_force);
+						REQUIRE(messages[i].type == decoded[i].type);
+					}
+				}
+			}
+			THEN("fields are little-endian at fixed offsets") {
+				const unsigned char* second = reinterpret_cast<const unsigned char*>(records.data()) + kWireRecordSize;
+				REQUIRE(static_cast<unsigned char>(WireRecordType::NewOrder) == second[0]);
+				REQUIRE(1 == second[1]);
+				REQUIRE(1 == second[4]);
+				REQUIRE(1 == second[8]);
+				REQUIRE(7 == second[16]);
+				REQUIRE(0 == second[17]);
+				REQUIRE(0xff == second[31]);
+			}
+		}
+		WHEN("a record is corrupt") {
+			char record[kWireRecordSize];
+			OrderMessage message{};
+			EncodeWireRecord(messages[1], record);
+			THEN("instruments beyond the limit are rejected") {
+				REQUIRE(WireError::UnknownInstrument == DecodeWireRecord(1, record, 1, message));
+			}
+			THEN("sides other than buy and sell are rejected") {
+				record[1] = 2;
+				REQUIRE(WireError::InvalidSide == DecodeWireRecord(1, record, 2, message));
+			}
+			THEN("unknown times in force are rejected") {
+				record[2] = 3;
+				REQUIRE(WireError::InvalidTimeInForce == DecodeWireRecord(1, record, 2, message));
+			}
+			THEN("unknown order types are rejected") {
+				record[3] = 2;
+				REQUIRE(WireError::InvalidOrderType == DecodeWireRecord(1, record, 2, message));
+			}
+			THEN("unknown record types are rejected") {
+				record[0] = 0;
+				REQUIRE(WireError::UnknownType == DecodeWireRecord(1, record, 2, message));
+				TradeReport report{};
+				REQUIRE(WireError::UnknownType == DecodeWireRecord(record, report));
+			}
+		}
+	}
+	GIVEN("a market writing trade reports") {
+		int fds[2] = { -1, -1 };
+		REQUIRE(0 == pipe(fds));
+		{
+			OutputBuffer output(fds[1]);
+			GreedyFillAllocator fill_allocator;
+			TradeEventWireWriter trade_writer{ output, DEF };
+			Market<FifoPriority, GreedyFillAllocator, TradeEventWireWriter> market(fill_allocator, trade_writer);
+			Order sell{ 100, 10, { 1, 1 } };
+			Order buy{ 101, 4, { 2, 2 } };
+			market.Sell(DEF, sell);
+			market.Buy(DEF, buy);
+			MarketWireWriter market_writer{ output };
+			market.ForEachOrderByTime(market_writer);
+		}
+		close(fds[1]);
+
+		WHEN("the output is read back in small blocks") {
+			std::vector<TradeReport> reports;
+			std::vector<OrderMessage> resting_orders;
+			const bool whole = ForEachWireRecordOfStream(fds[0], [&](const char* record) {
+				if (WireRecordType::TradeReport == WireRecordTypeOf(record)) {
+					TradeReport report{};
+					REQUIRE(WireError::None == DecodeWireRecord(record, report));
+					reports.push_back(report);
+				}
+				else {
+					OrderMessage message{};
+					REQUIRE(WireError::None == DecodeWireRecord(0, record, 2, message));
+					resting_orders.push_back(message);
+				}
+			}, 7);
+			close(fds[0]);
+			THEN("there is a trade report per fill, then a new order record per resting order") {
+				REQUIRE(whole);
+				REQUIRE(1 == reports.size());
+				REQUIRE(Side::Buy == reports[0].aggressor_side);
+				REQUIRE(DEF == reports[0].instrument);
+				REQUIRE(2 == reports[0].aggressor_id);
+				REQUIRE(1 == reports[0].resting_id);
+				REQUIRE(4 == reports[0].quantity);
+				REQUIRE(100 == reports[0].price);
+				REQUIRE(1 == resting_orders.size());
+				REQUIRE(Side::Sell == resting_orders[0].side);
+				REQUIRE(1 == resting_orders[0].order.key.id);
+				REQUIRE(6 == resting_orders[0].order.quantity);
+			}
+		}
+	}
+	GIVEN("a stream ending with a partial record") {
+		int fds[2] = { -1, -1 };
+		REQUIRE(0 == pipe(fds));
+		char records[kWireRecordSize + 3] = {};
+		REQUIRE(static_cast<ssize_t>(sizeof(records)) == write(fds[1], records, sizeof(records)));
+		close(fds[1]);
+		WHEN("it is read") {
+			int count = 0;
+			const bool whole = ForEachWireRecordOfStream(fds[0], [&count](const char*) { ++count; });
+			close(fds[0]);
+			THEN("whole records are handed over, and the partial one is reported") {
+				REQUIRE(1 == count);
+				REQUIRE(!whole);
+			}
+		}
+	}
+}
+
+SCENARIO("Latency histograms report percentiles to within their resolution", "[latency]") {
+	GIVEN("a histogram with 32 sub-buckets per power of two") {
+		LatencyHistogram<5> histogram;
+
+		WHEN("small values are recorded") {
+			for (std::uint64_t value = 1; value <= 32; ++value) {
+				histogram.Record(value);
+			}
+			THEN("they are counted exactly") {
+				REQUIRE(32 == histogram.Count());
+				REQUIRE(16 == histogram.ValueAtPercentile(50.0));
+				REQUIRE(32 == histogram.ValueAtPercentile(100.0));
+				REQUIRE(32 == histogram.Max());
+			}
+		}
+		WHEN("large values are recorded") {
+			for (std::uint64_t value = 1; value <= 100000; ++value) {
+				histogram.Record(value * 1000);
+			}
+			histogram.Record(18446744073709551615ULL);
+			THEN("percentiles are within 1/32 of the exact value, and the maximum is exact") {
+				const auto p50 = histogram.ValueAtPercentile(50.0);
+				const auto p99 = histogram.ValueAtPercentile(99.0);
+				REQUIRE(p50 >= 50000000);
+				REQUIRE(p50 <= 50000000 + 50000000 / 32);
+				REQUIRE(p99 >= 99000000);
+				REQUIRE(p99 <= 99000000 + 99000000 / 32);
+				REQUIRE(18446744073709551615ULL == histogram.Max());
+				REQUIRE(18446744073709551615ULL == histogram.ValueAtPercentile(100.0));
+			}
+		}
+		WHEN("nothing is recorded") {
+			THEN("every percentile is 0") {
+				REQUIRE(0 == histogram.ValueAtPercentile(99.9));
+			}
+		}
+	}
+}
+
+SCENARIO("Synthetic order flow is reproducible and shaped by its params", "[loadgen]") {
+	GIVEN("order flow params") {
+		OrderFlowParams params;
+		params.seed = 7;
+		params.instruments = 20;
+		params.cancel_ratio = 0.25;
+		params.aggressor_ratio = 0.2;
+
+		WHEN("two generators with the same seed run") {
+			OrderFlowGenerator first(params), second(params);
+			bool same = true;
+			OrderMessage a{}, b{};
+			for (int i = 0; i < 10000; ++i) {
+				first.Next(a);
+				second.Next(b);
+				same = same && (a.action == b.action) && (a.order == b.order)
+					&& ((OrderAction::Cancel == a.action) || ((a.side == b.side) && (a.instrument == b.instrument)));
+			}
+			THEN("they generate the same stream") {
+				REQUIRE(same);
+			}
+		}
+		WHEN("a stream is generated") {
+			OrderFlowGenerator generator(params);
+			std::vector<std::size_t> orders_per_instrument(params.instruments);
+			std::size_t cancels = 0, new_orders = 0;
+			std::set<Id> entered_ids;
+			bool cancels_entered_orders = true;
+			OrderMessage message{};
+			for (int i = 0; i < 100000; ++i) {
+				generator.Next(message);
+				if (OrderAction::Cancel == message.action) {
+					++cancels;
+					cancels_entered_orders = cancels_entered_orders && (1 == entered_ids.count(message.order.key.id));
+				}
+				else {
+					++new_orders;
+					++orders_per_instrument[message.instrument];
+					entered_ids.insert(message.order.key.id);
+				}
+			}
+			THEN("cancels only refer to entered orders, in about the configured ratio") {
+				REQUIRE(cancels_entered_orders);
+				REQUIRE(cancels > 23000);
+				REQUIRE(cancels < 27000);
+			}
+			THEN("instrument popularity falls off like a Zipf distribution") {
+				REQUIRE(orders_per_instrument[0] > orders_per_instrument[1]);
+				REQUIRE(orders_per_instrument[1] > orders_per_instrument[3]);
+				// With exponent 1, the most popular instrument is about 10 times as popular as the 10th
+				REQUIRE(orders_per_instrument[0] > 7 * orders_per_instrument[9]);
+				REQUIRE(orders_per_instrument[0] < 13 * orders_per_instrument[9]);
+			}
+		}
+	}
+}
+
+SCENARIO("SPSC queues pass values between two threads in order", "[shard]") {
+	GIVEN("a small queue") {
+		auto queue = std::make_unique<SpscQueue<std::uint64_t, 8>>();
+
+		WHEN("it is filled up on one thread") {
+			for (std::uint64_t i = 0; i < 8; ++i) {
+				REQUIRE(queue->TryPush(i));
+			}
+			THEN("it refuses more, and gives the values back in order, in batches") {
+				REQUIRE(!queue->TryPush(8));
+				std::vector<std::uint64_t> values;
+				REQUIRE(3 == queue->ConsumeAvailable([&values](const std::uint64_t value) { values.push_back(value); }, 3));
+				REQUIRE(5 == queue->ConsumeAvailable([&values](const std::uint64_t value) { values.push_back(value); }));
+				REQUIRE(values == std::vector<std::uint64_t>{ 0, 1, 2, 3, 4, 5, 6, 7 });
+				REQUIRE(queue->Empty());
+			}
+		}
+		WHEN("a producer thread pushes many more values than fit") {
+			constexpr std::uint64_t count = 100000;
+			std::thread producer([&queue]() {
+				for (std::uint64_t i = 0; i < count; ++i) {
+					unsigned spins = 0;
+					while (!queue->TryPush(i)) {
+						SpinWait(spins);
+					}
+				}
+			});
+			bool in_order = true;
+			std::uint64_t expected = 0;
+			unsigned spins = 0;
+			while (expected < count) {
+				std::uint64_t value = 0;
+				if (queue->TryPop(value)) {
+					in_order = in_order && (expected == value);
+					++expected;
+				}
+				else {
+					SpinWait(spins);
+				}
+			}
+			producer.join();
+			THEN("the consumer gets every value once, in order") {
+				REQUIRE(in_order);
+				REQUIRE(queue->Empty());
+			}
+		}
+	}
+}
+
+// Records fills with the instrument they were reported in.
+struct InstrumentTradeRecorder {
+	Instrument instrument = 0;
+	std::vector<std::pair<Instrument, TradeEvent>> trades;
+	void HandleTradeEvent(const Side side, const Price matched_price, const Quantity matched_quantity, const Order& aggressor_order, const PriorityKey& opposite_side_key) {
+		trades.push_back({ instrument, { side, matched_price, matched_quantity, aggressor_order, opposite_side_key } });
+	}
+};
+
+// Records resting orders in the order they are reported in.
+struct FullOrderDetailRecorder {
+	std::vector<FullOrderDetail> orders;
+	void HandleFullOrderDetail(const FullOrderDetail& full_order_detail) {
+		orders.push_back(full_order_detail);
+	}
+};
+
+SCENARIO("Sharded and pipelined markets report the same fills, in the same order, as a single market", "[shard][pipeline]") {
+	GIVEN("a synthetic order flow with amends and reused ids mixed in") {
+		OrderFlowParams params;
+		params.instruments = 10;
+		params.aggressor_ratio = 0.3;
+		OrderFlowGenerator generator(params);
+		Lcg lcg;
+		std::vector<OrderMessage> messages(30000);
+		for (std::size_t i = 0; i < messages.size(); ++i) {
+			auto& message = messages[i];
+			generator.Next(message);
+			if ((OrderAction::Cancel == message.action) && (0 == lcg.Next(2))) {
+				message.action = OrderAction::Amend;
+				message.order.quantity = lcg.Next(20);
+				message.order.price = params.start_price - 5 + lcg.Next(10);
+			}
+			// Some new orders take the id of a recent order, which may still be live, on the same shard or another
+			else if ((OrderAction::New == message.action) && (i > 0) && (0 == lcg.Next(10))) {
+				message.order.key.id = messages[i - 1 - lcg.Next(std::min<std::size_t>(i, 50))].order.key.id;
+			}
+		}
+
+		InstrumentTradeRecorder single_trades;
+		FullOrderDetailRecorder single_orders;
+		std::vector<TimeStamp> single_rejections;
+		{
+			GreedyFillAllocator fill_allocator;
+			Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> market(fill_allocator, single_trades);
+			for (auto message : messages) {
+				if (!ProcessOrderMessage(market, single_trades, message)) {
+					single_rejections.push_back(message.order.key.timestamp);
+				}
+			}
+			market.ForEachOrderByTime(single_orders);
+		}
+		REQUIRE(!single_trades.trades.empty());
+		REQUIRE(!single_rejections.empty());
+
+		for (const std::size_t shard_count : { 1, 3 }) {
+			WHEN("the flow is matched on " + std::to_string(shard_count) + " shards") {
+				InstrumentTradeRecorder sharded_trades;
+				FullOrderDetailRecorder sharded_orders;
+				std::vector<TimeStamp> sharded_rejections;
+				ShardedMarket<FifoPriority, GreedyFillAllocator, ArrayLadder<>> market(shard_count);
+				market.Start(false);
+				for (const auto& message : messages) {
+					if ((!market.Submit(message, sharded_trades)) && (OrderAction::New == message.action)) {
+						sharded_rejections.push_back(message.order.key.timestamp);
+					}
+					market.Poll(sharded_trades);
+				}
+				market.Finish(sharded_trades);
+				market.ForEachOrderByTime(sharded_orders);
+
+				THEN("fills, rejections and resting orders are identical") {
+					REQUIRE(sharded_trades.trades.size() == single_trades.trades.size());
+					REQUIRE(sharded_trades.trades == single_trades.trades);
+					REQUIRE(sharded_rejections == single_rejections);
+					REQUIRE(sharded_orders.orders == single_orders.orders);
+				}
+			}
+		}
+		WHEN("the flow is matched in a pipeline") {
+			InstrumentTradeRecorder pipelined_trades;
+			FullOrderDetailRecorder pipelined_orders;
+			NameTables output_names;
+			std::vector<TimeStamp> pipelined_rejections;
+			PipelinedMarket<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> market(pipelined_trades, output_names);
+			market.SetRejectedMessageHandler([&pipelined_rejections](const OrderMessage& message) {
+				pipelined_rejections.push_back(message.order.key.timestamp);
+			});
+			market.Start(false);
+			for (const auto& message : messages) {
+				market.Submit(message, {});
+			}
+			market.Finish();
+			market.ForEachOrderByTime(pipelined_orders);
+
+			THEN("fills, rejections and resting orders are identical") {
+				REQUIRE(pipelined_trades.trades == single_trades.trades);
+				REQUIRE(pipelined_rejections == single_rejections);
+				REQUIRE(pipelined_orders.orders == single_orders.orders);
+			}
+		}
+	}
+	GIVEN("an id reused for an instrument on another shard while its order is live, then cancelled") {
+		constexpr Instrument X = 0;
+		constexpr Instrument Y = 1;
+		std::vector<OrderMessage> messages{
+			{ OrderAction::New, Side::Buy, X, OrderType::Limit, TimeInForce::GoodTillCancel, { 100, 5, { 0, 1 } } },
+			{ OrderAction::New, Side::Buy, Y, OrderType::Limit, TimeInForce::GoodTillCancel, { 100, 5, { 0, 2 } } },
+			{ OrderAction::Cancel, Side::Buy, 0, OrderType::Limit, TimeInForce::GoodTillCancel, { 0, 0, { 0, 3 } } },
+			{ OrderAction::New, Side::Sell, Y, OrderType::Limit, TimeInForce::GoodTillCancel, { 100, 5, { 1, 4 } } },
+		};
+		WHEN("it is matched on 2 shards") {
+			InstrumentTradeRecorder sharded_trades;
+			FullOrderDetailRecorder sharded_orders;
+			std::vector<bool> submitted;
+			ShardedMarket<FifoPriority, GreedyFillAllocator, ArrayLadder<>> market(2);
+			market.Start(false);
+			for (const auto& message : messages) {
+				submitted.push_back(market.Submit(message, sharded_trades));
+				market.Poll(sharded_trades);
+			}
+			market.Finish(sharded_trades);
+			market.ForEachOrderByTime(sharded_orders);
+
+			THEN("the reuse is rejected, and the cancel reaches the live order, as in a single market") {
+				REQUIRE(submitted == std::vector<bool>{ true, false, true, true });
+				REQUIRE(sharded_trades.trades.empty());
+				REQUIRE(sharded_orders.orders.size() == 1);
+				REQUIRE(sharded_orders.orders[0].order.key.id == 1);
+				REQUIRE(sharded_orders.orders[0].instrument == Y);
+			}
+		}
+	}
+}
+
+SCENARIO("The output stage of a pipeline learns names as the gateway interns them", "[pipeline]") {
+	GIVEN("a pipeline printing trades as text") {
+		int fds[2] = { -1, -1 };
+		REQUIRE(0 == pipe(fds));
+		NameTables names;
+		NameTables output_names;
+
+		WHEN("lines are parsed, and new names passed along with their messages") {
+			{
+				OutputBuffer output(fds[1]);
+				TradeEventBufferedPrinter trade_printer{ output_names, output };
+				PipelinedMarket<FifoPriority, GreedyFillAllocator, TradeEventBufferedPrinter> market(trade_printer, output_names);
+				market.Start(false);
+				TimeStamp t = 0;
+				NewNameTracker new_names(names);
+				for (const char* line : { "s1 SELL ABC 5 100", "s2 SELL DEF 5 100", "b1 BUY DEF 7 100", "b1 AMEND 0 100" }) {
+					OrderMessage message{};
+					REQUIRE(ParseError::None == ParseLineToOrderParams(++t, line, names, message));
+					market.Submit(message, new_names.Take(names));
+				}
+				market.Finish();
+			}
+			close(fds[1]);
+			const auto contents = ReadAll(fds[0]);
+			close(fds[0]);
+
+			THEN("fills are printed with the right names, and both sides have the same handles") {
+				REQUIRE(contents == "TRADE DEF b1 s2 5 100\n");
+				REQUIRE(3 == output_names.order_ids.Size());
+				REQUIRE(2 == output_names.instruments.Size());
+				REQUIRE(names.instruments.Find("DEF") == output_names.instruments.Find("DEF"));
+				REQUIRE(names.order_ids.Find("b1") == output_names.order_ids.Find("b1"));
+			}
+		}
+	}
+}
+
+SCENARIO("Sequenced rings let several consumers read every entry in batches", "[ring]") {
+	GIVEN("a small ring with two independent consumers, and a third that stays behind the first") {
+		auto ring = std::make_unique<SequencedRing<std::uint64_t, 8>>();
+		const auto first = *ring->AddConsumer();
+		const auto second = *ring->AddConsumer();
+		const auto third = *ring->AddConsumer(first);
+
+		WHEN("the producer fills the ring") {
+			for (std::uint64_t i = 0; i < 8; ++i) {
+				*(ring->TryClaim()) = i;
+			}
+			ring->Publish();
+			THEN("it cannot claim more until every consumer has moved on") {
+				REQUIRE(nullptr == ring->TryClaim());
+				std::vector<bool> ends;
+				REQUIRE(0 == ring->ConsumeAvailable(third, [](const std::uint64_t&, std::uint64_t, bool) {}));
+				REQUIRE(8 == ring->ConsumeAvailable(first, [&ends](const std::uint64_t&, std::uint64_t, const bool end_of_batch) { ends.push_back(end_of_batch); }));
+				REQUIRE(ends == std::vector<bool>{ false, false, false, false, false, false, false, true });
+				REQUIRE(8 == ring->ConsumeAvailable(second, [](const std::uint64_t&, std::uint64_t, bool) {}));
+				REQUIRE(nullptr == ring->TryClaim());
+				REQUIRE(8 == ring->ConsumeAvailable(third, [](const std::uint64_t&, std::uint64_t, bool) {}));
+				REQUIRE(nullptr != ring->TryClaim());
+			}
+		}
+		WHEN("the consumers run on their own threads while many more entries than fit are published") {
+			constexpr std::uint64_t count = 50000;
+			std::atomic<std::uint64_t> first_done{ 0 };
+			const auto run = [&ring, count](const std::size_t consumer, std::atomic<std::uint64_t>* done, const std::atomic<std::uint64_t>* must_stay_behind) {
+				bool in_order = true;
+				std::uint64_t expected = 0;
+				unsigned spins = 0;
+				while (expected < count) {
+					const auto consumed = ring->ConsumeAvailable(consumer, [&](const std::uint64_t& value, const std::uint64_t sequence, bool) {
+						in_order = in_order && (expected == value) && (expected == sequence);
+						if (must_stay_behind) {
+							in_order = in_order && (sequence < must_stay_behind->load());
+						}
+						++expected;
+					});
+					if (done) {
+						done->store(expected);
+					}
+					if (0 == consumed) {
+						SpinWait(spins);
+					}
+				}
+				return in_order;
+			};
+			bool first_in_order = false, second_in_order = false, third_in_order = false;
+			std::thread first_thread([&]() { first_in_order = run(first, &first_done, nullptr); });
+			std::thread second_thread([&]() { second_in_order = run(second, nullptr, nullptr); });
+			std::thread third_thread([&]() { third_in_order = run(third, nullptr, &first_done); });
+			unsigned spins = 0;
+			for (std::uint64_t i = 0; i < count; ++i) {
+				std::uint64_t* slot = nullptr;
+				while (!(slot = ring->TryClaim())) {
+					SpinWait(spins);
+				}
+				*slot = i;
+				ring->Publish();
+			}
+			first_thread.join();
+			second_thread.join();
+			third_thread.join();
+			THEN("every consumer reads every entry once, in sequence, and the dependent one never overtakes") {
+				REQUIRE(first_in_order);
+				REQUIRE(second_in_order);
+				REQUIRE(third_in_order);
+			}
+		}
+	}
+	GIVEN("a ring with room for two consumers") {
+		auto ring = std::make_unique<SequencedRing<std::uint64_t, 8, 2>>();
+		WHEN("more consumers are added than fit, or behind consumers that do not exist") {
+			const auto first = ring->AddConsumer();
+			const auto behind_unknown = ring->AddConsumer(1);
+			const auto second = ring->AddConsumer(first);
+			const auto third = ring->AddConsumer();
+			THEN("those are refused") {
+				REQUIRE(first == 0);
+				REQUIRE(!behind_unknown.has_value());
+				REQUIRE(second == 1);
+				REQUIRE(!third.has_value());
+				REQUIRE(2 == ring->ConsumerCount());
+			}
+		}
+	}
+	GIVEN("a pipeline with another consumer of its inbound messages") {
+		NameTables output_names;
+		InstrumentTradeRecorder trades;
+		struct InboundRecorder {
+			std::vector<Id> ids;
+			std::vector<std::uint64_t> sequences;
+			std::size_t batches = 0;
+			void operator()(const OrderMessage& message, const NewNames&, const std::uint64_t sequence, const bool end_of_batch) {
+				ids.push_back(message.order.key.id);
+				sequences.push_back(sequence);
+				batches += end_of_batch ? 1 : 0;
+			}
+		} recorder;
+
+		WHEN("messages are submitted") {
+			{
+				PipelinedMarket<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder> market(trades, output_names);
+				REQUIRE(market.AddInboundConsumer(recorder));
+				market.Start(false);
+				for (Id id = 0; id < 1000; ++id) {
+					market.Submit({ OrderAction::New, (0 == id % 2) ? Side::Buy : Side::Sell, ABC, OrderType::Limit, TimeInForce::GoodTillCancel, { 100, 1, { id, id + 1 } } }, {});
+				}
+				market.Finish();
+			}
+			THEN("the consumer reads all of them in order, alongside the matcher") {
+				REQUIRE(1000 == recorder.ids.size());
+				REQUIRE(999 == recorder.ids.back());
+				REQUIRE(std::is_sorted(recorder.sequences.begin(), recorder.sequences.end()));
+				REQUIRE(999 == recorder.sequences.back());
+				REQUIRE(recorder.batches >= 1);
+				REQUIRE(500 == trades.trades.size());
+			}
+		}
+	}
+}
+
+// Path of a new, empty temporary file.
+std::string MakeTempFile() {
+	char path[] = "/tmp/me_test_XXXXXX";
+	const int fd = mkstemp(path);
+	REQUIRE(fd >= 0);
+	close(fd);
+	return path;
+}
+
+bool operator==(const OrderMessage& lhs, const OrderMessage& rhs) {
+	const bool same_order = (lhs.order.key.id == rhs.order.key.id) && (lhs.order.key.timestamp == rhs.order.key.timestamp)
+		&& (lhs.order.quantity == rhs.order.quantity) && (lhs.order.price == rhs.order.price);
+	if (OrderAction::New != lhs.action) {
+		return (lhs.action == rhs.action) && same_order;
+	}
+	return (lhs.action == rhs.action) && (lhs.side == rhs.side) && (lhs.instrument == rhs.instrument) && same_order;
+}
+
+SCENARIO("Inbound messages are journaled to a file with group commit", "[journal]") {
+	GIVEN("a journal opened after the symbol universe is loaded, and messages parsed from text") {
+		const auto path = MakeTempFile();
+		NameTables names;
+		names.instruments.Intern("XYZ");
+		std::vector<OrderMessage> messages;
+		JournalParams params;
+		params.sync_messages = 2;
+
+		WHEN("the messages are journaled, and the journal is read back") {
+			{
+				Journal journal(params);
+				REQUIRE(journal.Open(path.c_str(), names));
+				NewNameTracker new_names(names);
+				TimeStamp t = 0;
+				for (const char* line : { "a BUY ABC 5 100", "an-order-id-longer-than-a-whole-record-of-the-journal SELL DEF 7 18446744073709551615", "a AMEND 3 99", "b BUY XYZ 1 1", "b CANCEL" }) {
+					OrderMessage message{};
+					REQUIRE(ParseError::None == ParseLineToOrderParams(t += 2, line, names, message));
+					journal.Append(message, new_names.Take(names));
+					messages.push_back(message);
+				}
+				REQUIRE(journal.Close());
+				REQUIRE(messages.size() == journal.Durable());
+			}
+
+			NameTables read_names;
+			std::vector<OrderMessage> read_messages;
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			const auto error = ForEachJournalMessage(file.Contents(), read_names, 0, [&read_messages](const OrderMessage& message) {
+				read_messages.push_back(message);
+			});
+			THEN("the same messages come back, with their timestamps, and the names are interned as the same handles") {
+				REQUIRE(JournalError::None == error);
+				REQUIRE(read_messages == messages);
+				REQUIRE(names.instruments.Size() == read_names.instruments.Size());
+				REQUIRE(names.order_ids.Size() == read_names.order_ids.Size());
+				REQUIRE("XYZ" == read_names.instruments.Name(0));
+				REQUIRE("DEF" == read_names.instruments.Name(messages[1].instrument));
+				REQUIRE(names.order_ids.Name(messages[1].order.key.id) == read_names.order_ids.Name(messages[1].order.key.id));
+			}
+			THEN("a partial record left at the end by a crash is ignored") {
+				const std::string torn(file.Contents().substr(0, file.Contents().size() - 3));
+				NameTables torn_names;
+				std::size_t count = 0;
+				REQUIRE(JournalError::None == ForEachJournalMessage(torn, torn_names, 0, [&count](const OrderMessage&) { ++count; }));
+				REQUIRE(messages.size() - 1 == count);
+			}
+			THEN("names interned differently than journaled are reported") {
+				NameTables other_names;
+				other_names.instruments.Intern("ABC");
+				REQUIRE(JournalError::BadName == ForEachJournalMessage(file.Contents(), other_names, 0, [](const OrderMessage&) {}));
+				REQUIRE(JournalError::BadHeader == ForEachJournalMessage(file.Contents().substr(kWireRecordSize), other_names, 0, [](const OrderMessage&) {}));
+			}
+		}
+		unlink(path.c_str());
+	}
+	GIVEN("a pipeline with a journal reading its inbound messages") {
+		const auto path = MakeTempFile();
+		NameTables output_names;
+		InstrumentTradeRecorder trades;
+
+		WHEN("messages are submitted") {
+			Journal journal;
+			REQUIRE(journal.Open(path.c_str(), NameTables{}));
+			{
+				PipelinedMarket<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder> market(trades, output_names);
+				market.AddInboundConsumer(journal);
+				market.Start(false);
+				for (Id id = 0; id < 1000; ++id) {
+					market.Submit({ OrderAction::New, (0 == id % 2) ? Side::Buy : Side::Sell, ABC, OrderType::Limit, TimeInForce::GoodTillCancel, { 100, 1, { id, id + 1 } } }, {});
+				}
+				market.Finish();
+			}
+			REQUIRE(journal.Close());
+
+			NameTables read_names;
+			std::vector<Id> ids;
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			const auto error = ForEachJournalMessage(file.Contents(), read_names, 1, [&ids](const OrderMessage& message) {
+				ids.push_back(message.order.key.id);
+			});
+			THEN("every message is journaled in order") {
+				REQUIRE(JournalError::None == error);
+				REQUIRE(1000 == journal.Durable());
+				REQUIRE(1000 == ids.size());
+				REQUIRE(std::is_sorted(ids.begin(), ids.end()));
+			}
+		}
+		unlink(path.c_str());
+	}
+}
+
+SCENARIO("A market is recovered by replaying its journal with trade reporting muted", "[journal]") {
+	GIVEN("a synthetic order flow, and the fills and book of matching all of it in one go") {
+		OrderFlowParams params;
+		params.instruments = 5;
+		params.aggressor_ratio = 0.3;
+		OrderFlowGenerator generator(params);
+		std::vector<OrderMessage> messages(20000);
+		for (auto& message : messages) {
+			generator.Next(message);
+		}
+		const std::size_t crash = messages.size() / 2;
+
+		InstrumentTradeRecorder all_trades;
+		FullOrderDetailRecorder all_orders;
+		{
+			GreedyFillAllocator fill_allocator;
+			Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> market(fill_allocator, all_trades);
+			for (auto message : messages) {
+				ProcessOrderMessage(market, all_trades, message);
+			}
+			market.ForEachOrderByTime(all_orders);
+		}
+
+		WHEN("a market journals half of the flow and crashes mid-write, and another one recovers from the journal and matches the rest") {
+			const auto path = MakeTempFile();
+			NameTables names;
+			InstrumentTradeRecorder trades_before_crash;
+			{
+				Journal journal;
+				REQUIRE(journal.Open(path.c_str(), names));
+				GreedyFillAllocator fill_allocator;
+				Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> market(fill_allocator, trades_before_crash);
+				for (std::size_t i = 0; i < crash; ++i) {
+					auto message = messages[i];
+					journal.Append(message, {});
+					ProcessOrderMessage(market, trades_before_crash, message);
+				}
+				REQUIRE(journal.Close());
+			}
+			const int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+			REQUIRE(fd >= 0);
+			REQUIRE(7 == write(fd, "partial", 7));
+			close(fd);
+
+			InstrumentTradeRecorder trades_after_crash;
+			MutableTradeEventHandler<InstrumentTradeRecorder> trade_recorder{ trades_after_crash };
+			FullOrderDetailRecorder recovered_orders;
+			JournalPosition position;
+			JournalError error = JournalError::None;
+			{
+				GreedyFillAllocator fill_allocator;
+				Market<FifoPriority, GreedyFillAllocator, MutableTradeEventHandler<InstrumentTradeRecorder>, ArrayLadder<>> market(fill_allocator, trade_recorder);
+				{
+					MappedFile file;
+					REQUIRE(file.Open(path.c_str()));
+					trade_recorder.muted = true;
+					error = ForEachJournalMessage(file.Contents(), names, params.instruments, [&](OrderMessage& message) {
+						ProcessOrderMessage(market, trade_recorder, message);
+					}, position);
+					trade_recorder.muted = false;
+				}
+				Journal journal;
+				REQUIRE(journal.Reopen(path.c_str(), names, position));
+				for (std::size_t i = crash; i < messages.size(); ++i) {
+					auto message = messages[i];
+					journal.Append(message, {});
+					ProcessOrderMessage(market, trade_recorder, message);
+				}
+				REQUIRE(journal.Close());
+				market.ForEachOrderByTime(recovered_orders);
+			}
+
+			std::size_t journaled = 0;
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			NameTables read_names;
+			const auto read_error = ForEachJournalMessage(file.Contents(), read_names, params.instruments, [&journaled](const OrderMessage&) { ++journaled; });
+			unlink(path.c_str());
+
+			THEN("replay reports no fills, and the recovered market carries on exactly where the first one stopped") {
+				REQUIRE(JournalError::None == error);
+				REQUIRE(messages[crash - 1].order.key.timestamp == position.timestamp);
+				REQUIRE(!trades_before_crash.trades.empty());
+				REQUIRE(trades_before_crash.trades.size() + trades_after_crash.trades.size() == all_trades.trades.size());
+				REQUIRE(std::equal(trades_after_crash.trades.begin(), trades_after_crash.trades.end(), all_trades.trades.begin() + trades_before_crash.trades.size()));
+				REQUIRE(recovered_orders.orders == all_orders.orders);
+			}
+			THEN("the partial record is cut off, and the journal goes on to hold the whole flow") {
+				REQUIRE(JournalError::None == read_error);
+				REQUIRE(messages.size() == journaled);
+			}
+		}
+	}
+}
+
+SCENARIO("A market is snapshotted to a file and restored from it", "[snapshot]") {
+	GIVEN("a market that has matched part of a synthetic order flow") {
+		OrderFlowParams params;
+		params.instruments = 5;
+		params.aggressor_ratio = 0.3;
+		OrderFlowGenerator generator(params);
+		Lcg lcg;
+		std::vector<OrderMessage> messages(20000);
+		for (auto& message : messages) {
+			generator.Next(message);
+			if ((OrderAction::Cancel == message.action) && (0 == lcg.Next(2))) {
+				message.action = OrderAction::Amend;
+				message.order.quantity = lcg.Next(20);
+				message.order.price = params.start_price - 5 + lcg.Next(10);
+			}
+		}
+		const std::size_t half = messages.size() / 2;
+
+		InstrumentTradeRecorder trades;
+		GreedyFillAllocator fill_allocator;
+		Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> market(fill_allocator, trades);
+		for (std::size_t i = 0; i < half; ++i) {
+			auto message = messages[i];
+			ProcessOrderMessage(market, trades, message);
+		}
+		FullOrderDetailRecorder orders;
+		market.ForEachOrderByTime(orders);
+		REQUIRE(!orders.orders.empty());
+
+		WHEN("it is snapshotted, and another market is restored from the snapshot") {
+			const auto path = MakeTempFile();
+			REQUIRE(WriteSnapshot(market, NameTables{}, messages[half - 1].order.key.timestamp, path.c_str()));
+
+			InstrumentTradeRecorder restored_trades;
+			Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> restored(fill_allocator, restored_trades);
+			TimeStamp timestamp = 0;
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			SnapshotReader reader(file.Contents());
+			const auto error = restored.Restore(reader, timestamp);
+			FullOrderDetailRecorder restored_orders;
+			restored.ForEachOrderByTime(restored_orders);
+
+			// Both carry on with the rest of the flow, including cancels and amends of restored orders
+			trades.trades.clear();
+			for (std::size_t i = half; i < messages.size(); ++i) {
+				auto message = messages[i];
+				ProcessOrderMessage(market, trades, message);
+				message = messages[i];
+				ProcessOrderMessage(restored, restored_trades, message);
+			}
+			FullOrderDetailRecorder final_orders;
+			market.ForEachOrderByTime(final_orders);
+			FullOrderDetailRecorder final_restored_orders;
+			restored.ForEachOrderByTime(final_restored_orders);
+
+			THEN("the restored market holds the same orders, and matches the rest of the flow the same way") {
+				REQUIRE(SnapshotError::None == error);
+				REQUIRE(messages[half - 1].order.key.timestamp == timestamp);
+				REQUIRE(restored.InstrumentCount() == market.InstrumentCount());
+				REQUIRE(restored_orders.orders == orders.orders);
+				REQUIRE(!trades.trades.empty());
+				REQUIRE(restored_trades.trades == trades.trades);
+				REQUIRE(final_restored_orders.orders == final_orders.orders);
+			}
+			THEN("a snapshot cut short, or not a snapshot at all, is reported") {
+				const std::string contents(file.Contents());
+				SnapshotReader truncated(std::string_view(contents).substr(0, contents.size() / 2));
+				REQUIRE(SnapshotError::Truncated == restored.Restore(truncated, timestamp));
+				SnapshotReader not_a_snapshot(std::string_view(contents).substr(1));
+				REQUIRE(SnapshotError::BadHeader == restored.Restore(not_a_snapshot, timestamp));
+			}
+			unlink(path.c_str());
+		}
+		WHEN("it is snapshotted from a forked child") {
+			const auto path = MakeTempFile();
+			const auto forked_path = MakeTempFile();
+			// With a name longer than the output buffer's headroom, which the child writes in pieces
+			NameTables names;
+			names.instruments.Intern(std::string(3 * OutputBuffer::kHeadroom, 'x'));
+			names.order_ids.Intern("order");
+			REQUIRE(WriteSnapshot(market, names, 1, path.c_str()));
+			const pid_t child = ForkSnapshot(market, names, 1, forked_path.c_str());
+			REQUIRE(child > 0);
+			int status = -1;
+			REQUIRE(child == waitpid(child, &status, 0));
+
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			MappedFile forked_file;
+			REQUIRE(forked_file.Open(forked_path.c_str()));
+			THEN("the child writes the same snapshot, and leaves no temporary file behind") {
+				REQUIRE(WIFEXITED(status));
+				REQUIRE(0 == WEXITSTATUS(status));
+				REQUIRE(file.Contents() == forked_file.Contents());
+				REQUIRE(0 != access((forked_path + ".tmp").c_str(), F_OK));
+			}
+			THEN("the long name comes back whole") {
+				InstrumentTradeRecorder restored_trades;
+				Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> restored(fill_allocator, restored_trades);
+				SnapshotReader reader(forked_file.Contents());
+				TimeStamp timestamp = 0;
+				REQUIRE(SnapshotError::None == restored.Restore(reader, timestamp));
+				NameTables restored_names;
+				REQUIRE(SnapshotError::None == reader.Names(restored_names));
+				REQUIRE(restored_names.instruments.Name(0) == names.instruments.Name(0));
+			}
+			unlink(path.c_str());
+			unlink(forked_path.c_str());
+		}
+		WHEN("it is snapshotted with the names its handles were interned from") {
+			NameTables names;
+			for (const char* symbol : { "ABC", "DEF", "GHI", "JKL", "MNO" }) {
+				names.instruments.Intern(symbol);
+			}
+			for (std::size_t i = 0; i < messages.size(); ++i) {
+				names.order_ids.Intern("order-" + std::to_string(i));
+			}
+			const auto path = MakeTempFile();
+			REQUIRE(WriteSnapshot(market, names, messages[half - 1].order.key.timestamp, path.c_str()));
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			const auto restore_names = [&file, &fill_allocator](NameTables& restored_names) {
+				InstrumentTradeRecorder restored_trades;
+				Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>> restored(fill_allocator, restored_trades);
+				SnapshotReader reader(file.Contents());
+				TimeStamp timestamp = 0;
+				const auto error = restored.Restore(reader, timestamp);
+				return (SnapshotError::None == error) ? reader.Names(restored_names) : error;
+			};
+			THEN("the names come back with the same handles, also into tables that already hold the symbol universe") {
+				NameTables restored_names;
+				restored_names.instruments.Intern("ABC");
+				restored_names.instruments.Intern("DEF");
+				REQUIRE(SnapshotError::None == restore_names(restored_names));
+				REQUIRE(restored_names.order_ids.Size() == names.order_ids.Size());
+				REQUIRE(restored_names.instruments.Size() == names.instruments.Size());
+				REQUIRE(restored_names.order_ids.Name(123) == "order-123");
+				REQUIRE(restored_names.instruments.Name(4) == "MNO");
+				REQUIRE(restored_names.order_ids.Intern("a new order") == names.order_ids.Size());
+			}
+			THEN("names that were interned as other handles are reported") {
+				NameTables restored_names;
+				restored_names.instruments.Intern("DEF");
+				REQUIRE(SnapshotError::BadName == restore_names(restored_names));
+			}
+			unlink(path.c_str());
+		}
+	}
+}
+
+// Every resting order of a market, sorted into sells then buys, each by time: what ForEachOrderByTime must report.
+template<typename Market>
+std::vector<FullOrderDetail> SortedRestingOrders(const Market& market) {
+	std::vector<FullOrderDetail> orders;
+	for (Instrument instrument = 0; instrument < market.InstrumentCount(); ++instrument) {
+		for (const auto& [price, level] : market.Sells(instrument)) {
+			for (const auto& [key, quantity] : level) {
+				orders.push_back({ Side::Sell, instrument, { price, quantity, key } });
+			}
+		}
+		for (const auto& [price, level] : market.Buys(instrument)) {
+			for (const auto& [key, quantity] : level) {
+				orders.push_back({ Side::Buy, instrument, { price, quantity, key } });
+			}
+		}
+	}
+	std::sort(orders.begin(), orders.end(), [](const FullOrderDetail& lhs, const FullOrderDetail& rhs) {
+		if (lhs.side != rhs.side) {
+			return Side::Sell == lhs.side;
+		}
+		return lhs.order.key.timestamp < rhs.order.key.timestamp;
+	});
+	return orders;
+}
+
+template<typename MatchingOrdersComparator, typename LadderPolicy>
+void RequireOrdersByTimeAreMerged() {
+	OrderFlowParams params;
+	params.instruments = 16;
+	params.mean_distance_ticks = 20.0;
+	OrderFlowGenerator generator(params);
+	Lcg lcg;
+	InstrumentTradeRecorder trades;
+	GreedyFillAllocator fill_allocator;
+	Market<MatchingOrdersComparator, GreedyFillAllocator, InstrumentTradeRecorder, LadderPolicy> market(fill_allocator, trades);
+	for (int i = 0; i < 20000; ++i) {
+		OrderMessage message{};
+		generator.Next(message);
+		// Amends that lose priority move orders to the back of their level, out of id order
+		if ((OrderAction::Cancel == message.action) && (0 == lcg.Next(2))) {
+			message.action = OrderAction::Amend;
+			message.order.quantity = 1 + lcg.Next(20);
+			message.order.price = params.start_price - 20 + lcg.Next(40);
+		}
+		ProcessOrderMessage(market, trades, message);
+	}
+
+	FullOrderDetailRecorder orders;
+	market.ForEachOrderByTime(orders);
+	const auto expected_orders = SortedRestingOrders(market);
+	REQUIRE(expected_orders.size() > 1000);
+	REQUIRE(orders.orders == expected_orders);
+}
+
+SCENARIO("Resting orders of every orderbook are merged into one walk by time", "[market]") {
+	GIVEN("a market of many instruments with deep books") {
+		WHEN("levels are FIFO order queues in an array ladder") {
+			THEN("orders come out as sells then buys, each by time, exactly once") {
+				RequireOrdersByTimeAreMerged<FifoPriority, ArrayLadder<>>();
+			}
+		}
+		WHEN("levels are maps sorted by timestamp in a std::map ladder") {
+			THEN("orders come out as sells then buys, each by time, exactly once") {
+				RequireOrdersByTimeAreMerged<PriorityKey::TimeStampComparator, MapLadder>();
+			}
+		}
+	}
+	GIVEN("a market with no resting orders") {
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator> market(fill_allocator, trade_event_accumulator);
+		market.AddInstrument(3);
+		FullOrderDetailRecorder orders;
+		market.ForEachOrderByTime(orders);
+		THEN("nothing is reported") {
+			REQUIRE(orders.orders.empty());
+		}
+	}
+}
+
+// Whether every level's total quantity and order count agree with its orders.
+template<typename Levels>
+bool LevelTotalsAreInStep(const Levels& levels) {
+	for (const auto& [price, level] : levels) {
+		std::size_t order_count = 0;
+		for (auto it = level.begin(); it != level.end(); ++it) {
+			++order_count;
+		}
+		if ((level.TotalQuantity() != TotalQuantity(level)) || (level.OrderCount() != order_count)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template<typename MatchingOrdersComparator, typename LadderPolicy>
+void RequireLevelTotalsStayInStep() {
+	OrderFlowParams params;
+	params.instruments = 4;
+	params.aggressor_ratio = 0.3;
+	OrderFlowGenerator generator(params);
+	Lcg lcg;
+	InstrumentTradeRecorder trades;
+	GreedyFillAllocator fill_allocator;
+	Market<MatchingOrdersComparator, GreedyFillAllocator, InstrumentTradeRecorder, LadderPolicy> market(fill_allocator, trades);
+	std::unordered_map<Id, Price> prices;
+	bool in_step = true;
+	for (int i = 0; (i < 20000) && in_step; ++i) {
+		OrderMessage message{};
+		generator.Next(message);
+		// Mix in amends in place and with loss of priority, market orders, and immediate-or-cancel and fill-or-kill orders
+		if (OrderAction::Cancel == message.action) {
+			switch (lcg.Next(3)) {
+			case 0:
+				message.action = OrderAction::Amend;
+				message.order.quantity = lcg.Next(20);
+				message.order.price = params.start_price - 5 + lcg.Next(10);
+				break;
+			case 1:
+				message.action = OrderAction::Amend;
+				message.order.quantity = 1;
+				message.order.price = prices[message.order.key.id];
+				break;
+			}
+		}
+		else if (0 == lcg.Next(20)) {
+			message.type = OrderType::Market;
+		}
+		else if (0 == lcg.Next(10)) {
+			message.time_in_force = (0 == lcg.Next(2)) ? TimeInForce::ImmediateOrCancel : TimeInForce::FillOrKill;
+		}
+		if (OrderAction::Cancel != message.action) {
+			prices[message.order.key.id] = message.order.price;
+		}
+		ProcessOrderMessage(market, trades, message);
+		if (0 == i % 100) {
+			for (Instrument instrument = 0; instrument < market.InstrumentCount(); ++instrument) {
+				in_step = in_step && LevelTotalsAreInStep(market.Buys(instrument)) && LevelTotalsAreInStep(market.Sells(instrument));
+			}
+		}
+	}
+	REQUIRE(in_step);
+	REQUIRE(!trades.trades.empty());
+}
+
+// Greedy allocation, counting the levels it is asked to fill.
+struct CountingFillAllocator {
+	std::size_t fills = 0;
+	template<typename PrioritySortedOrders, typename TradeEventHandler>
+	void Fill(const Side side, const Price matched_price, Order& aggressor_order, PrioritySortedOrders& opposite_side_resting_orders, TradeEventHandler& trade_event_handler) {
+		++fills;
+		GreedyFillAllocator{}.Fill(side, matched_price, aggressor_order, opposite_side_resting_orders, trade_event_handler);
+	}
+};
+
+template<typename MatchingOrdersComparator, typename LadderPolicy>
+void RequireWholeLevelsFillInBulk() {
+	OrderMaker order_maker;
+	CountingFillAllocator fill_allocator;
+	TradeEventAccumulator trade_event_accumulator;
+	Orderbook<MatchingOrdersComparator, CountingFillAllocator, TradeEventAccumulator, LadderPolicy> orderbook;
+	for (const auto& [price, quantity] : { PriceAndQuantity{ 10001, 10 }, { 10001, 20 }, { 10002, 5 }, { 10003, 8 }, { 10003, 8 } }) {
+		Order order = order_maker.MakeOrder(price, quantity);
+		orderbook.Sell(fill_allocator, trade_event_accumulator, order);
+	}
+	Order aggressor_order = order_maker.MakeOrder(10003, 40);
+	REQUIRE(orderbook.Buy(fill_allocator, trade_event_accumulator, aggressor_order) == FillExtent::Full);
+
+	std::vector<Quantity> matched_quantities;
+	for (const auto& trade_event : trade_event_accumulator.trade_event_history) {
+		matched_quantities.push_back(trade_event.matched_quantity);
+	}
+	REQUIRE(matched_quantities == std::vector<Quantity>{ 10, 20, 5, 5 });
+	REQUIRE(trade_event_accumulator.WereFillsFIFO());
+	// Only the level the aggressor takes part of goes through the allocator
+	REQUIRE(fill_allocator.fills == 1);
+	REQUIRE(!orderbook.LevelAt(Side::Sell, 10001).has_value());
+	REQUIRE(!orderbook.LevelAt(Side::Sell, 10002).has_value());
+	REQUIRE(orderbook.LevelAt(Side::Sell, 10003) == LevelSummary{ 10003, 11, 2 });
+	REQUIRE(orderbook.BestAsk() == LevelSummary{ 10003, 11, 2 });
+
+	Order sweep = order_maker.MakeOrder(10003, 11);
+	REQUIRE(orderbook.Buy(fill_allocator, trade_event_accumulator, sweep) == FillExtent::Full);
+	REQUIRE(fill_allocator.fills == 1);
+	REQUIRE(orderbook.Sells().empty());
+}
+
+SCENARIO("Aggressors that take whole price levels fill them in bulk", "[matcher][depth]") {
+	GIVEN("an orderbook with FIFO levels in an array ladder") {
+		THEN("whole levels fill in priority order without the allocator, and are removed") {
+			RequireWholeLevelsFillInBulk<FifoPriority, ArrayLadder<>>();
+		}
+	}
+	GIVEN("an orderbook with time-sorted levels in a std::map") {
+		THEN("whole levels fill in priority order without the allocator, and are removed") {
+			RequireWholeLevelsFillInBulk<PriorityKey::TimeStampComparator, MapLadder>();
+		}
+	}
+}
+
+SCENARIO("Price levels keep their total quantity and order count as orders come and go", "[market][depth]") {
+	GIVEN("a market with sells of 10 and 20 at 10001, 5 at 10003, and a buy of 7 at 9999") {
+		OrderMaker order_maker;
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> market(fill_allocator, trade_event_accumulator);
+		for (const auto& [price, quantity] : { PriceAndQuantity{ 10001, 10 }, { 10001, 20 }, { 10003, 5 } }) {
+			Order aggressor_order = order_maker.MakeOrder(price, quantity);
+			market.Sell(ABC, aggressor_order);
+		}
+		Order bid = order_maker.MakeOrder(9999, 7);
+		market.Buy(ABC, bid);
+		const auto depth = [&market](const Side side) {
+			std::array<LevelSummary, 2> levels{};
+			const auto count = market.Depth(ABC, side, levels);
+			return std::vector<LevelSummary>(levels.begin(), levels.begin() + count);
+		};
+
+		THEN("levels are summed up, best first, up to the depth asked for") {
+			REQUIRE(market.LevelAt(ABC, Side::Sell, 10001) == LevelSummary{ 10001, 30, 2 });
+			REQUIRE(market.LevelAt(ABC, Side::Sell, 10003) == LevelSummary{ 10003, 5, 1 });
+			REQUIRE(!market.LevelAt(ABC, Side::Sell, 10002).has_value());
+			REQUIRE(!market.LevelAt(DEF, Side::Sell, 10001).has_value());
+			REQUIRE(depth(Side::Sell) == std::vector<LevelSummary>{ { 10001, 30, 2 }, { 10003, 5, 1 } });
+			REQUIRE(depth(Side::Buy) == std::vector<LevelSummary>{ { 9999, 7, 1 } });
+			REQUIRE(market.Depth(DEF, Side::Buy, std::span<LevelSummary>()) == 0);
+		}
+		WHEN("an order rests far from the touch, outside the ladder's array window") {
+			Order far_order = order_maker.MakeOrder(90001, 3);
+			market.Sell(ABC, far_order);
+			THEN("its level is found all the same") {
+				REQUIRE(market.LevelAt(ABC, Side::Sell, 90001) == LevelSummary{ 90001, 3, 1 });
+				REQUIRE(!market.LevelAt(ABC, Side::Sell, 90002).has_value());
+			}
+		}
+		WHEN("an aggressor partially fills the first order of a level") {
+			Order aggressor_order = order_maker.MakeOrder(10001, 4);
+			market.Buy(ABC, aggressor_order);
+			THEN("the level's total drops, and its count does not") {
+				REQUIRE(market.LevelAt(ABC, Side::Sell, 10001) == LevelSummary{ 10001, 26, 2 });
+			}
+		}
+		WHEN("an aggressor fills one order of a level completely") {
+			Order aggressor_order = order_maker.MakeOrder(10001, 10);
+			market.Buy(ABC, aggressor_order);
+			THEN("both the total and the count drop") {
+				REQUIRE(market.LevelAt(ABC, Side::Sell, 10001) == LevelSummary{ 10001, 20, 1 });
+			}
+		}
+		WHEN("orders are amended in place, amended with loss of priority, and cancelled") {
+			market.Amend(1, 10001, 8, 100);
+			market.Amend(2, 10003, 20, 101);
+			market.Cancel(4);
+			THEN("levels follow") {
+				REQUIRE(depth(Side::Sell) == std::vector<LevelSummary>{ { 10001, 8, 1 }, { 10003, 25, 2 } });
+				REQUIRE(depth(Side::Buy).empty());
+			}
+		}
+		WHEN("the book is snapshotted and restored") {
+			const auto path = MakeTempFile();
+			REQUIRE(WriteSnapshot(market, NameTables{}, 4, path.c_str()));
+			Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> restored(fill_allocator, trade_event_accumulator);
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			SnapshotReader reader(file.Contents());
+			TimeStamp timestamp = 0;
+			REQUIRE(SnapshotError::None == restored.Restore(reader, timestamp));
+			unlink(path.c_str());
+			THEN("the restored levels have the same totals") {
+				std::array<LevelSummary, 2> levels{};
+				REQUIRE(restored.Depth(ABC, Side::Sell, levels) == 2);
+				REQUIRE(std::vector<LevelSummary>(levels.begin(), levels.end()) == depth(Side::Sell));
+				REQUIRE(restored.LevelAt(ABC, Side::Buy, 9999) == LevelSummary{ 9999, 7, 1 });
+			}
+		}
+	}
+	GIVEN("levels sorted by timestamp, and an order resting at 10001") {
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		Market<PriorityKey::TimeStampComparator, GreedyFillAllocator, TradeEventAccumulator, MapLadder> market(fill_allocator, trade_event_accumulator);
+		Order first{ 10001, 10, { 1, 5 } };
+		market.Buy(ABC, first);
+
+		WHEN("another order with the same timestamp comes to rest at that price") {
+			Order same_timestamp{ 10001, 20, { 2, 5 } };
+			market.Buy(ABC, same_timestamp);
+			THEN("it does not rest, and the level's total is that of its one order") {
+				REQUIRE(market.LevelAt(ABC, Side::Buy, 10001) == LevelSummary{ 10001, 10, 1 });
+				REQUIRE(TotalQuantity(market.Buys(ABC).begin()->second) == 10);
+				REQUIRE(!market.Cancel(2));
+				REQUIRE(market.Cancel(1));
+				REQUIRE(market.Buys(ABC).empty());
+			}
+		}
+		WHEN("a snapshot is restored whose level holds two orders of the same priority, or of the same id") {
+			const auto snapshot_of = [](const std::vector<std::pair<PriorityKey, Quantity>>& orders) {
+				int fds[2] = { -1, -1 };
+				REQUIRE(0 == pipe(fds));
+				{
+					OutputBuffer output(fds[1]);
+					SnapshotWriter writer(output);
+					writer.Header(10, 1, orders.size());
+					writer.Level(ABC, Side::Buy, 10001, orders.size());
+					for (const auto& [key, quantity] : orders) {
+						writer.RestingOrder(key, quantity);
+					}
+					writer.End();
+				}
+				close(fds[1]);
+				const auto contents = ReadAll(fds[0]);
+				close(fds[0]);
+				return contents;
+			};
+			const auto same_priority = snapshot_of({ { { 1, 5 }, 10 }, { { 2, 5 }, 20 } });
+			const auto same_id = snapshot_of({ { { 1, 5 }, 10 }, { { 1, 6 }, 20 } });
+			TimeStamp timestamp = 0;
+			SnapshotReader same_priority_reader(same_priority);
+			const auto same_priority_error = market.Restore(same_priority_reader, timestamp);
+			const auto same_priority_level = market.LevelAt(ABC, Side::Buy, 10001);
+			Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> fifo_market(fill_allocator, trade_event_accumulator);
+			SnapshotReader same_id_reader(same_id);
+			const auto same_id_error = fifo_market.Restore(same_id_reader, timestamp);
+			THEN("the level is rejected as bad, and the totals restored so far agree with the orders") {
+				REQUIRE(SnapshotError::BadLevel == same_priority_error);
+				REQUIRE(same_priority_level == LevelSummary{ 10001, 10, 1 });
+				REQUIRE(SnapshotError::BadLevel == same_id_error);
+				REQUIRE(fifo_market.LevelAt(ABC, Side::Buy, 10001) == LevelSummary{ 10001, 10, 1 });
+				REQUIRE(TotalQuantity(fifo_market.Buys(ABC).begin()->second) == 10);
+			}
+		}
+	}
+	GIVEN("a long order flow of every kind of message") {
+		WHEN("levels are FIFO order queues in an array ladder") {
+			THEN("every level's total and count always agree with its orders") {
+				RequireLevelTotalsStayInStep<FifoPriority, ArrayLadder<16>>();
+			}
+		}
+		WHEN("levels are maps sorted by timestamp in a std::map ladder") {
+			THEN("every level's total and count always agree with its orders") {
+				RequireLevelTotalsStayInStep<PriorityKey::TimeStampComparator, MapLadder>();
+			}
+		}
+	}
+}
+
+// Every change of the best bid or offer of an instrument, in order.
+struct BboRecorder {
+	std::vector<std::pair<Instrument, TopOfBook>> changes;
+	void HandleBbo(const Instrument instrument, const TopOfBook& top) {
+		changes.emplace_back(instrument, top);
+	}
+	void HandleBookChange(const Instrument) {}
+};
+
+// Top of an instrument's book, the slow way.
+template<typename Market>
+TopOfBook TopFromDepth(const Market& market, const Instrument instrument) {
+	TopOfBook top{};
+	market.Depth(instrument, Side::Buy, std::span<LevelSummary>(&top.bid, 1));
+	market.Depth(instrument, Side::Sell, std::span<LevelSummary>(&top.ask, 1));
+	return top;
+}
+
+template<typename MatchingOrdersComparator, typename LadderPolicy>
+void RequireBboChangesFollowTheBook() {
+	OrderFlowParams params;
+	params.instruments = 4;
+	params.aggressor_ratio = 0.3;
+	OrderFlowGenerator generator(params);
+	Lcg lcg;
+	InstrumentTradeRecorder trades;
+	BboRecorder bbo;
+	GreedyFillAllocator fill_allocator;
+	Market<MatchingOrdersComparator, GreedyFillAllocator, InstrumentTradeRecorder, LadderPolicy, BboRecorder> market(fill_allocator, trades, bbo);
+	std::unordered_map<Instrument, TopOfBook> published;
+	bool in_step = true;
+	for (int i = 0; (i < 20000) && in_step; ++i) {
+		OrderMessage message{};
+		generator.Next(message);
+		if ((OrderAction::Cancel == message.action) && (0 == lcg.Next(2))) {
+			message.action = OrderAction::Amend;
+			message.order.quantity = lcg.Next(20);
+			message.order.price = params.start_price - 5 + lcg.Next(10);
+		}
+		else if (0 == lcg.Next(20)) {
+			message.type = OrderType::Market;
+		}
+		const auto change_count = bbo.changes.size();
+		ProcessOrderMessage(market, trades, message);
+		// At most one change per message, and only when the top did change
+		in_step = in_step && (bbo.changes.size() <= change_count + 1);
+		if (bbo.changes.size() > change_count) {
+			const auto& [instrument, top] = bbo.changes.back();
+			in_step = in_step && (published[instrument] != top);
+			published[instrument] = top;
+		}
+		for (Instrument instrument = 0; instrument < market.InstrumentCount(); ++instrument) {
+			const auto top = TopFromDepth(market, instrument);
+			in_step = in_step && (market.Top(instrument) == top) && (published[instrument] == top);
+		}
+	}
+	REQUIRE(in_step);
+	REQUIRE(bbo.changes.size() > 1000);
+}
+
+SCENARIO("The best bid and offer are kept up to date, and changes to them are published", "[market][bbo]") {
+	GIVEN("a market with a BBO handler, a sell of 10 at 10001 and a buy of 7 at 9999") {
+		OrderMaker order_maker;
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		BboRecorder bbo;
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>, BboRecorder> market(fill_allocator, trade_event_accumulator, bbo);
+		Order ask = order_maker.MakeOrder(10001, 10);
+		market.Sell(ABC, ask);
+		Order bid = order_maker.MakeOrder(9999, 7);
+		market.Buy(ABC, bid);
+		const TopOfBook top = { { 9999, 7, 1 }, { 10001, 10, 1 } };
+
+		THEN("each order that changed the top was published") {
+			REQUIRE(market.Top(ABC) == top);
+			REQUIRE(market.BestBid(ABC) == LevelSummary{ 9999, 7, 1 });
+			REQUIRE(market.BestAsk(ABC) == LevelSummary{ 10001, 10, 1 });
+			REQUIRE(market.Top(DEF) == TopOfBook{});
+			REQUIRE(bbo.changes.size() == 2);
+			REQUIRE(bbo.changes[0] == std::make_pair(ABC, TopOfBook{ {}, { 10001, 10, 1 } }));
+			REQUIRE(bbo.changes[1] == std::make_pair(ABC, top));
+		}
+		WHEN("orders rest behind the top, and one of them is cancelled") {
+			bbo.changes.clear();
+			Order worse_ask = order_maker.MakeOrder(10002, 5);
+			market.Sell(ABC, worse_ask);
+			Order worse_bid = order_maker.MakeOrder(9998, 5);
+			market.Buy(ABC, worse_bid);
+			market.Cancel(worse_ask.key.id);
+			THEN("nothing is published") {
+				REQUIRE(bbo.changes.empty());
+				REQUIRE(market.Top(ABC) == top);
+			}
+		}
+		WHEN("an order joins the best bid, and a better offer arrives") {
+			bbo.changes.clear();
+			Order joining_bid = order_maker.MakeOrder(9999, 3);
+			market.Buy(ABC, joining_bid);
+			Order better_ask = order_maker.MakeOrder(10000, 2);
+			market.Sell(ABC, better_ask);
+			THEN("each change is published") {
+				REQUIRE(bbo.changes.size() == 2);
+				REQUIRE(bbo.changes[0].second == TopOfBook{ { 9999, 10, 2 }, { 10001, 10, 1 } });
+				REQUIRE(bbo.changes[1].second == TopOfBook{ { 9999, 10, 2 }, { 10000, 2, 1 } });
+			}
+		}
+		WHEN("an aggressor sweeps the best offer and rests its remainder") {
+			bbo.changes.clear();
+			Order aggressor_order = order_maker.MakeOrder(10001, 15);
+			market.Buy(ABC, aggressor_order);
+			THEN("both sides change, and that is published once") {
+				REQUIRE(bbo.changes.size() == 1);
+				REQUIRE(bbo.changes[0].second == TopOfBook{ { 10001, 5, 1 }, {} });
+			}
+		}
+		WHEN("a fill-or-kill order cannot fill, and an immediate-or-cancel order partially fills the best offer") {
+			bbo.changes.clear();
+			Order kill_order = order_maker.MakeOrder(10001, 11);
+			market.Buy(ABC, kill_order, TimeInForce::FillOrKill);
+			Order ioc_order = order_maker.MakeOrder(10001, 4);
+			market.Buy(ABC, ioc_order, TimeInForce::ImmediateOrCancel);
+			THEN("only the partial fill is published") {
+				REQUIRE(bbo.changes.size() == 1);
+				REQUIRE(bbo.changes[0].second == TopOfBook{ { 9999, 7, 1 }, { 10001, 6, 1 } });
+			}
+		}
+		WHEN("the best bid is reduced in place, then amended through the offer") {
+			bbo.changes.clear();
+			market.Amend(bid.key.id, 9999, 5, 100);
+			market.Amend(bid.key.id, 10001, 12, 101);
+			THEN("each amend is published once") {
+				REQUIRE(bbo.changes.size() == 2);
+				REQUIRE(bbo.changes[0].second == TopOfBook{ { 9999, 5, 1 }, { 10001, 10, 1 } });
+				REQUIRE(bbo.changes[1].second == TopOfBook{ { 10001, 2, 1 }, {} });
+			}
+		}
+		WHEN("the book is snapshotted and restored into a market without a BBO handler") {
+			const auto path = MakeTempFile();
+			REQUIRE(WriteSnapshot(market, NameTables{}, 2, path.c_str()));
+			Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>> restored(fill_allocator, trade_event_accumulator);
+			MappedFile file;
+			REQUIRE(file.Open(path.c_str()));
+			SnapshotReader reader(file.Contents());
+			TimeStamp timestamp = 0;
+			REQUIRE(SnapshotError::None == restored.Restore(reader, timestamp));
+			unlink(path.c_str());
+			THEN("the restored market has the same top") {
+				REQUIRE(restored.Top(ABC) == top);
+			}
+		}
+	}
+	GIVEN("a long order flow of every kind of message") {
+		WHEN("levels are FIFO order queues in an array ladder") {
+			THEN("the top is always that of the levels, and every change of it is published") {
+				RequireBboChangesFollowTheBook<FifoPriority, ArrayLadder<16>>();
+			}
+		}
+		WHEN("levels are maps sorted by timestamp in a std::map ladder") {
+			THEN("the top is always that of the levels, and every change of it is published") {
+				RequireBboChangesFollowTheBook<PriorityKey::TimeStampComparator, MapLadder>();
+			}
+		}
+	}
+}
+
+// Depth updates as published, and the book of best levels a feed consumer builds from them.
+// Counts updates that do not fit the consumer's book, e.g. an add of a level it already has.
+struct DepthUpdateRecorder {
+	std::vector<DepthUpdate> updates;
+	std::map<std::pair<Instrument, Side>, std::map<Price, LevelSummary>> books;
+	std::size_t misfits = 0;
+	void HandleDepthUpdate(const DepthUpdate& update) {
+		updates.push_back(update);
+		auto& levels = books[{ update.instrument, update.side }];
+		const bool known = levels.count(update.level.price) > 0;
+		misfits += ((LevelAction::Add == update.action) == known) ? 1 : 0;
+		if (LevelAction::Delete == update.action) {
+			levels.erase(update.level.price);
+		}
+		else {
+			levels[update.level.price] = update.level;
+		}
+	}
+	// Consumer's levels of one side, best first
+	std::vector<LevelSummary> Levels(const Instrument instrument, const Side side) {
+		std::vector<LevelSummary> levels;
+		for (const auto& [price, level] : books[{ instrument, side }]) {
+			levels.push_back(level);
+		}
+		if (Side::Buy == side) {
+			std::reverse(levels.begin(), levels.end());
+		}
+		return levels;
+	}
+};
+
+template<std::size_t kLevels, typename Market>
+std::vector<LevelSummary> BestLevelsOf(const Market& market, const Instrument instrument, const Side side) {
+	std::array<LevelSummary, kLevels> levels{};
+	const auto count = market.Depth(instrument, side, levels);
+	return std::vector<LevelSummary>(levels.begin(), levels.begin() + count);
+}
+
+template<typename MatchingOrdersComparator, typename LadderPolicy>
+void RequireDepthFeedRebuildsTheBook(const TimeStamp window) {
+	constexpr std::size_t kLevels = 5;
+	OrderFlowParams params;
+	params.instruments = 4;
+	params.aggressor_ratio = 0.3;
+	OrderFlowGenerator generator(params);
+	Lcg lcg;
+	InstrumentTradeRecorder trades;
+	DepthUpdateRecorder depth;
+	DepthFeed<kLevels, DepthUpdateRecorder> feed(depth, window);
+	GreedyFillAllocator fill_allocator;
+	Market<MatchingOrdersComparator, GreedyFillAllocator, InstrumentTradeRecorder, LadderPolicy, DepthFeed<kLevels, DepthUpdateRecorder>> market(fill_allocator, trades, feed);
+	const auto consumer_is_in_step = [&] {
+		bool in_step = true;
+		for (Instrument instrument = 0; instrument < market.InstrumentCount(); ++instrument) {
+			for (const Side side : { Side::Buy, Side::Sell }) {
+				in_step = in_step && (depth.Levels(instrument, side) == BestLevelsOf<kLevels>(market, instrument, side));
+			}
+		}
+		return in_step;
+	};
+	bool in_step = true;
+	for (int i = 0; (i < 20000) && in_step; ++i) {
+		OrderMessage message{};
+		generator.Next(message);
+		if ((OrderAction::Cancel == message.action) && (0 == lcg.Next(2))) {
+			message.action = OrderAction::Amend;
+			message.order.quantity = lcg.Next(20);
+			message.order.price = params.start_price - 5 + lcg.Next(10);
+		}
+		const auto timestamp = message.order.key.timestamp;
+		ProcessOrderMessage(market, trades, message);
+		feed.Publish(market, timestamp);
+		// Without a window, the consumer is always up to date; with one, once the changes waiting have been flushed
+		if ((0 == window) || (0 == i % 500)) {
+			feed.Flush(market, timestamp);
+			in_step = in_step && consumer_is_in_step();
+		}
+	}
+	REQUIRE(in_step);
+	REQUIRE(depth.misfits == 0);
+	REQUIRE(depth.updates.size() > 1000);
+}
+
+SCENARIO("An incremental depth feed publishes changes to the best levels, conflated per instrument", "[market][depth]") {
+	GIVEN("a market with a depth feed two levels deep and no conflation, and a sell of 10 at 10001") {
+		OrderMaker order_maker;
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		DepthUpdateRecorder depth;
+		DepthFeed<2, DepthUpdateRecorder> feed(depth);
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>, DepthFeed<2, DepthUpdateRecorder>> market(fill_allocator, trade_event_accumulator, feed);
+		const auto sell = [&](const Price price, const Quantity quantity) {
+			Order order = order_maker.MakeOrder(price, quantity);
+			market.Sell(ABC, order);
+			feed.Publish(market, order.key.timestamp);
+			return order.key.id;
+		};
+		const auto buy = [&](const Price price, const Quantity quantity) {
+			Order order = order_maker.MakeOrder(price, quantity);
+			market.Buy(ABC, order);
+			feed.Publish(market, order.key.timestamp);
+			return order.key.id;
+		};
+		sell(10001, 10);
+		THEN("the new level is added") {
+			REQUIRE(depth.updates == std::vector<DepthUpdate>{ { ABC, Side::Sell, LevelAction::Add, { 10001, 10, 1 } } });
+		}
+		WHEN("an order joins the level, and another rests behind it") {
+			depth.updates.clear();
+			sell(10001, 5);
+			sell(10003, 7);
+			THEN("the level is modified, and the other one added") {
+				REQUIRE(depth.updates == std::vector<DepthUpdate>{
+					{ ABC, Side::Sell, LevelAction::Modify, { 10001, 15, 2 } },
+					{ ABC, Side::Sell, LevelAction::Add, { 10003, 7, 1 } },
+				});
+			}
+			AND_WHEN("a level comes between them, then goes again") {
+				depth.updates.clear();
+				const auto id = sell(10002, 3);
+				market.Cancel(id);
+				feed.Publish(market, 100);
+				THEN("the level pushed out of the best two is deleted, then added back") {
+					REQUIRE(depth.updates == std::vector<DepthUpdate>{
+						{ ABC, Side::Sell, LevelAction::Add, { 10002, 3, 1 } },
+						{ ABC, Side::Sell, LevelAction::Delete, { 10003, 7, 1 } },
+						{ ABC, Side::Sell, LevelAction::Delete, { 10002, 3, 1 } },
+						{ ABC, Side::Sell, LevelAction::Add, { 10003, 7, 1 } },
+					});
+				}
+			}
+			AND_WHEN("an aggressor sweeps the first level and rests its remainder") {
+				depth.updates.clear();
+				buy(10001, 20);
+				THEN("the swept level is deleted, and the remainder's level added") {
+					REQUIRE(depth.updates == std::vector<DepthUpdate>{
+						{ ABC, Side::Buy, LevelAction::Add, { 10001, 5, 1 } },
+						{ ABC, Side::Sell, LevelAction::Delete, { 10001, 15, 2 } },
+					});
+				}
+			}
+		}
+		WHEN("an order that changes nothing is entered") {
+			depth.updates.clear();
+			Order kill_order = order_maker.MakeOrder(10001, 11);
+			market.Buy(ABC, kill_order, TimeInForce::FillOrKill);
+			feed.Publish(market, kill_order.key.timestamp);
+			THEN("nothing is published") {
+				REQUIRE(depth.updates.empty());
+				REQUIRE(feed.PendingCount() == 0);
+			}
+		}
+	}
+	GIVEN("a market with a depth feed conflating each instrument's changes for 10 timestamps") {
+		GreedyFillAllocator fill_allocator;
+		TradeEventAccumulator trade_event_accumulator;
+		DepthUpdateRecorder depth;
+		DepthFeed<2, DepthUpdateRecorder> feed(depth, 10);
+		Market<FifoPriority, GreedyFillAllocator, TradeEventAccumulator, ArrayLadder<>, DepthFeed<2, DepthUpdateRecorder>> market(fill_allocator, trade_event_accumulator, feed);
+		const auto sell = [&](const Instrument instrument, const Id id, const Price price, const Quantity quantity, const TimeStamp timestamp) {
+			Order order = { price, quantity, { id, timestamp } };
+			market.Sell(instrument, order);
+			feed.Publish(market, timestamp);
+		};
+		sell(ABC, 1, 10001, 10, 1);
+		THEN("the first change of an instrument is published at once") {
+			REQUIRE(depth.updates == std::vector<DepthUpdate>{ { ABC, Side::Sell, LevelAction::Add, { 10001, 10, 1 } } });
+		}
+		WHEN("a burst of changes to the same instrument comes within the window, and another instrument changes") {
+			depth.updates.clear();
+			sell(ABC, 2, 10001, 5, 2);
+			sell(ABC, 3, 10001, 5, 3);
+			sell(ABC, 4, 10002, 1, 4);
+			market.Cancel(4);
+			market.Amend(1, 10001, 4, 5);
+			feed.Publish(market, 5);
+			sell(DEF, 5, 20001, 1, 6);
+			THEN("only the other instrument is published") {
+				REQUIRE(depth.updates == std::vector<DepthUpdate>{ { DEF, Side::Sell, LevelAction::Add, { 20001, 1, 1 } } });
+				REQUIRE(feed.PendingCount() == 1);
+			}
+			AND_WHEN("the window has passed") {
+				depth.updates.clear();
+				feed.Publish(market, 11);
+				THEN("the burst is published as one update of the level as it is by then") {
+					REQUIRE(depth.updates == std::vector<DepthUpdate>{ { ABC, Side::Sell, LevelAction::Modify, { 10001, 14, 3 } } });
+					REQUIRE(feed.PendingCount() == 0);
+				}
+			}
+			AND_WHEN("the feed is flushed before the window has passed") {
+				depth.updates.clear();
+				feed.Flush(market, 7);
+				THEN("the burst is published all the same") {
+					REQUIRE(depth.updates == std::vector<DepthUpdate>{ { ABC, Side::Sell, LevelAction::Modify, { 10001, 14, 3 } } });
+				}
+			}
+		}
+	}
+	GIVEN("a long order flow of every kind of message") {
+		WHEN("every change is published") {
+			THEN("a consumer applying the updates always has the market's best levels") {
+				RequireDepthFeedRebuildsTheBook<FifoPriority, ArrayLadder<16>>(0);
+			}
+		}
+		WHEN("changes are conflated") {
+			THEN("a consumer applying the updates has the market's best levels once they are flushed") {
+				RequireDepthFeedRebuildsTheBook<PriorityKey::TimeStampComparator, MapLadder>(50);
+			}
+		}
+	}
+}
+
+SCENARIO("A depth feed behind the matcher of a pipeline publishes what it would on a single market", "[pipeline][depth]") {
+	GIVEN("a synthetic order flow with amends mixed in") {
+		constexpr std::size_t kLevels = 5;
+		OrderFlowParams params;
+		params.instruments = 4;
+		params.aggressor_ratio = 0.3;
+		OrderFlowGenerator generator(params);
+		Lcg lcg;
+		std::vector<OrderMessage> messages(20000);
+		for (auto& message : messages) {
+			generator.Next(message);
+			if ((OrderAction::Cancel == message.action) && (0 == lcg.Next(2))) {
+				message.action = OrderAction::Amend;
+				message.order.quantity = lcg.Next(20);
+				message.order.price = params.start_price - 5 + lcg.Next(10);
+			}
+		}
+
+		InstrumentTradeRecorder single_trades;
+		DepthUpdateRecorder single_depth;
+		{
+			DepthFeed<kLevels, DepthUpdateRecorder> feed(single_depth);
+			GreedyFillAllocator fill_allocator;
+			Market<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>, DepthFeed<kLevels, DepthUpdateRecorder>> market(fill_allocator, single_trades, feed);
+			for (auto message : messages) {
+				ProcessOrderMessage(market, single_trades, message);
+				feed.Publish(market, message.order.key.timestamp);
+			}
+		}
+		REQUIRE(single_depth.updates.size() > 1000);
+
+		WHEN("the flow is matched in a pipeline with a depth feed as its market data consumer") {
+			using Pipeline = PipelinedMarket<FifoPriority, GreedyFillAllocator, InstrumentTradeRecorder, ArrayLadder<>>;
+			static_assert(Pipeline::kMarketDataLevels == kLevels);
+			struct DepthFeedConsumer {
+				DepthUpdateRecorder depth;
+				BestLevelsMirror<kLevels> mirror;
+				DepthFeed<kLevels, DepthUpdateRecorder> feed{ depth };
+				void operator()(const OrderMessage& message, const NewNames&, const Pipeline::MarketDataLevels* levels, const std::uint64_t, const bool) {
+					if (levels) {
+						mirror.Update(*levels);
+						feed.HandleBookChange(levels->instrument);
+					}
+					feed.Publish(mirror, message.order.key.timestamp);
+				}
+			} consumer;
+			InstrumentTradeRecorder pipelined_trades;
+			NameTables output_names;
+			{
+				Pipeline market(pipelined_trades, output_names);
+				REQUIRE(market.AddMarketDataConsumer(consumer));
+				market.Start(false);
+				for (const auto& message : messages) {
+					market.Submit(message, {});
+				}
+				market.Finish();
+			}
+
+			THEN("the depth updates are identical") {
+				REQUIRE(pipelined_trades.trades == single_trades.trades);
+				REQUIRE(consumer.depth.updates == single_depth.updates);
+				REQUIRE(consumer.depth.misfits == 0);
+			}
+		}
+	}
+}